@@ -0,0 +1,180 @@
+#pragma once
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Minimal printf formatter with a per char output callback, so text is
+ * produced right where it goes (i.e. into a ring) without a buffer.
+ *
+ * Flags '-' and '0', width (also *), precision for %s, h/l/z modifiers,
+ * conversions d i u x X p c s %. Numbers are 32 bit, no floats, no ll.
+ * Unknown conversions are put as is.
+ */
+
+/* NULL put only counts */
+typedef void (*av_fmt_put_t)(void *ctx, char ch);
+
+static inline int av_fmt_rep(av_fmt_put_t put, void *ctx, char ch, int n)
+{
+    int i;
+
+    for (i = 0; put && i < n; i++) {
+        put(ctx, ch);
+    }
+    return n > 0 ? n : 0;
+}
+
+/* Returns number of chars put */
+static inline int av_vfmt(av_fmt_put_t put, void *ctx, const char *fmt, va_list ap)
+{
+    char num[10];                   /* Digits of a 32 bit number, reversed */
+    const char *str;
+    const char *prefix;
+    uint32_t val;
+    int len = 0;
+    int left, zero, lng, width, prec, slen, nlen, pad;
+    char ch;
+
+    while ((ch = *fmt++) != 0) {
+        if (ch != '%') {
+            len += av_fmt_rep(put, ctx, ch, 1);
+            continue;
+        }
+
+        left = zero = lng = 0;
+        width = 0;
+        prec = -1;
+
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                left = 1;
+            } else if (*fmt == '0') {
+                zero = 1;
+            } else {
+                break;
+            }
+        }
+
+        if (*fmt == '*') {
+            width = va_arg(ap, int);
+            if (width < 0) {
+                left = 1;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+
+        if (*fmt == '.') {
+            prec = 0;
+            while (*++fmt >= '0' && *fmt <= '9') {
+                prec = prec * 10 + (*fmt - '0');
+            }
+        }
+
+        for (; *fmt == 'l' || *fmt == 'h' || *fmt == 'z'; fmt++) {
+            lng |= (*fmt == 'l');
+        }
+
+        ch = *fmt;
+        if (!ch) {
+            break;
+        }
+        fmt++;
+
+        prefix = "";
+        switch (ch) {
+        case 'd':
+        case 'i':
+            val = lng ? (uint32_t)va_arg(ap, long) : (uint32_t)va_arg(ap, int);
+            if ((int32_t)val < 0) {
+                prefix = "-";
+                val = 0U - val;
+            }
+            break;
+
+        case 'u':
+        case 'x':
+        case 'X':
+            val = lng ? (uint32_t)va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            break;
+
+        case 'p':
+            val = (uint32_t)(uintptr_t)va_arg(ap, void *);
+            prefix = "0x";
+            break;
+
+        case 'c':
+            num[0] = (char)va_arg(ap, int);
+            str = num;
+            slen = 1;
+            goto put_str;
+
+        case 's':
+            str = va_arg(ap, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            for (slen = 0; str[slen] && (prec < 0 || slen < prec); slen++) {
+            }
+            goto put_str;
+
+        default:
+            /* %% and unknown ones */
+            if (ch != '%') {
+                len += av_fmt_rep(put, ctx, '%', 1);
+            }
+            len += av_fmt_rep(put, ctx, ch, 1);
+            continue;
+        }
+
+        /* Number */
+        nlen = 0;
+        do {
+            if (ch == 'd' || ch == 'i' || ch == 'u') {
+                num[nlen++] = (char)('0' + val % 10U);
+                val /= 10U;
+            } else {
+                num[nlen++] = "0123456789abcdef0123456789ABCDEF"[(val & 0xFU) + (ch == 'X' ? 16 : 0)];
+                val >>= 4;
+            }
+        } while (val);
+
+        pad = width - nlen - (int)strlen(prefix);
+        if (!left && !zero) {
+            len += av_fmt_rep(put, ctx, ' ', pad);
+        }
+        for (str = prefix; *str; str++) {
+            len += av_fmt_rep(put, ctx, *str, 1);
+        }
+        if (!left && zero) {
+            len += av_fmt_rep(put, ctx, '0', pad);
+        }
+        while (nlen) {
+            len += av_fmt_rep(put, ctx, num[--nlen], 1);
+        }
+        if (left) {
+            len += av_fmt_rep(put, ctx, ' ', pad);
+        }
+        continue;
+
+put_str:
+        pad = width - slen;
+        if (!left) {
+            len += av_fmt_rep(put, ctx, ' ', pad);
+        }
+        while (slen--) {
+            len += av_fmt_rep(put, ctx, *str++, 1);
+        }
+        if (left) {
+            len += av_fmt_rep(put, ctx, ' ', pad);
+        }
+    }
+
+    return len;
+}
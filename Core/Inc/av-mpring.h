@@ -0,0 +1,103 @@
+#pragma once
+#include "av-ring.h"
+
+/*
+ * Multiple producer / single consumer byte ring on top of av_ring_t.
+ *
+ * Producers in any context reserve space, fill it and commit. Interrupts
+ * are disabled for the index update only, not for the copy.
+ * Reservations nest like the contexts making them (an ISR preempts the
+ * main loop, but not vice versa), thus data are published to the consumer
+ * once no reservation is pending, i.e. upon the outermost commit.
+ * Consumer uses av_ring_t consumer API on .ring.
+ *
+ * Producer:  av_mpring_reserve() -> av_mpring_copy() -> av_mpring_commit()
+ */
+
+/* Might be called with interrupts disabled already, so PRIMASK is restored */
+#ifndef AV_MPRING_LOCK
+#include "cmsis_compiler.h"
+#define AV_MPRING_LOCK(_key)    do { (_key) = __get_PRIMASK(); __disable_irq(); } while (0)
+#define AV_MPRING_UNLOCK(_key)  __set_PRIMASK(_key)
+#endif
+
+typedef struct av_mpring_s {
+    av_ring_t ring;                 /* wr_idx is the published end */
+    uint32_t res_idx;               /* Reserved end, free running */
+    uint32_t pending;               /* Reservations not committed yet */
+
+    /* Reservations failed for lack of space */
+    uint32_t drop_cnt;
+    uint32_t drop_bytes;
+} av_mpring_t;
+
+static inline void av_mpring_init(av_mpring_t *r, uint8_t *buff, uint32_t size)
+{
+    av_ring_init(&r->ring, buff, size);
+    r->res_idx = 0;
+    r->pending = 0;
+    r->drop_cnt = 0;
+    r->drop_bytes = 0;
+}
+
+/* Any context. Returns 0 and the ring index to write at, or -1 if len
+ * bytes don't fit. The message is dropped and counted then. */
+static inline int av_mpring_reserve(av_mpring_t *r, uint32_t len, uint32_t *idx)
+{
+    uint32_t key;
+    int rc = -1;
+
+    AV_MPRING_LOCK(key);
+    if (r->ring.size - (r->res_idx - r->ring.rd_idx) >= len) {
+        *idx = r->res_idx;
+        r->res_idx += len;
+        r->pending++;
+        rc = 0;
+    } else {
+        r->drop_cnt++;
+        r->drop_bytes += len;
+    }
+    AV_MPRING_UNLOCK(key);
+
+    return rc;
+}
+
+/* Fill reserved space starting at the ring index idx */
+static inline void av_mpring_copy(av_mpring_t *r, uint32_t idx, const void *src, uint32_t len)
+{
+    const uint8_t *src8 = (const uint8_t *)src;
+    uint32_t ofs = idx & r->ring.mask;
+    uint32_t len1 = r->ring.size - ofs;
+
+    if (len1 > len) len1 = len;
+
+    memcpy(&r->ring.buff[ofs], src8, len1);
+    if (len - len1) {
+        memcpy(&r->ring.buff[0], &src8[len1], len - len1);
+    }
+}
+
+static inline void av_mpring_commit(av_mpring_t *r)
+{
+    uint32_t key;
+
+    AV_MPRING_LOCK(key);
+    if (--r->pending == 0) {
+        av_ring_produce(&r->ring, r->res_idx - r->ring.wr_idx);
+    }
+    AV_MPRING_UNLOCK(key);
+}
+
+/* Any context. Whole message or nothing. Returns number of bytes written */
+static inline uint32_t av_mpring_write(av_mpring_t *r, const void *src, uint32_t len)
+{
+    uint32_t idx;
+
+    if (av_mpring_reserve(r, len, &idx)) {
+        return 0;
+    }
+
+    av_mpring_copy(r, idx, src, len);
+    av_mpring_commit(r);
+    return len;
+}
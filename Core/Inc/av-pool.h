@@ -0,0 +1,36 @@
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Static memory pool. Buffers are carved at init and never freed,
+ * so their sizes might be decided at run time within a fixed RAM budget.
+ */
+
+#define AV_POOL_ALIGN 4U
+
+typedef struct av_pool_s {
+    uint8_t *buff;
+    uint32_t size;
+    uint32_t used;
+} av_pool_t;
+
+static inline void av_pool_init(av_pool_t *p, void *buff, uint32_t size)
+{
+    p->buff = (uint8_t *)buff;
+    p->size = size;
+    p->used = 0;
+}
+
+/* Returns NULL if the pool is exhausted */
+static inline void *av_pool_alloc(av_pool_t *p, uint32_t size)
+{
+    uint32_t ofs = (p->used + AV_POOL_ALIGN - 1) & ~(AV_POOL_ALIGN - 1);
+
+    if (size > p->size || ofs > p->size - size) {
+        return NULL;
+    }
+
+    p->used = ofs + size;
+    return &p->buff[ofs];
+}
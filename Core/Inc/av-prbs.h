@@ -0,0 +1,83 @@
+#pragma once
+#include <inttypes.h>
+
+/*
+ * PRBS-15 (x^15 + x^14 + 1) byte stream generator and checker.
+ *
+ * LFSR state is the last 15 bits of the stream. Taps are 7+ bits apart
+ * from the input, thus 8 bits are produced at once, MSB first.
+ *
+ * Checker is self-synchronizing: it predicts the next byte from the last
+ * received ones. So it locks after 2 bytes and recovers after lost data
+ * by itself. A single bit error is seen up to 3 times (input and taps).
+ */
+
+#define AV_PRBS_MASK 0x7FFFU
+
+typedef struct av_prbs_s {
+    uint16_t state;
+} av_prbs_t;
+
+typedef struct av_prbs_chk_s {
+    uint16_t state;
+    uint32_t bytes;                 /* Bytes received, including sync ones */
+    uint32_t err_bits;
+    uint32_t err_bytes;
+    uint32_t first_err_ofs;         /* Offset of the first errored byte, ~0 if none */
+} av_prbs_chk_t;
+
+static inline uint8_t av_prbs_step(uint16_t state)
+{
+    return (uint8_t)((state >> 7) ^ (state >> 6));
+}
+
+static inline void av_prbs_init(av_prbs_t *p, uint16_t seed)
+{
+    /* All zeros is a lockup state */
+    p->state = (seed & AV_PRBS_MASK) ? (seed & AV_PRBS_MASK) : 1;
+}
+
+static inline uint8_t av_prbs_next(av_prbs_t *p)
+{
+    uint8_t b = av_prbs_step(p->state);
+    p->state = ((p->state << 8) | b) & AV_PRBS_MASK;
+    return b;
+}
+
+static inline void av_prbs_fill(av_prbs_t *p, uint8_t *buff, uint32_t len)
+{
+    while (len--) {
+        *buff++ = av_prbs_next(p);
+    }
+}
+
+static inline void av_prbs_chk_reset(av_prbs_chk_t *c)
+{
+    c->state = 0;
+    c->bytes = 0;
+    c->err_bits = 0;
+    c->err_bytes = 0;
+    c->first_err_ofs = ~0U;
+}
+
+static inline void av_prbs_check(av_prbs_chk_t *c, const uint8_t *data, uint32_t len)
+{
+    while (len--) {
+        uint8_t b = *data++;
+
+        /* First 2 bytes only load the state */
+        if (c->bytes >= 2) {
+            uint8_t diff = b ^ av_prbs_step(c->state);
+            if (diff) {
+                if (c->err_bytes == 0) {
+                    c->first_err_ofs = c->bytes;
+                }
+                c->err_bytes++;
+                c->err_bits += __builtin_popcount(diff);
+            }
+        }
+
+        c->state = ((c->state << 8) | b) & AV_PRBS_MASK;
+        c->bytes++;
+    }
+}
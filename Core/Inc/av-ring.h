@@ -0,0 +1,176 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+
+/*
+ * Lock-free single producer / single consumer byte ring.
+ *
+ * Indices are free running and masked on buffer access, thus the whole
+ * buffer is usable and fill level is just (wr_idx - rd_idx).
+ * Producer modifies wr_idx only, consumer modifies rd_idx only, so
+ * neither side needs interrupts to be disabled. Buffer size must be
+ * a power of two.
+ *
+ * Producer:  av_ring_wr_span() -> fill data -> av_ring_produce()
+ * Consumer:  av_ring_rd_span() -> use data  -> av_ring_consume()
+ */
+
+/* Orders data access against index publishing.
+ * Single core M0+ doesn't reorder, but a compiler does. */
+#ifndef AV_RING_BARRIER
+#define AV_RING_BARRIER() __sync_synchronize()
+#endif
+
+typedef struct av_ring_s {
+    uint8_t *buff;
+    uint32_t size;
+    uint32_t mask;
+    volatile uint32_t wr_idx;       /* Producer owned, free running */
+    volatile uint32_t rd_idx;       /* Consumer owned, free running */
+
+    /* Instrumentation */
+    uint32_t hwm;                   /* Producer owned. Highest level seen, exceeds size on overflow */
+    uint32_t hi_ms;                 /* av_ring_sample() owned. Time spent above 3/4 full */
+    uint32_t hi_ts;
+    int hi;
+} av_ring_t;
+
+#define AV_RING_IS_POW2(_size) ((_size) != 0 && (((_size) & ((_size) - 1)) == 0))
+
+static inline void av_ring_init(av_ring_t *r, uint8_t *buff, uint32_t size)
+{
+    r->buff = buff;
+    r->size = size;
+    r->mask = size - 1;
+    r->wr_idx = 0;
+    r->rd_idx = 0;
+    r->hwm = 0;
+    r->hi_ms = 0;
+    r->hi_ts = 0;
+    r->hi = 0;
+}
+
+/* Both producer and consumer must be stopped */
+static inline void av_ring_reset(av_ring_t *r)
+{
+    r->wr_idx = 0;
+    r->rd_idx = 0;
+}
+
+/* Both producer and consumer must be stopped, and the ring must be empty.
+ * Move the ring start to the buffer origin, indices keep running */
+static inline void av_ring_rewind(av_ring_t *r)
+{
+    uint32_t idx = (r->wr_idx + r->mask) & ~r->mask;
+
+    r->wr_idx = idx;
+    r->rd_idx = idx;
+}
+
+/* Might exceed ring size, if producer doesn't check for free space (i.e. DMA) */
+static inline uint32_t av_ring_used(const av_ring_t *r)
+{
+    uint32_t wr_idx = r->wr_idx;
+    return wr_idx - r->rd_idx;
+}
+
+static inline uint32_t av_ring_free(const av_ring_t *r)
+{
+    uint32_t used = av_ring_used(r);
+    return used < r->size ? r->size - used : 0;
+}
+
+/*
+ * Producer side
+ */
+
+/* Returns number of contiguous free bytes at *ptr */
+static inline uint32_t av_ring_wr_span(av_ring_t *r, uint8_t **ptr)
+{
+    uint32_t wr_ofs = r->wr_idx & r->mask;
+    uint32_t d_free = av_ring_free(r);
+    uint32_t till_border = r->size - wr_ofs;
+
+    AV_RING_BARRIER();
+
+    *ptr = &r->buff[wr_ofs];
+    return d_free < till_border ? d_free : till_border;
+}
+
+/* Publish len bytes written */
+static inline void av_ring_produce(av_ring_t *r, uint32_t len)
+{
+    uint32_t used;
+
+    AV_RING_BARRIER();
+    r->wr_idx += len;
+
+    used = av_ring_used(r);
+    if (used > r->hwm) {
+        r->hwm = used;
+    }
+}
+
+/* Copy as much as fits. Returns number of bytes written. */
+static inline uint32_t av_ring_write(av_ring_t *r, const void *src, uint32_t len)
+{
+    const uint8_t *src8 = (const uint8_t *)src;
+    uint32_t wr_ofs = r->wr_idx & r->mask;
+    uint32_t d_free = av_ring_free(r);
+    uint32_t len1;
+
+    AV_RING_BARRIER();
+
+    if (len > d_free) len = d_free;
+
+    /* Split write into 2 parts - till border and from the beginning */
+    len1 = r->size - wr_ofs;
+    if (len1 > len) len1 = len;
+
+    memcpy(&r->buff[wr_ofs], src8, len1);
+    if (len - len1) {
+        memcpy(&r->buff[0], &src8[len1], len - len1);
+    }
+
+    av_ring_produce(r, len);
+    return len;
+}
+
+/*
+ * Accumulate time spent above 3/4 full. To be called periodically from
+ * a single context, i.e. the main loop. now is in milliseconds.
+ * Resolution is the call period.
+ */
+static inline void av_ring_sample(av_ring_t *r, uint32_t now)
+{
+    if (r->hi) {
+        r->hi_ms += now - r->hi_ts;
+    }
+
+    r->hi_ts = now;
+    r->hi = av_ring_used(r) > r->size - r->size / 4;
+}
+
+/*
+ * Consumer side
+ */
+
+/* Returns number of contiguous bytes available at *ptr */
+static inline uint32_t av_ring_rd_span(av_ring_t *r, uint8_t **ptr)
+{
+    uint32_t rd_ofs = r->rd_idx & r->mask;
+    uint32_t used = av_ring_used(r);
+    uint32_t till_border = r->size - rd_ofs;
+
+    AV_RING_BARRIER();
+
+    *ptr = &r->buff[rd_ofs];
+    return used < till_border ? used : till_border;
+}
+
+/* Release len bytes back to producer */
+static inline void av_ring_consume(av_ring_t *r, uint32_t len)
+{
+    AV_RING_BARRIER();
+    r->rd_idx += len;
+}
@@ -24,3 +24,4 @@ extern dev0_t g_dev0;
 
 void dev0_init();
 void dev0_on_idle(uint32_t now_tick);
+int dev0_cmd_register(void);
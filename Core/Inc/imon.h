@@ -1,5 +1,19 @@
 #pragma once
 
+/* Streamed sample record, little endian, one per ADC conversion (~220 Hz).
+ * Put into the ictrl console stream, see tools/ictrl_log_decode.py */
+#pragma pack(push, 1)
+typedef struct imon_rec_s {
+	uint8_t magic;				/* ICTRL_IMON_MAGIC */
+	uint8_t len;				/* sizeof(imon_rec_t) */
+	uint16_t seq;				/* Free running, gaps are records dropped */
+	int16_t temp_degc;
+	uint16_t vref;				/* mV */
+	int16_t ts_raw;				/* ADC readings */
+	int16_t vrefint_raw;
+} imon_rec_t;
+#pragma pack(pop)
+
 typedef struct imon_s {
 
 	const int16_t *adc_ts;
@@ -15,6 +29,12 @@ typedef struct imon_s {
 
 	int last_report_tick;
 
+	/* Every sample is streamed, ISR context */
+	volatile int stream;
+	uint16_t stream_seq;
+	uint32_t stream_cnt;
+	uint32_t stream_drop_cnt;	/* Console output ring was full */
+
 } imon_t;
 
 extern imon_t g_imon;
@@ -22,3 +42,4 @@ extern imon_t g_imon;
 void imon_adc_completed();
 void imon_on_idle(uint32_t now_tick);
 void imon_init(int16_t *adc_ts, int16_t *adc_vrefint);
+int imon_cmd_register(void);
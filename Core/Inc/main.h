@@ -68,17 +68,62 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
-
+void BRIDGE2_UART_MspInit(UART_HandleTypeDef *huart);
+void BRIDGE2_UART_MspDeInit(UART_HandleTypeDef *huart);
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
 #define HOST_RST_Pin GPIO_PIN_0
 #define HOST_RST_GPIO_Port GPIOA
+#define BRIDGE2_TX_Pin GPIO_PIN_2
+#define BRIDGE2_TX_GPIO_Port GPIOA
+#define BRIDGE2_RX_Pin GPIO_PIN_3
+#define BRIDGE2_RX_GPIO_Port GPIOA
+#define UART1_DTR_Pin GPIO_PIN_4
+#define UART1_DTR_GPIO_Port GPIOA
+#define UART1_RTS_Pin GPIO_PIN_5
+#define UART1_RTS_GPIO_Port GPIOA
+#define UART1_CTS_Pin GPIO_PIN_6
+#define UART1_CTS_GPIO_Port GPIOA
+#define UART1_DSR_Pin GPIO_PIN_7
+#define UART1_DSR_GPIO_Port GPIOA
 #define LED_RED_Pin GPIO_PIN_0
 #define LED_RED_GPIO_Port GPIOB
 #define LED_GREEN_Pin GPIO_PIN_1
 #define LED_GREEN_GPIO_Port GPIOB
+#define UART1_DCD_Pin GPIO_PIN_8
+#define UART1_DCD_GPIO_Port GPIOA
 /* USER CODE BEGIN Private defines */
+/* UART1_* are USART1 modem lines. Native USART1 RTS/CTS pins are taken
+ * by USB, thus these are GPIO driven. All lines are active low: DTR/RTS
+ * start deasserted, unconnected CTS, DSR and DCD read as asserted. */
+
+/* Second UART bridge. USART2 and LPUART1 share PA2/PA3, and USB has
+ * endpoints for one more CDC function only, thus either of them or none. */
+#define UART_BRIDGE2_NONE       0
+#define UART_BRIDGE2_USART2     1
+#define UART_BRIDGE2_LPUART1    2
+#ifndef UART_BRIDGE2
+#define UART_BRIDGE2            UART_BRIDGE2_USART2
+#endif
+
+#if UART_BRIDGE2 == UART_BRIDGE2_USART2
+#define BRIDGE2_UART_Instance   USART2
+#define BRIDGE2_UART_IRQn       USART2_IRQn
+#define BRIDGE2_UART_IRQHandler USART2_IRQHandler
+#define BRIDGE2_UART_AF         GPIO_AF4_USART2
+#define BRIDGE2_DMA_REQUEST     DMA_REQUEST_4
+#define BRIDGE2_UART_CLK_ENABLE()   __HAL_RCC_USART2_CLK_ENABLE()
+#define BRIDGE2_UART_CLK_DISABLE()  __HAL_RCC_USART2_CLK_DISABLE()
+#elif UART_BRIDGE2 == UART_BRIDGE2_LPUART1
+#define BRIDGE2_UART_Instance   LPUART1
+#define BRIDGE2_UART_IRQn       RNG_LPUART1_IRQn
+#define BRIDGE2_UART_IRQHandler RNG_LPUART1_IRQHandler
+#define BRIDGE2_UART_AF         GPIO_AF6_LPUART1
+#define BRIDGE2_DMA_REQUEST     DMA_REQUEST_5
+#define BRIDGE2_UART_CLK_ENABLE()   __HAL_RCC_LPUART1_CLK_ENABLE()
+#define BRIDGE2_UART_CLK_DISABLE()  __HAL_RCC_LPUART1_CLK_DISABLE()
+#endif
 
 /* USER CODE END Private defines */
 
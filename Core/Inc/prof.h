@@ -0,0 +1,80 @@
+#pragma once
+#include <inttypes.h>
+
+/*
+ * Timing probes. M0+ has no cycle counter, so cycles are taken from
+ * SysTick, see systick.h. Sections are timed inclusive of
+ * interrupts preempting them. "prof" console command reports the table.
+ *
+ *   PROF_BEGIN(ts);
+ *   ...
+ *   PROF_END(PROF_ID_USB_IRQ, ts);
+ *
+ * Everything compiles out unless PROF_ENABLE is set.
+ */
+#ifndef PROF_ENABLE
+#define PROF_ENABLE         0
+#endif
+
+/* id, name */
+#define PROF_LIST(X) \
+    X(USB_IRQ,          "usb irq") \
+    X(USART1_IRQ,       "usart1 irq") \
+    X(USART1_DMA_IRQ,   "usart1 dma irq") \
+    X(BRIDGE2_UART_IRQ, "bridge2 irq") \
+    X(BRIDGE2_DMA_IRQ,  "bridge2 dma irq") \
+    X(ADC_DMA_IRQ,      "adc dma irq") \
+    X(IMON_IDLE,        "imon idle") \
+    X(DEV0_IDLE,        "dev0 idle") \
+    X(UART0_IDLE,       "uart0 idle") /* Per bridge, as the stat groups */ \
+    X(UART1_IDLE,       "uart1 idle") \
+    X(ICTRL_IDLE,       "ictrl idle") \
+    X(MAIN_LOOP,        "main loop")
+
+#define PROF_ID(_id, _name) PROF_ID_##_id,
+enum prof_id {
+    PROF_LIST(PROF_ID)
+    PROF_ID_NUM
+};
+#undef PROF_ID
+
+#if PROF_ENABLE
+
+#include "systick.h"
+
+typedef struct prof_entry_s {
+    uint32_t cnt;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} prof_entry_t;
+
+extern prof_entry_t g_prof[PROF_ID_NUM];
+
+/* Sections are recorded from one context each, no locking */
+static inline void prof_record(enum prof_id id, uint32_t cycles)
+{
+    prof_entry_t *e = &g_prof[id];
+
+    if (!e->cnt || cycles < e->min) {
+        e->min = cycles;
+    }
+    if (cycles > e->max) {
+        e->max = cycles;
+    }
+    e->total += cycles;
+    e->cnt++;
+}
+
+#define PROF_BEGIN(_ts)         uint32_t _ts = systick_cycles()
+#define PROF_END(_id, _ts)      prof_record((_id), systick_cycles() - (_ts))
+
+extern int prof_cmd_register(void);
+
+#else
+
+#define PROF_BEGIN(_ts)
+#define PROF_END(_id, _ts)
+#define prof_cmd_register()     0
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Counter registry. Modules register groups of 32 bit counters kept in
+ * their own contexts, the "stat" console command lists them all.
+ * Counters are free running. One found below its previous reading was
+ * restarted by the owner, the delta is taken from zero then.
+ */
+#define STATS_GROUP_MAX     8
+#define STATS_CNT_MAX       64      /* All groups, readings kept for "stat -d" */
+#define STATS_HOOK_MAX      4
+
+typedef struct stats_desc_s {
+    const char *name;
+    uint16_t ofs;                   /* uint32_t counter offset in the group context */
+} stats_desc_t;
+
+/* Nested fields are fine, i.e. STATS_DESC(cdc_ictrl_t, us.log.drop_cnt) */
+#define STATS_DESC(_type, _field)   { #_field, (uint16_t)offsetof(_type, _field) }
+
+/* Table and context must stay valid. Returns -1 if the registry is full */
+extern int stats_register(const char *name, void *ctx, const stats_desc_t *desc, unsigned int num);
+
+/* Called by "stat reset" after counters are zeroed, main loop. For owners
+ * keeping own readings of the counters. Returns -1 if no room */
+typedef void (*stats_reset_hook_t)(void);
+extern int stats_reset_hook(stats_reset_hook_t hook);
+
+/* Flat access to all counters in registration order, for RPC */
+extern unsigned int stats_total(void);
+extern uint32_t stats_read(unsigned int idx);
+/* Returns -1 if idx is out of range */
+extern int stats_name(unsigned int idx, const char **group, const char **name);
+
+extern int stats_cmd_register(void);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "stm32l0xx_hal.h"
+
+/*
+ * SysTick based clocks. Milliseconds are counted by SysTick interrupt,
+ * the fraction is taken from SysTick counter. Reload not yet counted by
+ * the interrupt (i.e. read from an ISR, or with interrupts disabled) is
+ * checked, so the clocks are monotonic from any context.
+ */
+
+/* Returns cycles per millisecond tick, *ms and *cyc are the tick and
+ * cycles into it */
+static inline uint32_t systick_read(uint32_t *ms, uint32_t *cyc)
+{
+    uint32_t primask = __get_PRIMASK();
+    uint32_t val, load;
+
+    __disable_irq();
+    *ms = HAL_GetTick();
+    val = SysTick->VAL;
+    if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+        (*ms)++;
+        val = SysTick->VAL;
+    }
+    load = SysTick->LOAD;
+    __set_PRIMASK(primask);
+
+    *cyc = load - val;
+    return load + 1U;
+}
+
+/* Free running core cycles, wraps around in 2^32 cycles */
+static inline uint32_t systick_cycles(void)
+{
+    uint32_t ms, cyc;
+    uint32_t load = systick_read(&ms, &cyc);
+
+    return ms * load + cyc;
+}
+
+/* Free running microseconds, wraps around in ~71 minutes */
+static inline uint32_t systick_us(void)
+{
+    uint32_t ms, cyc;
+    uint32_t load = systick_read(&ms, &cyc);
+
+    return ms * 1000U + cyc * 1000U / load;
+}
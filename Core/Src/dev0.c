@@ -29,8 +29,25 @@ void dev0_on_idle (uint32_t now_tick)
 		}
 		if (presc && (imon->temp_degc != INT16_MAX) && g_dev0_dbg == 1){
 			static int cnt = 0;
-			ictrl_printf_nonisr("[%d] %dC, %dmV\r\n",
+			ICTRL_LOG("[%d] %dC, %dmV\r\n",
 					cnt++, imon->temp_degc, imon->vref);
 		}
 	}
 }
+
+/* Periodic IMON print out */
+static int dev0_cmd_imonc(int argc, char *argv[])
+{
+	g_dev0_dbg = 1 - g_dev0_dbg;
+	ictrl_printf("IMON %s\r\n", g_dev0_dbg ? "EN" : "DIS");
+	return 0;
+}
+
+static const ictrl_cmd_t g_dev0_cmds[] = {
+	{ "imonc", "", "Toggle periodic IMON print out", dev0_cmd_imonc },
+};
+
+int dev0_cmd_register(void)
+{
+	return ictrl_cmd_register(g_dev0_cmds, COUNT_OF(g_dev0_cmds));
+}
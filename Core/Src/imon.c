@@ -1,5 +1,7 @@
 #include "main.h"
 #include "imon.h"
+#include "cdc_ictrl.h"
+#include "stats.h"
 
 #define QFACT1	10
 #define QFACT2  (16-QFACT1)
@@ -57,11 +59,37 @@ void imon_init(int16_t *adc_ts, int16_t *adc_vrefint)
 	imon->last_report_tick = HAL_GetTick();
 }
 
+/* ISR context. Whole record or nothing, the host sees drops as seq gaps */
+static void imon_stream_sample(imon_t *imon)
+{
+	imon_rec_t rec;
+
+	imon_convert();
+
+	rec.magic = ICTRL_IMON_MAGIC;
+	rec.len = sizeof(rec);
+	rec.seq = imon->stream_seq++;
+	rec.temp_degc = imon->temp_degc;
+	rec.vref = imon->vref;
+	rec.ts_raw = *imon->adc_ts;
+	rec.vrefint_raw = *imon->adc_vrefint;
+
+	if (ictrl_print_out((const char *)&rec, sizeof(rec))) {
+		imon->stream_cnt++;
+	} else {
+		imon->stream_drop_cnt++;
+	}
+}
+
 /* Note: Called from ISR */
 void imon_adc_completed ()
 {
 	imon_t *imon = &g_imon;
 	imon->adc_ready = 1;
+
+	if (imon->stream) {
+		imon_stream_sample(imon);
+	}
 }
 
 void imon_on_idle (uint32_t now_tick)
@@ -71,10 +99,51 @@ void imon_on_idle (uint32_t now_tick)
 	if (now_tick - its->last_report_tick > 1000 ){
 		its->last_report_tick = now_tick;
 
-		if (its->adc_ready) {
+		/* Samples are converted by the stream then */
+		if (its->adc_ready && !its->stream) {
 			imon_convert(its);
 		}
 	}
 
 }
 
+
+/* imon [stream on|off] */
+static int imon_cmd_imon(int argc, char *argv[])
+{
+	static int cnt = 0;
+	imon_t *imon = &g_imon;
+
+	if (argc == 3 && 0 == strcmp(argv[1], "stream")) {
+		if (0 == strcmp(argv[2], "on")) {
+			imon->stream = 1;
+		} else if (0 == strcmp(argv[2], "off")) {
+			imon->stream = 0;
+		} else {
+			return -1;
+		}
+		ictrl_printf("Stream %s, %lu sent, %lu dropped\r\n",
+				argv[2], imon->stream_cnt, imon->stream_drop_cnt);
+		return 0;
+	} else if (argc != 1) {
+		return -1;
+	}
+
+	ictrl_printf("[%d] %dC, %dmV\r\n", cnt++, imon->temp_degc, imon->vref);
+	return 0;
+}
+
+static const ictrl_cmd_t g_imon_cmds[] = {
+	{ "imon", "[stream on|off]", "Chip temperature and VDDA, binary stream of every sample", imon_cmd_imon },
+};
+
+static const stats_desc_t g_imon_stats[] = {
+	STATS_DESC(imon_t, stream_cnt),
+	STATS_DESC(imon_t, stream_drop_cnt),
+};
+
+int imon_cmd_register(void)
+{
+	return ictrl_cmd_register(g_imon_cmds, COUNT_OF(g_imon_cmds)) ||
+		stats_register("imon", &g_imon, g_imon_stats, COUNT_OF(g_imon_stats));
+}
@@ -27,6 +27,8 @@
 #include "cdc_uart.h"
 #include "cdc_ictrl.h"
 #include "dev0.h"
+#include "stats.h"
+#include "prof.h"
 
 /* USER CODE END Includes */
 
@@ -52,6 +54,7 @@ TIM_HandleTypeDef htim3;
 TIM_HandleTypeDef htim6;
 
 UART_HandleTypeDef huart1;
+DMA_HandleTypeDef hdma_usart1_rx;
 DMA_HandleTypeDef hdma_usart1_tx;
 
 /* USER CODE BEGIN PV */
@@ -60,7 +63,12 @@ int16_t g_adc_samples[ADC_CH_NUM];		/* DMA destination */
 
 //extern USBD_Handle hUsbDevice;
 extern cdc_ictrl_t g_cdc_ictrl;
-extern cdc_uart_t g_cdc_uart1;
+
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+UART_HandleTypeDef huart_bridge2;
+DMA_HandleTypeDef hdma_bridge2_rx;
+DMA_HandleTypeDef hdma_bridge2_tx;
+#endif
 
 /* USER CODE END PV */
 
@@ -73,11 +81,44 @@ static void MX_USART1_UART_Init(void);
 static void MX_TIM3_Init(void);
 static void MX_TIM6_Init(void);
 /* USER CODE BEGIN PFP */
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+static void MX_BRIDGE2_UART_Init(void);
+#endif
 
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+static const cdc_uart_modem_t g_uart1_modem = {
+    .dtr = { UART1_DTR_GPIO_Port, UART1_DTR_Pin },
+    .rts = { UART1_RTS_GPIO_Port, UART1_RTS_Pin },
+    .cts = { UART1_CTS_GPIO_Port, UART1_CTS_Pin },
+    .dsr = { UART1_DSR_GPIO_Port, UART1_DSR_Pin },
+    .dcd = { UART1_DCD_GPIO_Port, UART1_DCD_Pin },
+    .flow_ctrl = CDC_UART_FLOW_CTRL,
+};
+
+/* Per instance buffer sizes. There is no persistent settings storage yet,
+ * so they are set here. Buffers are carved out of g_buff_pool at init,
+ * which is sized for the defaults: a larger ring of one instance has to be
+ * paid with a smaller one elsewhere */
+static const cdc_uart_cfg_t g_cdc_uart_cfg[USBD_CDC_UART_NUM] = {
+    { .us_size = UART_CDC_UPSTREAM_BUFF_SIZE, .ds_size = CDC_UART_DOWN_BUFF_SIZE },
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+    { .us_size = UART_CDC_UPSTREAM_BUFF_SIZE, .ds_size = CDC_UART_DOWN_BUFF_SIZE },
+#endif
+};
+
+#define BUFF_POOL_SIZE \
+    (USBD_CDC_UART_NUM * CDC_UART_POOL_SIZE(UART_CDC_UPSTREAM_BUFF_SIZE, CDC_UART_DOWN_BUFF_SIZE) + \
+     CDC_ICTRL_POOL_SIZE(ICTRL_CDC_UPSTREAM_BUFF_SIZE, CDC_ICTRL_DS_BUFF_SIZE))
+
+static uint32_t g_buff_pool_mem[BUFF_POOL_SIZE / sizeof(uint32_t)];
+static av_pool_t g_buff_pool;
+
+/* Idle handler probe per bridge */
+CTASSERT(PROF_ID_UART0_IDLE + USBD_CDC_UART_NUM <= PROF_ID_ICTRL_IDLE);
+
 void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc)
 {
   /* Prevent unused argument(s) compilation warning */
@@ -125,8 +166,27 @@ int main(void)
   imon_init(&g_adc_samples[1], &g_adc_samples[0]);
 
   /* Link USB Device CDC interface with a corresponding Downface Interface (DFI) */
-  cdc_uart_init(&g_cdc_uart1, &g_cdc0, &huart1);
-  cdc_ictrl_init(&g_cdc1);
+  av_pool_init(&g_buff_pool, g_buff_pool_mem, sizeof(g_buff_pool_mem));
+  if (cdc_uart_init(&g_cdc_uart[0], &g_cdc_bridge[0], &huart1, &g_uart1_modem,
+          &g_buff_pool, &g_cdc_uart_cfg[0])) {
+    Error_Handler();
+  }
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+  MX_BRIDGE2_UART_Init();
+  if (cdc_uart_init(&g_cdc_uart[1], &g_cdc_bridge[1], &huart_bridge2, NULL,
+          &g_buff_pool, &g_cdc_uart_cfg[1])) {
+    Error_Handler();
+  }
+#endif
+  if (cdc_ictrl_init(&g_cdc1, &g_buff_pool, ICTRL_CDC_UPSTREAM_BUFF_SIZE, CDC_ICTRL_DS_BUFF_SIZE)) {
+    Error_Handler();
+  }
+
+  /* Console commands and counters of the modules */
+  if (cdc_uart_cmd_register() || imon_cmd_register() || dev0_cmd_register() ||
+      stats_cmd_register() || usb_device_stats_register() || prof_cmd_register()) {
+    Error_Handler();
+  }
 
   HAL_TIM_Base_Start_IT(&htim6);
 
@@ -141,15 +201,27 @@ int main(void)
   while (1)
   {
     uint32_t now_tick = HAL_GetTick();
+    PROF_BEGIN(ts_loop);
+    PROF_BEGIN(ts_imon);
     imon_on_idle(now_tick);
+    PROF_END(PROF_ID_IMON_IDLE, ts_imon);
+    PROF_BEGIN(ts_dev0);
     dev0_on_idle(now_tick);
-
-    g_cdc_uart1.dfi.on_idle(&g_cdc_uart1.dfi);
+    PROF_END(PROF_ID_DEV0_IDLE, ts_dev0);
+
+    for (int i = 0; i < USBD_CDC_UART_NUM; i++) {
+      PROF_BEGIN(ts_uart);
+      g_cdc_uart[i].dfi.on_idle(&g_cdc_uart[i].dfi);
+      PROF_END(PROF_ID_UART0_IDLE + i, ts_uart);
+    }
+    PROF_BEGIN(ts_ictrl);
     g_cdc_ictrl.dfi.on_idle(&g_cdc_ictrl.dfi);
+    PROF_END(PROF_ID_ICTRL_IDLE, ts_ictrl);
 #if NAVIG
     cdc_uart_dfi_on_idle();
     cdc_ictrl_dfi_on_idle();
 #endif
+    PROF_END(PROF_ID_MAIN_LOOP, ts_loop);
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -419,7 +491,7 @@ static void MX_GPIO_Init(void)
   __HAL_RCC_GPIOB_CLK_ENABLE();
 
   /*Configure GPIO pin Output Level */
-  HAL_GPIO_WritePin(HOST_RST_GPIO_Port, HOST_RST_Pin, GPIO_PIN_SET);
+  HAL_GPIO_WritePin(GPIOA, HOST_RST_Pin|UART1_DTR_Pin|UART1_RTS_Pin, GPIO_PIN_SET);
 
   /*Configure GPIO pin Output Level */
   HAL_GPIO_WritePin(GPIOB, LED_RED_Pin|LED_GREEN_Pin, GPIO_PIN_RESET);
@@ -431,6 +503,25 @@ static void MX_GPIO_Init(void)
   GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
   HAL_GPIO_Init(HOST_RST_GPIO_Port, &GPIO_InitStruct);
 
+  /*Configure GPIO pins : BRIDGE2_TX_Pin BRIDGE2_RX_Pin */
+  GPIO_InitStruct.Pin = BRIDGE2_TX_Pin|BRIDGE2_RX_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_ANALOG;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  /*Configure GPIO pins : UART1_DTR_Pin UART1_RTS_Pin */
+  GPIO_InitStruct.Pin = UART1_DTR_Pin|UART1_RTS_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  /*Configure GPIO pins : UART1_CTS_Pin UART1_DSR_Pin UART1_DCD_Pin */
+  GPIO_InitStruct.Pin = UART1_CTS_Pin|UART1_DSR_Pin|UART1_DCD_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
   /*Configure GPIO pins : LED_RED_Pin LED_GREEN_Pin */
   GPIO_InitStruct.Pin = LED_RED_Pin|LED_GREEN_Pin;
   GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
@@ -441,6 +532,32 @@ static void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 4 */
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+/**
+  * @brief Second UART bridge Initialization Function, USART2 or LPUART1
+  * @param None
+  * @retval None
+  */
+static void MX_BRIDGE2_UART_Init(void)
+{
+  huart_bridge2.Instance = BRIDGE2_UART_Instance;
+  huart_bridge2.Init.BaudRate = 115200;
+  huart_bridge2.Init.WordLength = UART_WORDLENGTH_8B;
+  huart_bridge2.Init.StopBits = UART_STOPBITS_1;
+  huart_bridge2.Init.Parity = UART_PARITY_NONE;
+  huart_bridge2.Init.Mode = UART_MODE_TX_RX;
+  huart_bridge2.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+  huart_bridge2.Init.OverSampling = UART_OVERSAMPLING_16;
+  huart_bridge2.Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
+  huart_bridge2.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
+  /* The instance is unknown to CubeMX, HAL_UART_MspInit() skips it */
+  BRIDGE2_UART_MspInit(&huart_bridge2);
+  if (HAL_UART_Init(&huart_bridge2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
+#endif
 
 /* USER CODE END 4 */
 
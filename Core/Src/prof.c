@@ -0,0 +1,87 @@
+#include <string.h>
+#include "prof.h"
+
+#if PROF_ENABLE
+
+#include "cdc_ictrl.h"
+#include "av-generic.h"
+
+#define PROF_LINE_MAX   64      /* Output room checked before each entry */
+
+prof_entry_t g_prof[PROF_ID_NUM];
+
+#define PROF_NAME(_id, _name) _name,
+static const char *g_prof_names[PROF_ID_NUM] = {
+    PROF_LIST(PROF_NAME)
+};
+#undef PROF_NAME
+
+/* ISRs record at any time, so the entry is copied at once */
+static void prof_read(enum prof_id id, prof_entry_t *e)
+{
+    __disable_irq();
+    *e = g_prof[id];
+    __enable_irq();
+}
+
+static void prof_reset(void)
+{
+    __disable_irq();
+    memset(g_prof, 0, sizeof(g_prof));
+    __enable_irq();
+}
+
+/* prof [reset] - count, min, max and average cycles per section.
+ * Table takes more passes, the output ring doesn't hold it at once */
+static int prof_cmd_prof(int argc, char *argv[])
+{
+    static unsigned int idx;
+    prof_entry_t e;
+    uint32_t t0, t1;
+
+    if (ictrl_cmd_pass() == 0) {
+        if (argc == 2 && 0 == strcmp(argv[1], "reset")) {
+            prof_reset();
+            ictrl_printf("Probes reset\r\n");
+            return 0;
+        } else if (argc != 1) {
+            return -1;
+        }
+
+        /* Back to back reading, included in every section */
+        t0 = systick_cycles();
+        t1 = systick_cycles();
+
+        ictrl_printf("Cycles at %lu MHz, probe overhead %lu\r\n",
+                SystemCoreClock / 1000000U, t1 - t0);
+        ictrl_printf("%-16s %8s %7s %7s %7s\r\n", "section", "count", "min", "max", "avg");
+        idx = 0;
+    }
+
+    for (; idx < PROF_ID_NUM; idx++) {
+        if (ictrl_out_free() < 2 * PROF_LINE_MAX) {
+            return ICTRL_CMD_MORE;
+        }
+
+        prof_read((enum prof_id)idx, &e);
+        if (!e.cnt) {
+            continue;
+        }
+
+        ictrl_printf("%-16s %8lu %7lu %7lu %7lu\r\n", g_prof_names[idx],
+                e.cnt, e.min, e.max, (uint32_t)(e.total / e.cnt));
+    }
+
+    return 0;
+}
+
+static const ictrl_cmd_t g_prof_cmds[] = {
+    { "prof", "[reset]", "Timing probes, cycles per section", prof_cmd_prof },
+};
+
+int prof_cmd_register(void)
+{
+    return ictrl_cmd_register(g_prof_cmds, COUNT_OF(g_prof_cmds));
+}
+
+#endif
@@ -0,0 +1,231 @@
+#include <string.h>
+#include "main.h"
+#include "stats.h"
+#include "cdc_ictrl.h"
+#include "av-generic.h"
+
+#define STATS_LINE_MAX  64      /* Output room checked before each counter */
+
+typedef struct stats_group_s {
+    const char *name;
+    uint8_t *ctx;
+    const stats_desc_t *desc;
+    unsigned int num;
+    uint32_t *last;             /* Readings at the previous "stat -d" */
+} stats_group_t;
+
+enum stats_mode {
+    STATS_MODE_VALUE,           /* stat */
+    STATS_MODE_DELTA,           /* stat -d */
+    STATS_MODE_MACHINE,         /* stat -m */
+};
+
+static stats_group_t g_stats_groups[STATS_GROUP_MAX];
+static unsigned int g_stats_group_num;
+
+static uint32_t g_stats_last[STATS_CNT_MAX];
+static unsigned int g_stats_cnt_num;
+static uint32_t g_stats_last_ms;        /* Time of the previous "stat -d" or reset */
+
+static stats_reset_hook_t g_stats_hooks[STATS_HOOK_MAX];
+static unsigned int g_stats_hook_num;
+
+int stats_register(const char *name, void *ctx, const stats_desc_t *desc, unsigned int num)
+{
+    stats_group_t *grp;
+
+    if (g_stats_group_num >= STATS_GROUP_MAX || num > STATS_CNT_MAX - g_stats_cnt_num) {
+        return -1;
+    }
+
+    grp = &g_stats_groups[g_stats_group_num++];
+    grp->name = name;
+    grp->ctx = (uint8_t *)ctx;
+    grp->desc = desc;
+    grp->num = num;
+    grp->last = &g_stats_last[g_stats_cnt_num];
+    g_stats_cnt_num += num;
+    return 0;
+}
+
+static inline volatile uint32_t *stats_cnt(const stats_group_t *grp, unsigned int i)
+{
+    return (volatile uint32_t *)(grp->ctx + grp->desc[i].ofs);
+}
+
+int stats_reset_hook(stats_reset_hook_t hook)
+{
+    if (g_stats_hook_num >= STATS_HOOK_MAX) {
+        return -1;
+    }
+
+    g_stats_hooks[g_stats_hook_num++] = hook;
+    return 0;
+}
+
+/* Group of the flat counter index, NULL if out of range */
+static const stats_group_t *stats_find(unsigned int *idx)
+{
+    unsigned int g;
+
+    for (g = 0; g < g_stats_group_num; g++) {
+        if (*idx < g_stats_groups[g].num) {
+            return &g_stats_groups[g];
+        }
+        *idx -= g_stats_groups[g].num;
+    }
+
+    return NULL;
+}
+
+unsigned int stats_total(void)
+{
+    return g_stats_cnt_num;
+}
+
+uint32_t stats_read(unsigned int idx)
+{
+    const stats_group_t *grp = stats_find(&idx);
+
+    return grp ? *stats_cnt(grp, idx) : 0;
+}
+
+int stats_name(unsigned int idx, const char **group, const char **name)
+{
+    const stats_group_t *grp = stats_find(&idx);
+
+    if (!grp) {
+        return -1;
+    }
+
+    *group = grp->name;
+    *name = grp->desc[idx].name;
+    return 0;
+}
+
+/* Owners update counters in ISRs, so they are cleared at once */
+static void stats_reset(void)
+{
+    unsigned int g, i;
+
+    __disable_irq();
+    for (g = 0; g < g_stats_group_num; g++) {
+        for (i = 0; i < g_stats_groups[g].num; i++) {
+            *stats_cnt(&g_stats_groups[g], i) = 0;
+        }
+    }
+    __enable_irq();
+
+    memset(g_stats_last, 0, sizeof(g_stats_last));
+    g_stats_last_ms = HAL_GetTick();
+
+    for (i = 0; i < g_stats_hook_num; i++) {
+        g_stats_hooks[i]();
+    }
+}
+
+/*****************************************************************************
+ * Console commands
+ *
+ *****************************************************************************/
+
+/* Listing takes more passes, the output ring doesn't hold it at once */
+static struct {
+    enum stats_mode mode;
+    unsigned int group;
+    unsigned int cnt;
+    uint32_t dt_ms;
+} g_stats_list;
+
+static void stats_cmd_print(const stats_group_t *grp, unsigned int i)
+{
+    uint32_t val = *stats_cnt(grp, i);
+    uint32_t delta;
+
+    switch (g_stats_list.mode) {
+    case STATS_MODE_VALUE:
+        ictrl_printf("  %-24s %10lu\r\n", grp->desc[i].name, val);
+        break;
+
+    case STATS_MODE_DELTA:
+        delta = val >= grp->last[i] ? val - grp->last[i] : val;
+        grp->last[i] = val;
+        ictrl_printf("  %-24s %10lu +%lu %lu/s\r\n", grp->desc[i].name, val, delta,
+                g_stats_list.dt_ms ? (uint32_t)((uint64_t)delta * 1000U / g_stats_list.dt_ms) : 0);
+        break;
+
+    case STATS_MODE_MACHINE:
+        ictrl_printf("%s.%s=%lu\r\n", grp->name, grp->desc[i].name, val);
+        break;
+    }
+}
+
+/* stat [-d|-m|reset]
+ * -d adds deltas and per second rates since the previous "stat -d",
+ * -m prints "group.counter=value" lines, preceded by "ts_ms=<tick>" */
+static int stats_cmd_stat(int argc, char *argv[])
+{
+    const stats_group_t *grp;
+    uint32_t now;
+
+    if (ictrl_cmd_pass() == 0) {
+        if (argc > 2) {
+            return -1;
+        }
+
+        now = HAL_GetTick();
+        g_stats_list.mode = STATS_MODE_VALUE;
+
+        if (argc == 2) {
+            if (0 == strcmp(argv[1], "reset")) {
+                stats_reset();
+                ictrl_printf("Counters reset\r\n");
+                return 0;
+            } else if (0 == strcmp(argv[1], "-d")) {
+                g_stats_list.mode = STATS_MODE_DELTA;
+                g_stats_list.dt_ms = now - g_stats_last_ms;
+                g_stats_last_ms = now;
+                ictrl_printf("%lu ms since the previous reading\r\n", g_stats_list.dt_ms);
+            } else if (0 == strcmp(argv[1], "-m")) {
+                g_stats_list.mode = STATS_MODE_MACHINE;
+                ictrl_printf("ts_ms=%lu\r\n", now);
+            } else {
+                return -1;
+            }
+        }
+
+        g_stats_list.group = 0;
+        g_stats_list.cnt = 0;
+    }
+
+    while (g_stats_list.group < g_stats_group_num) {
+        if (ictrl_out_free() < 2 * STATS_LINE_MAX) {
+            return ICTRL_CMD_MORE;
+        }
+
+        grp = &g_stats_groups[g_stats_list.group];
+        if (g_stats_list.cnt == 0 && g_stats_list.mode != STATS_MODE_MACHINE) {
+            ictrl_printf("%s\r\n", grp->name);
+        }
+
+        if (g_stats_list.cnt < grp->num) {
+            stats_cmd_print(grp, g_stats_list.cnt++);
+        }
+
+        if (g_stats_list.cnt >= grp->num) {
+            g_stats_list.group++;
+            g_stats_list.cnt = 0;
+        }
+    }
+
+    return 0;
+}
+
+static const ictrl_cmd_t g_stats_cmds[] = {
+    { "stat", "[-d|-m|reset]", "Counters, -d with deltas and rates, -m for scripts", stats_cmd_stat },
+};
+
+int stats_cmd_register(void)
+{
+    return ictrl_cmd_register(g_stats_cmds, COUNT_OF(g_stats_cmds));
+}
@@ -25,6 +25,8 @@
 /* USER CODE END Includes */
 extern DMA_HandleTypeDef hdma_adc;
 
+extern DMA_HandleTypeDef hdma_usart1_rx;
+
 extern DMA_HandleTypeDef hdma_usart1_tx;
 
 /* Private typedef -----------------------------------------------------------*/
@@ -44,6 +46,10 @@ extern DMA_HandleTypeDef hdma_usart1_tx;
 
 /* Private variables ---------------------------------------------------------*/
 /* USER CODE BEGIN PV */
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+extern DMA_HandleTypeDef hdma_bridge2_rx;
+extern DMA_HandleTypeDef hdma_bridge2_tx;
+#endif
 
 /* USER CODE END PV */
 
@@ -259,6 +265,23 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
     /* USART1 DMA Init */
+    /* USART1_RX Init */
+    hdma_usart1_rx.Instance = DMA1_Channel3;
+    hdma_usart1_rx.Init.Request = DMA_REQUEST_3;
+    hdma_usart1_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart1_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart1_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart1_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    if (HAL_DMA_Init(&hdma_usart1_rx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    __HAL_LINKDMA(huart,hdmarx,hdma_usart1_rx);
+
     /* USART1_TX Init */
     hdma_usart1_tx.Instance = DMA1_Channel2;
     hdma_usart1_tx.Init.Request = DMA_REQUEST_3;
@@ -309,6 +332,7 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
     HAL_GPIO_DeInit(GPIOA, GPIO_PIN_9|GPIO_PIN_10);
 
     /* USART1 DMA DeInit */
+    HAL_DMA_DeInit(huart->hdmarx);
     HAL_DMA_DeInit(huart->hdmatx);
 
     /* USART1 interrupt DeInit */
@@ -321,6 +345,93 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
 }
 
 /* USER CODE BEGIN 1 */
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+/**
+* @brief Second UART bridge MSP Initialization, USART2 or LPUART1
+* Both are served by DMA1 channels 6 (RX) and 7 (TX)
+* @param huart: UART handle pointer
+* @retval None
+*/
+void BRIDGE2_UART_MspInit(UART_HandleTypeDef *huart)
+{
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+  /* Peripheral clock enable */
+  BRIDGE2_UART_CLK_ENABLE();
+
+  __HAL_RCC_GPIOA_CLK_ENABLE();
+  /**USART2 or LPUART1 GPIO Configuration
+  PA2     ------> TX
+  PA3     ------> RX
+  */
+  GPIO_InitStruct.Pin = BRIDGE2_TX_Pin|BRIDGE2_RX_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+  GPIO_InitStruct.Alternate = BRIDGE2_UART_AF;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  /* RX Init */
+  hdma_bridge2_rx.Instance = DMA1_Channel6;
+  hdma_bridge2_rx.Init.Request = BRIDGE2_DMA_REQUEST;
+  hdma_bridge2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  hdma_bridge2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_bridge2_rx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_bridge2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_bridge2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_bridge2_rx.Init.Mode = DMA_CIRCULAR;
+  hdma_bridge2_rx.Init.Priority = DMA_PRIORITY_HIGH;
+  if (HAL_DMA_Init(&hdma_bridge2_rx) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  __HAL_LINKDMA(huart,hdmarx,hdma_bridge2_rx);
+
+  /* TX Init */
+  hdma_bridge2_tx.Instance = DMA1_Channel7;
+  hdma_bridge2_tx.Init.Request = BRIDGE2_DMA_REQUEST;
+  hdma_bridge2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma_bridge2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_bridge2_tx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_bridge2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_bridge2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_bridge2_tx.Init.Mode = DMA_NORMAL;
+  hdma_bridge2_tx.Init.Priority = DMA_PRIORITY_LOW;
+  if (HAL_DMA_Init(&hdma_bridge2_tx) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  __HAL_LINKDMA(huart,hdmatx,hdma_bridge2_tx);
+
+  /* DMA and UART interrupt Init */
+  HAL_NVIC_SetPriority(DMA1_Channel4_5_6_7_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel4_5_6_7_IRQn);
+  HAL_NVIC_SetPriority(BRIDGE2_UART_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(BRIDGE2_UART_IRQn);
+}
+
+/**
+* @brief Second UART bridge MSP De-Initialization
+* Counterpart of BRIDGE2_UART_MspInit(), call it after HAL_UART_DeInit()
+* @param huart: UART handle pointer
+* @retval None
+*/
+void BRIDGE2_UART_MspDeInit(UART_HandleTypeDef *huart)
+{
+  /* Peripheral clock disable */
+  BRIDGE2_UART_CLK_DISABLE();
+
+  HAL_GPIO_DeInit(GPIOA, BRIDGE2_TX_Pin|BRIDGE2_RX_Pin);
+
+  HAL_DMA_DeInit(huart->hdmarx);
+  HAL_DMA_DeInit(huart->hdmatx);
+
+  HAL_NVIC_DisableIRQ(DMA1_Channel4_5_6_7_IRQn);
+  HAL_NVIC_DisableIRQ(BRIDGE2_UART_IRQn);
+}
+#endif
 
 /* USER CODE END 1 */
 
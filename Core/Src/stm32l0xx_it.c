@@ -22,6 +22,8 @@
 #include "stm32l0xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "cdc_uart.h"
+#include "prof.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -60,9 +62,15 @@ extern DMA_HandleTypeDef hdma_adc;
 extern ADC_HandleTypeDef hadc;
 extern TIM_HandleTypeDef htim3;
 extern TIM_HandleTypeDef htim6;
+extern DMA_HandleTypeDef hdma_usart1_rx;
 extern DMA_HandleTypeDef hdma_usart1_tx;
 extern UART_HandleTypeDef huart1;
 /* USER CODE BEGIN EV */
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+extern DMA_HandleTypeDef hdma_bridge2_rx;
+extern DMA_HandleTypeDef hdma_bridge2_tx;
+extern UART_HandleTypeDef huart_bridge2;
+#endif
 
 /* USER CODE END EV */
 
@@ -152,11 +160,11 @@ void SysTick_Handler(void)
 void DMA1_Channel1_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Channel1_IRQn 0 */
-
+  PROF_BEGIN(ts);
   /* USER CODE END DMA1_Channel1_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_adc);
   /* USER CODE BEGIN DMA1_Channel1_IRQn 1 */
-
+  PROF_END(PROF_ID_ADC_DMA_IRQ, ts);
   /* USER CODE END DMA1_Channel1_IRQn 1 */
 }
 
@@ -166,11 +174,12 @@ void DMA1_Channel1_IRQHandler(void)
 void DMA1_Channel2_3_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Channel2_3_IRQn 0 */
-
+  PROF_BEGIN(ts);
   /* USER CODE END DMA1_Channel2_3_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_usart1_tx);
+  HAL_DMA_IRQHandler(&hdma_usart1_rx);
   /* USER CODE BEGIN DMA1_Channel2_3_IRQn 1 */
-
+  PROF_END(PROF_ID_USART1_DMA_IRQ, ts);
   /* USER CODE END DMA1_Channel2_3_IRQn 1 */
 }
 
@@ -225,11 +234,12 @@ void TIM6_DAC_IRQHandler(void)
 void USART1_IRQHandler(void)
 {
   /* USER CODE BEGIN USART1_IRQn 0 */
-
+  PROF_BEGIN(ts);
+  cdc_uart_irq_hook(&huart1);
   /* USER CODE END USART1_IRQn 0 */
   HAL_UART_IRQHandler(&huart1);
   /* USER CODE BEGIN USART1_IRQn 1 */
-
+  PROF_END(PROF_ID_USART1_IRQ, ts);
   /* USER CODE END USART1_IRQn 1 */
 }
 
@@ -239,15 +249,38 @@ void USART1_IRQHandler(void)
 void USB_IRQHandler(void)
 {
   /* USER CODE BEGIN USB_IRQn 0 */
-
+  PROF_BEGIN(ts);
   /* USER CODE END USB_IRQn 0 */
   HAL_PCD_IRQHandler(&hpcd_USB);
   /* USER CODE BEGIN USB_IRQn 1 */
-
+  PROF_END(PROF_ID_USB_IRQ, ts);
   /* USER CODE END USB_IRQn 1 */
 }
 
 /* USER CODE BEGIN 1 */
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+/**
+  * @brief This function handles DMA1 channel 4, 5, 6 and 7 interrupts.
+  */
+void DMA1_Channel4_5_6_7_IRQHandler(void)
+{
+  PROF_BEGIN(ts);
+  HAL_DMA_IRQHandler(&hdma_bridge2_rx);
+  HAL_DMA_IRQHandler(&hdma_bridge2_tx);
+  PROF_END(PROF_ID_BRIDGE2_DMA_IRQ, ts);
+}
+
+/**
+  * @brief This function handles the second UART bridge interrupt, USART2 or LPUART1.
+  */
+void BRIDGE2_UART_IRQHandler(void)
+{
+  PROF_BEGIN(ts);
+  cdc_uart_irq_hook(&huart_bridge2);
+  HAL_UART_IRQHandler(&huart_bridge2);
+  PROF_END(PROF_ID_BRIDGE2_UART_IRQ, ts);
+}
+#endif
 
 /* USER CODE END 1 */
 
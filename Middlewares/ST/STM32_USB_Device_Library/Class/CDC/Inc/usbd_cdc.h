@@ -19,7 +19,7 @@
 
 #define CDC_DATA_MAX_PACKET_SIZE       64U  /* Endpoint IN & OUT Packet size */
 
-#define CDC_CMD_PACKET_SIZE            8U  /* Control Endpoint Packet size */
+#define CDC_CMD_PACKET_SIZE            16U /* Control Endpoint Packet size, fits SERIAL_STATE */
 
 #define CDC_DATA_IN_PACKET_SIZE        CDC_DATA_MAX_PACKET_SIZE
 #define CDC_DATA_OUT_PACKET_SIZE       CDC_DATA_MAX_PACKET_SIZE
@@ -37,6 +37,22 @@
 #define CDC_SET_CONTROL_LINE_STATE      0x22U
 #define CDC_SEND_BREAK                  0x23U
 
+/* PSTN120 Table 30: Class-Specific Notification Codes */
+#define CDC_NOTIFY_SERIAL_STATE         0x20U
+
+/* PSTN120 Table 31: UART State Bitmap Values */
+#define CDC_SERIAL_STATE_RX_CARRIER     0x0001U     /* DCD */
+#define CDC_SERIAL_STATE_TX_CARRIER     0x0002U     /* DSR */
+#define CDC_SERIAL_STATE_BREAK          0x0004U
+#define CDC_SERIAL_STATE_RING_SIGNAL    0x0008U
+#define CDC_SERIAL_STATE_FRAMING        0x0010U
+#define CDC_SERIAL_STATE_PARITY         0x0020U
+#define CDC_SERIAL_STATE_OVERRUN        0x0040U
+/* Irregular signals, reported once per event */
+#define CDC_SERIAL_STATE_EVENTS         (CDC_SERIAL_STATE_BREAK | CDC_SERIAL_STATE_RING_SIGNAL | \
+                                         CDC_SERIAL_STATE_FRAMING | CDC_SERIAL_STATE_PARITY | \
+                                         CDC_SERIAL_STATE_OVERRUN)
+
 #pragma pack(push, 1)
  /*******************************************************************************/
  /* Line Coding Structure  PSTN120.pdf Table 17                                 */
@@ -47,6 +63,18 @@ typedef struct pstn_line_coding_s {
     uint8_t bParityType;    /* Parity 0-None; 1-Odd; 2-Even; 3-Mark; 4-Space */
     uint8_t bDataBits;      /* Number Data bits (5, 6, 7, 8 or 16) */
 } pstn_line_coding_t;
+
+ /*******************************************************************************/
+ /* SERIAL_STATE Notification  PSTN120.pdf 6.5.4                                */
+ /*******************************************************************************/
+typedef struct pstn_serial_state_s {
+    uint8_t bmRequestType;  /* 0xA1 */
+    uint8_t bNotification;  /* CDC_NOTIFY_SERIAL_STATE */
+    uint16_t wValue;        /* Zero */
+    uint16_t wIndex;        /* Interface */
+    uint16_t wLength;       /* Size of the UART state bitmap */
+    uint16_t bmUartState;   /* CDC_SERIAL_STATE_xxx */
+} pstn_serial_state_t;
 #pragma pack(pop)
 
 typedef struct
@@ -67,9 +95,11 @@ typedef struct cdc_dfi_s {
     void (*on_idle) (struct cdc_dfi_s *dfi);
     void (*us_start_rx) (struct cdc_dfi_s *dfi);
     void (*us_stop_rx) (struct cdc_dfi_s *dfi);
+    void (*us_on_tx_cplt) (struct cdc_dfi_s *dfi);     /* Whole IN transfer (incl. ZLP) is completed */
     void (*ds_on_control) (struct cdc_dfi_s *dfi, uint8_t cmd, uint8_t* buf, uint16_t len);
     void (*ds_on_rx) (struct cdc_dfi_s *dfi, uint32_t len);
     uint8_t *(*ds_get_buffer) (struct cdc_dfi_s *dfi);
+    void (*on_sof) (struct cdc_dfi_s *dfi);            /* ISR context, once per 1 ms frame. Optional */
 } cdc_dfi_t;
 
 #pragma pack(push, 1)
@@ -105,6 +135,9 @@ typedef struct _USBD_CDC_Handle
 
     __IO uint32_t TxState;
     __IO uint32_t RxState;
+    __IO uint32_t NotifyState;              /* Notification on the command EP is in progress */
+
+    pstn_serial_state_t notify __attribute__ ((aligned (4)));
 
     USBD_CDC_ConfigDesc    *cfg_desc;
 
@@ -112,6 +145,7 @@ typedef struct _USBD_CDC_Handle
 
 uint8_t USBD_CDC_ReceivePacket    (USBD_CDC_Handle *hcdc);
 uint8_t USBD_CDC_TransmitPacket    (USBD_CDC_Handle *hcdc, uint8_t  *buf, uint16_t len);
+uint8_t USBD_CDC_SerialState       (USBD_CDC_Handle *hcdc, uint16_t state);
 
 void CDC_Register(USBD_CDC_Handle *hcdc, usbd_intf_t *intf, USBD_ConfigDesc *config_desc, int *ifnum, int *epnum);
 
@@ -144,15 +144,16 @@ static int8_t CDC_DeInit(USBD_CDC_Handle *hcdc)
 /**
   * @brief  Manage the CDC class requests
   * @param  cmd: Command code
+  * @param  buf: Request data, or the Setup packet itself if length is 0
   * @param  length: Number of data to be sent (in bytes)
   *
   * In HOST->DEVICE direction data passed using Setup packet + data in EP0
   * In DEVICE->HOST direction data need to be put directly to ????
   */
 int8_t CDC_Control(USBD_CDC_Handle *hcdc,
-		uint8_t cmd, uint16_t length)
+		uint8_t cmd, uint8_t *buf, uint16_t length)
 {
-	hcdc->dfi->ds_on_control(hcdc->dfi, cmd, hcdc->data, length);
+	hcdc->dfi->ds_on_control(hcdc->dfi, cmd, buf, length);
 #if NAVIG
 	cdc_ictrl_dfi_on_control();
 	cdc_uart_dfi_on_control();
@@ -253,6 +254,7 @@ void USBD_CDC_Init (union intf_dev_handle_u h, USBD_Handle *pdev, uint8_t cfgidx
 
     hcdc->TxState = 0U;
     hcdc->RxState = 0U;
+    hcdc->NotifyState = 0U;
 
     /* Init  physical Interface components */
     CDC_Init(hcdc, pdev, cfgidx);
@@ -332,7 +334,7 @@ uint8_t USBD_CDC_Setup (union intf_dev_handle_u h, enum setup_recp_e recp,
 			/* Data Phase Transfer Direction = DEV->HOST */
 			/* Data to be processed were received in hcdc.data earlier. */
 			/* Process request and put result into hcdc.data  */
-			CDC_Control(hcdc, req->bRequest, req->wLength);
+			CDC_Control(hcdc, req->bRequest, hcdc->data, req->wLength);
 			USBD_CtlSendData(pdev, hcdc->data, req->wLength);
 		}
 		else {
@@ -343,6 +345,11 @@ uint8_t USBD_CDC_Setup (union intf_dev_handle_u h, enum setup_recp_e recp,
 				hcdc->CmdLength = (uint8_t)req->wLength;
 				USBD_CtlPrepareRx(pdev, hcdc->data, req->wLength);
 			}
+			else {
+				/* No data stage, i.e. SET_CONTROL_LINE_STATE.
+				 * Parameters are in wValue of the Setup packet */
+				CDC_Control(hcdc, req->bRequest, (uint8_t *)req, 0);
+			}
 		}
 		break;
 		/* EOF USB_REQ_TYPE_CLASS */
@@ -406,23 +413,34 @@ uint8_t USBD_CDC_Setup (union intf_dev_handle_u h, enum setup_recp_e recp,
 uint8_t USBD_CDC_DataIn (union intf_dev_handle_u h, uint8_t epnum)
 {
 	USBD_CDC_Handle *hcdc = h.cdc;
+	USBD_Endpoint *pep;
 
 	if (epnum != hcdc->epnum_data && epnum != hcdc->epnum_cmd) {
 		return USBD_OK;
 	}
 
 	if (epnum == hcdc->epnum_cmd) {
-		return USBD_FAIL;
+		/* Notification sent */
+		hcdc->NotifyState = 0U;
+		return USBD_BUSY;
 	}
 
 	assert_param(hcdc->TxState);
 
-	/* CDC is a byte stream, but not packet based. Thus it doesn't use
-	 * multipacket transactions. Also, in order to avoid ZLP exchange
-	 * (i.e. reduce traffic) the transmitter never use full length
-	 * transactions. Just mark tx state as ready and exit.
+	pep = &hcdc->pdev->ep_in[hcdc->epnum_data];
+
+	/* Multipacket transfer is split into packets by the PCD driver.
+	 * If the last packet is a full length one, then the host doesn't
+	 * know that the transfer is over. Terminate it with ZLP.
 	 */
+	if (pep->total_length && (pep->total_length % CDC_DATA_IN_PACKET_SIZE) == 0) {
+		pep->total_length = 0;
+		USBD_LL_Transmit(hcdc->pdev, hcdc->epnum_data, NULL, 0);
+		return USBD_BUSY;
+	}
+
 	hcdc->TxState = 0U;
+	hcdc->dfi->us_on_tx_cplt(hcdc->dfi);
 
 	/* packet consumed */
 	return USBD_BUSY;
@@ -467,7 +485,7 @@ uint8_t USBD_CDC_EP0_RxReady (union intf_dev_handle_u h)
 	USBD_CDC_Handle *hcdc = h.cdc;
 
 	if(hcdc->CmdOpCode != 0xFF) {
-		CDC_Control(hcdc, hcdc->CmdOpCode, hcdc->CmdLength);
+		CDC_Control(hcdc, hcdc->CmdOpCode, hcdc->data, hcdc->CmdLength);
 		hcdc->CmdOpCode = 0xFFU;
 		return USBD_BUSY;		/* Inform composite layer that received data processed */
 	}
@@ -475,9 +493,28 @@ uint8_t USBD_CDC_EP0_RxReady (union intf_dev_handle_u h)
 	return USBD_OK;
 }
 
+/**
+  * @brief  USBD_CDC_SOF
+  *         Handle SOF event, i.e. flush upstream once per frame
+  * @param  h: CDC handle
+  * @retval status
+  */
+uint8_t USBD_CDC_SOF (union intf_dev_handle_u h)
+{
+	USBD_CDC_Handle *hcdc = h.cdc;
+
+	if (hcdc->dfi && hcdc->dfi->on_sof) {
+		hcdc->dfi->on_sof(hcdc->dfi);
+	}
+
+	return USBD_OK;
+}
+
 /**
   * @brief  USBD_CDC_TransmitPacket
-  *         Transmit packet on IN endpoint
+  *         Transmit data on IN endpoint. Transfer might be longer than
+  *         the endpoint size, ZLP is sent when necessary.
+  *         The buffer must be kept untouched till dfi->us_on_tx_cplt()
   * @param  pdev: device instance
   * @retval status
   */
@@ -487,6 +524,7 @@ uint8_t USBD_CDC_TransmitPacket(USBD_CDC_Handle *hcdc,
 
 	if (!hcdc->pdev) {
 		/* If USB side not initiated yet then work as a null dev */
+		hcdc->dfi->us_on_tx_cplt(hcdc->dfi);
 		return USBD_OK;
 	}
 
@@ -506,6 +544,39 @@ uint8_t USBD_CDC_TransmitPacket(USBD_CDC_Handle *hcdc,
 }
 
 
+/**
+  * @brief  USBD_CDC_SerialState
+  *         Send SERIAL_STATE notification on the command IN endpoint
+  * @param  hcdc: CDC interface instance
+  * @param  state: UART state bitmap, CDC_SERIAL_STATE_xxx
+  * @retval USBD_BUSY if the previous notification is not sent yet
+  */
+uint8_t USBD_CDC_SerialState(USBD_CDC_Handle *hcdc, uint16_t state)
+{
+	pstn_serial_state_t *ntf = &hcdc->notify;
+
+	if (!hcdc->pdev) {
+		return USBD_FAIL;
+	}
+
+	if (hcdc->NotifyState) {
+		return USBD_BUSY;
+	}
+
+	hcdc->NotifyState = 1U;
+
+	ntf->bmRequestType = 0xA1;
+	ntf->bNotification = CDC_NOTIFY_SERIAL_STATE;
+	ntf->wValue = 0;
+	ntf->wIndex = host2usb_u16(hcdc->ifnum_cmd);
+	ntf->wLength = host2usb_u16(sizeof(ntf->bmUartState));
+	ntf->bmUartState = host2usb_u16(state);
+
+	USBD_LL_Transmit(hcdc->pdev, hcdc->epnum_cmd, (uint8_t *)ntf, sizeof(*ntf));
+
+	return USBD_OK;
+}
+
 /**
   * @brief  USBD_CDC_ReceivePacket prepare OUT Endpoint for reception
   * @param  hcdc: CDC interface instance
@@ -543,6 +614,7 @@ void CDC_Register (
 	intf->Setup = USBD_CDC_Setup;
 	intf->DataIn = USBD_CDC_DataIn;
 	intf->DataOut = USBD_CDC_DataOut;
+	intf->SOF = USBD_CDC_SOF;
 
 	USBD_CDC_Compose_ConfigDesc(hcdc, config_desc, *ifnum, *epnum);
 	*ifnum += 2;
@@ -22,7 +22,7 @@ void* USBD_CfgDescAppend (USBD_ConfigDesc *cfg_desc, uint8_t *desc, int desc_len
 	uint16_t tot_len = usb2host_u16(cfg_desc->wTotalLength);
 	uint8_t *dst = ((uint8_t*)cfg_desc) + tot_len;
 
-	assert(tot_len + desc_len <= sizeof(USBD_ConfigDescExt));
+	assert((size_t)(tot_len + desc_len) <= sizeof(USBD_ConfigDescExt));
 
 	memcpy(dst, desc, desc_len);
 	tot_len += desc_len;
@@ -192,6 +192,22 @@ uint8_t USBD_Composite_EP0_RxReady (USBD_Handle *pdev)
 	return USBD_OK;
 }
 
+/* Every interface gets SOF, none of them consumes it */
+uint8_t USBD_Composite_SOF (USBD_Handle *pdev)
+{
+	int i;
+
+	for (i = 0; i < COMPOSITE_INTF_NUM; i ++) {
+		usbd_intf_t *intf = &pdev->intf[i];
+
+		if (!intf || !intf->SOF || !intf->h.ctx) continue;
+
+		intf->SOF(intf->h);
+	}
+
+	return USBD_OK;
+}
+
 uint8_t* USBD_Composite_GetCfgDesc (struct _USBD_Handle *pdev, uint16_t *length)
 {
 	*length = pdev->config_desc->wTotalLength;
@@ -214,7 +230,7 @@ USBD_Class USBD_Class_Composite =
     .EP0_RxReady = USBD_Composite_EP0_RxReady,
     .DataIn = USBD_Composite_DataIn,
     .DataOut = USBD_Composite_DataOut,
-    .SOF = NULL,
+    .SOF = USBD_Composite_SOF,
     .IsoINIncomplete = NULL,
     .IsoOUTIncomplete = NULL,
     .GetHSConfigDescriptor =  USBD_Composite_GetCfgDesc,
@@ -281,6 +281,7 @@ void HID_Register (
 	intf->Setup = USBD_HID_Setup;
 	intf->DataIn = USBD_HID_DataIn;
 	intf->DataOut = USBD_HID_DataOut;
+	intf->SOF = NULL;
 
 	hhid->Register(hhid, config_desc, ifnum, epnum);
 #if NAVIG
@@ -380,6 +380,7 @@ typedef struct usbd_intf_s {
     uint8_t (*Setup)(union intf_dev_handle_u h, enum setup_recp_e, uint8_t recp_idx, USBD_SetupReq  *req);
     uint8_t (*DataIn)(union intf_dev_handle_u h, uint8_t epnum);
     uint8_t (*DataOut)(union intf_dev_handle_u h, uint8_t epnum);
+    uint8_t (*SOF)(union intf_dev_handle_u h);      /* Once per 1 ms frame while configured. Optional */
 
 #if 0
     /* Control Endpoints*/
@@ -395,7 +396,22 @@ typedef struct usbd_intf_s {
 } usbd_intf_t;
 
 /* USB Device handle structure */
+#ifndef COMPOSITE_INTF_NUM
 #define COMPOSITE_INTF_NUM 3
+#endif
+
+/* Core event counters, ISR context */
+typedef struct {
+  uint32_t             setup_cnt;
+  uint32_t             data_out_cnt;         /* OUT transfers completed, EP0 included */
+  uint32_t             data_in_cnt;
+  uint32_t             sof_cnt;
+  uint32_t             reset_cnt;
+  uint32_t             suspend_cnt;
+  uint32_t             resume_cnt;
+  uint32_t             disconnect_cnt;
+  uint32_t             ctl_err_cnt;          /* EP0 stalled on a bad request */
+} USBD_Stats;
 
 typedef struct _USBD_Handle {
   uint8_t              id;
@@ -426,6 +442,8 @@ typedef struct _USBD_Handle {
   usbd_intf_t          intf[COMPOSITE_INTF_NUM];
 
   PCD_HandleTypeDef    *pPCDHandle;
+
+  USBD_Stats           stats;
   
 } USBD_Handle;
 
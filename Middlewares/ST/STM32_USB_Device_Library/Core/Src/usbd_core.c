@@ -183,6 +183,8 @@ USBD_Status USBD_LL_SetupStage (USBD_Handle *pdev, uint8_t *psetup)
 {
   USBD_Status ret;
 
+  pdev->stats.setup_cnt++;
+
   USBD_ParseSetupRequest(&pdev->request, psetup);
 
   pdev->ep0_state = USBD_EP0_SETUP;
@@ -224,6 +226,8 @@ USBD_Status USBD_LL_DataOutStage(USBD_Handle *pdev,
   USBD_Endpoint *pep;
   USBD_Status ret;
 
+  pdev->stats.data_out_cnt++;
+
   if (epnum == 0U)
   {
     pep = &pdev->ep_out[0];
@@ -295,6 +299,8 @@ USBD_Status USBD_LL_DataInStage(USBD_Handle *pdev,
   USBD_Endpoint *pep;
   USBD_Status ret;
 
+  pdev->stats.data_in_cnt++;
+
   if (epnum == 0U)
   {
     pep = &pdev->ep_in[0];
@@ -386,6 +392,8 @@ USBD_Status USBD_LL_DataInStage(USBD_Handle *pdev,
 
 USBD_Status USBD_LL_Reset(USBD_Handle *pdev)
 {
+	pdev->stats.reset_cnt++;
+
 	/* Upon Reset call user call back */
 	pdev->dev_state = USBD_STATE_DEFAULT;
 	pdev->ep0_state = USBD_EP0_IDLE;
@@ -435,6 +443,8 @@ USBD_Status USBD_LL_SetSpeed(USBD_Handle *pdev,
 
 USBD_Status USBD_LL_Suspend(USBD_Handle *pdev)
 {
+  pdev->stats.suspend_cnt++;
+
   pdev->dev_old_state = pdev->dev_state;
   pdev->dev_state = USBD_STATE_SUSPENDED;
 
@@ -450,6 +460,8 @@ USBD_Status USBD_LL_Suspend(USBD_Handle *pdev)
 
 USBD_Status USBD_LL_Resume(USBD_Handle *pdev)
 {
+  pdev->stats.resume_cnt++;
+
   if (pdev->dev_state == USBD_STATE_SUSPENDED)
   {
     pdev->dev_state = pdev->dev_old_state;
@@ -467,6 +479,8 @@ USBD_Status USBD_LL_Resume(USBD_Handle *pdev)
 
 USBD_Status USBD_LL_SOF(USBD_Handle *pdev)
 {
+  pdev->stats.sof_cnt++;
+
   if (pdev->pClass == NULL)
   {
     return USBD_FAIL;
@@ -555,6 +569,8 @@ USBD_Status USBD_LL_DevConnected(USBD_Handle *pdev)
   */
 USBD_Status USBD_LL_DevDisconnected(USBD_Handle *pdev)
 {
+  pdev->stats.disconnect_cnt++;
+
   /* Free Class Resources */
   pdev->dev_state = USBD_STATE_DEFAULT;
 
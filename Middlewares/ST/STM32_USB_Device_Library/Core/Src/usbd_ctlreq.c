@@ -875,6 +875,8 @@ void USBD_CtlError(USBD_Handle *pdev, USBD_SetupReq *req)
 {
   UNUSED(req);
 
+  pdev->stats.ctl_err_cnt++;
+
   (void)USBD_LL_StallEP(pdev, 0x80U);
   (void)USBD_LL_StallEP(pdev, 0U);
 }
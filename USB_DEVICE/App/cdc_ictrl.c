@@ -1,55 +1,65 @@
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "av-generic.h"
+#include "av-fmt.h"
+#include "main.h"
 #include "usbd_def.h"
 #include "usbd_cdc.h"
 #include "cdc_ictrl.h"
-#include "imon.h"
+#include "stats.h"
+#include "ictrl_rpc.h"
 
 cdc_ictrl_t g_cdc_ictrl;
-#define ICTRL_CDC_TX_TIMEOUT_MS 16
 #define ICTRL_REV 0
 
-static int ICTRL_CDC_UPSTREAM_AVAILABLE(ictrl_cdc_upstream_t *us)
-{
-    /* Ensure ictrl_wr_idx read only once.
-     * Otherwise it need to protected by interrupt dis/en */
-    int ictrl_wr_idx = us->ictrl_wr_idx;
-
-    return (ictrl_wr_idx >= us->usbd_rd_idx) ?
-                (ictrl_wr_idx - us->usbd_rd_idx) :
-                (ictrl_wr_idx - us->usbd_rd_idx + ICTRL_CDC_UPSTREAM_BUFF_SIZE);
-}
+CTASSERT(AV_RING_IS_POW2(ICTRL_CDC_UPSTREAM_BUFF_SIZE));
 
 static void cdc_ictrl_upstream_send (ictrl_cdc_upstream_t *us)
 {
     USBD_Status usbd_rc;
-    int bytes_available;
+    uint8_t *rd_ptr;
     int bytes_to_tx;
-    int till_border;
 
-    bytes_available = ICTRL_CDC_UPSTREAM_AVAILABLE(us);
+    if (us->usbd_tx_len) {
+        /* Previous transfer is not completed yet */
+        return;
+    }
 
-    till_border = ICTRL_CDC_UPSTREAM_BUFF_SIZE - us->usbd_rd_idx;
+    /* Whole contiguous span at once. CDC class splits it to packets */
+    bytes_to_tx = av_ring_rd_span(&us->log.ring, &rd_ptr);
 
-    /* (CDC_DATA_IN_PACKET_SIZE - 1) is to avoid ZLP exchange. */
-    bytes_to_tx = MIN(CDC_DATA_IN_PACKET_SIZE - 1, bytes_available);
-    bytes_to_tx = MIN(bytes_to_tx, till_border);
+    /* Might be completed inside the call if USB isn't configured */
+    us->usbd_tx_len = bytes_to_tx;
+    usbd_rc = USBD_CDC_TransmitPacket(us->hcdc, rd_ptr, (uint16_t)bytes_to_tx);
 
-    usbd_rc = USBD_CDC_TransmitPacket(
-            us->hcdc,
-            &us->buff[us->usbd_rd_idx],
-            (uint16_t)bytes_to_tx);
+    if (usbd_rc != USBD_OK) {
+        us->usbd_tx_len = 0;
+    }
+}
 
-    if (usbd_rc == USBD_OK) {
-        us->stat_tx_bytes += bytes_to_tx;
+/* ISR context on IN transfer completed */
+void cdc_ictrl_dfi_us_tx_cplt (struct cdc_dfi_s *cdc_dfi)
+{
+    ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
 
-        us->usbd_rd_idx += bytes_to_tx;
-        // AV: CIRC INC
-        assert_param(us->usbd_rd_idx <= ICTRL_CDC_UPSTREAM_BUFF_SIZE);
-        if (us->usbd_rd_idx >= ICTRL_CDC_UPSTREAM_BUFF_SIZE) {
-            us->usbd_rd_idx -= ICTRL_CDC_UPSTREAM_BUFF_SIZE;
-        }
+    UNUSED(cdc_dfi);
+
+    us->stat_tx_bytes += us->usbd_tx_len;
+    av_ring_consume(&us->log.ring, us->usbd_tx_len);
+    us->usbd_tx_len = 0;
+}
+
+/* ISR context. Whatever is printed goes out once per frame */
+void cdc_ictrl_dfi_on_sof (struct cdc_dfi_s *cdc_dfi)
+{
+    ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
+
+    UNUSED(cdc_dfi);
+
+    if (av_ring_used(&us->log.ring) > (uint32_t)us->usbd_tx_len) {
+        cdc_ictrl_upstream_send(us);
     }
 }
 
@@ -58,23 +68,29 @@ void cdc_ictrl_dfi_us_rx_start (struct cdc_dfi_s *cdc_dfi)
 	// ictrl_cdc_upstream_t *us = &cdc_dfi->ctx.cdc_ictrl->us;
     ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
 
-	us->usbd_rd_idx = 0;
-	us->ictrl_wr_idx = 0;
+	UNUSED(cdc_dfi);
+
+	/* Drop what is published. A producer interrupted by this ISR
+	 * might be in the middle of a reservation, so no ring reset */
+	av_ring_consume(&us->log.ring, av_ring_used(&us->log.ring));
+	us->usbd_tx_len = 0;
+
+	/* CDC class prepares OUT endpoint right after this call */
+	g_cdc_ictrl.ds.rx_pending = 1;
 
 	/* Statistics counters */
-	us->stat_rx_bytes = 0;
 	us->stat_tx_bytes = 0;
+	g_cdc_ictrl.ds.stat_rx_bytes = 0;
 
 	/* Error counters */
 	us->ictrl_err_cnt = 0;
-	us->ictrl_ovfl_bytes = 0;
-	us->ictrl_ovfl_cnt = 0;
 
 	return;
 }
 
 void cdc_ictrl_dfi_us_rx_stop (struct cdc_dfi_s *cdc_dfi)
 {
+	UNUSED(cdc_dfi);
 	return;
 }
 
@@ -82,174 +98,563 @@ uint8_t *cdc_ictrl_dfi_ds_get_buff(struct cdc_dfi_s *cdc_dfi)
 {
     // ictrl_cdc_downstream_t *ds = &cdc_dfi->ctx.cdc_ictrl->ds;
     ictrl_cdc_downstream_t *ds = &g_cdc_ictrl.ds;
-    int wr_idx = ds->usbd_wr_idx;
 
-    if (wr_idx >= CDC_ICTRL_DS_BUFF_SIZE) {
-        // assert(0)
-        wr_idx = 0;
+    UNUSED(cdc_dfi);
+
+	return &ds->buff[ds->rx.wr_idx & ds->rx.mask];
+}
+
+/*
+ * Command registry. Modules register tables of commands, the pointers are
+ * kept sorted by name, so lookup is a binary search with exact match.
+ */
+static const ictrl_cmd_t *g_ictrl_cmds[ICTRL_CMD_MAX];
+static unsigned int g_ictrl_cmd_num;
+
+static const ictrl_cmd_t *ictrl_cmd_find(const char *name)
+{
+    unsigned int lo = 0;
+    unsigned int hi = g_ictrl_cmd_num;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        int rc = strcmp(name, g_ictrl_cmds[mid]->name);
+
+        if (rc == 0) {
+            return g_ictrl_cmds[mid];
+        } else if (rc < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
     }
 
-	return &ds->buff[wr_idx];
+    return NULL;
 }
 
-extern int g_dev0_dbg;
+int ictrl_cmd_register(const ictrl_cmd_t *cmds, unsigned int num)
+{
+    unsigned int i, pos;
+
+    for (i = 0; i < num; i++) {
+        if (g_ictrl_cmd_num == ICTRL_CMD_MAX || ictrl_cmd_find(cmds[i].name)) {
+            return -1;
+        }
 
-static void ictrl_on_command(const char *cmd, int len)
+        /* Insertion sort, done once at init */
+        pos = g_ictrl_cmd_num;
+        while (pos && strcmp(cmds[i].name, g_ictrl_cmds[pos - 1]->name) < 0) {
+            g_ictrl_cmds[pos] = g_ictrl_cmds[pos - 1];
+            pos--;
+        }
+        g_ictrl_cmds[pos] = &cmds[i];
+        g_ictrl_cmd_num++;
+    }
+
+    return 0;
+}
+
+int ictrl_arg_uint(const char *arg, uint32_t *val)
 {
-    if (len != 0 && cmd[0] == '\e') {
-        return;
+    char *end;
+    unsigned long v = strtoul(arg, &end, 0);
+
+    if (end == arg || *end) {
+        return -1;
     }
 
-    if (len == 0) {
-        ictrl_print_out("\r\n", 2);
-    } else if (0 == strncmp(cmd, "sign", len)) {
-        ictrl_printf_nonisr("\r\nICTR V%d\r\n", ICTRL_REV);
-    } else if (0 == strncmp(cmd, "help", len)) {
-        ictrl_printf_nonisr("\r\nhelp me too...\r\n");
-    } else if (0 == strncmp(cmd, "imonc", len)) {
-        g_dev0_dbg = 1 - g_dev0_dbg;
-        ictrl_printf_nonisr("\r\nIMON %s\r\n", g_dev0_dbg ? "DIS" : "EN");
-    } else if (0 == strncmp(cmd, "imon", len)) {
-        static int cnt = 0;
-        imon_t *imon = &g_imon;
-        ictrl_printf_nonisr("\r\n[%d] %dC, %dmV\r\n",
-                cnt++, imon->temp_degc, imon->vref);
-    } else if (0 == strncmp(cmd, "ledred", len)) {
-        ictrl_printf_nonisr("\r\nRED LED Toggle\r\n");
+    *val = (uint32_t)v;
+    return 0;
+}
+
+/* Split the line in place by blanks. Returns argc, -1 if there are too many */
+static int ictrl_tokenize(char *line, char *argv[], int argv_len)
+{
+    int argc = 0;
+
+    for (;;) {
+        while (*line == ' ' || *line == '\t') {
+            line++;
+        }
+        if (!*line) {
+            return argc;
+        }
+        if (argc == argv_len) {
+            return -1;
+        }
+
+        argv[argc++] = line;
+        while (*line && *line != ' ' && *line != '\t') {
+            line++;
+        }
+        if (*line) {
+            *line++ = 0;
+        }
+    }
+}
+
+static void ictrl_cmd_usage(const ictrl_cmd_t *cmd)
+{
+    ictrl_printf("%s %s\r\n  %s\r\n", cmd->name, cmd->args, cmd->help);
+}
+
+/* Names only, the whole list must fit the upstream ring */
+static int ictrl_cmd_help(int argc, char *argv[])
+{
+    const ictrl_cmd_t *cmd;
+    unsigned int i;
+
+    if (argc > 2) {
+        return -1;
+    }
+
+    if (argc == 2) {
+        cmd = ictrl_cmd_find(argv[1]);
+        if (cmd) {
+            ictrl_cmd_usage(cmd);
+        } else {
+            ictrl_printf("%s: unknown command\r\n", argv[1]);
+        }
+        return 0;
+    }
+
+    for (i = 0; i < g_ictrl_cmd_num; i++) {
+        ictrl_printf("%s ", g_ictrl_cmds[i]->name);
+    }
+    ictrl_printf("\r\nhelp <command> for details\r\n");
+    return 0;
+}
+
+static int ictrl_cmd_sign(int argc, char *argv[])
+{
+    UNUSED(argc);
+    UNUSED(argv);
+    ictrl_printf("ICTR V%d\r\n", ICTRL_REV);
+    return 0;
+}
+
+static int ictrl_cmd_led(int argc, char *argv[])
+{
+    if (argc != 2) {
+        return -1;
+    }
+
+    if (0 == strcmp(argv[1], "red")) {
         HAL_GPIO_TogglePin(LED_RED_GPIO_Port, LED_RED_Pin);
-    } else if (0 == strncmp(cmd, "ledgreen", len)) {
-        ictrl_printf_nonisr("\r\nGREEN LED Toggle\r\n");
+    } else if (0 == strcmp(argv[1], "green")) {
         HAL_GPIO_TogglePin(LED_GREEN_GPIO_Port, LED_GREEN_Pin);
     } else {
-        // Command not recognized
-        ictrl_print_out("\r\n", 2);
+        return -1;
     }
-    ictrl_printf_nonisr("ictrl>");
+
+    ictrl_printf("%s LED toggle\r\n", argv[1]);
+    return 0;
 }
 
-void ds_on_idle()
+void ictrl_ring_report(const char *name, const av_ring_t *r)
 {
-    ictrl_cdc_downstream_t *ds = &g_cdc_ictrl.ds;
+    ictrl_printf("%s %lu, hwm %lu, >75%% %lu ms\r\n", name, r->size, r->hwm, r->hi_ms);
+}
 
-    if (ds->ictrl_rd_idx == ds->usbd_wr_idx) {
-        if (!ds->rx_pending) {
-            if (USBD_OK == USBD_CDC_ReceivePacket(ds->hcdc)) {
-                ds->rx_pending = 1;
-            }
-        }
+/* Buffer pool usage and console ring level, bridge rings are reported by "uart".
+ * High-water mark exceeds the ring size if data were lost on overflow */
+static int ictrl_cmd_mem(int argc, char *argv[])
+{
+    const av_pool_t *pool = g_cdc_ictrl.pool;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    ictrl_printf("pool %lu/%lu\r\n", pool->used, pool->size);
+    ictrl_ring_report("ictrl up", &g_cdc_ictrl.us.log.ring);
+    ictrl_printf("dropped %lu/%lu bytes\r\n",
+            g_cdc_ictrl.us.log.drop_cnt, g_cdc_ictrl.us.log.drop_bytes);
+    return 0;
+}
+
+static const stats_desc_t g_ictrl_stats[] = {
+    STATS_DESC(cdc_ictrl_t, us.stat_tx_bytes),
+    STATS_DESC(cdc_ictrl_t, ds.stat_rx_bytes),
+    STATS_DESC(cdc_ictrl_t, us.ictrl_err_cnt),
+    STATS_DESC(cdc_ictrl_t, us.log.drop_cnt),
+    STATS_DESC(cdc_ictrl_t, us.log.drop_bytes),
+};
+
+static const ictrl_cmd_t g_ictrl_core_cmds[] = {
+    { "help", "[command]", "List commands, or describe one", ictrl_cmd_help },
+    { "led",  "red|green", "Toggle LED",                     ictrl_cmd_led },
+    { "mem",  "",          "Buffer pool and console ring",   ictrl_cmd_mem },
+    { "sign", "",          "Firmware signature",             ictrl_cmd_sign },
+};
+
+unsigned int ictrl_cmd_pass(void)
+{
+    return g_cdc_ictrl.ds.cmd_pass;
+}
+
+/* Runs the command pass. The prompt follows once it's done */
+static void ictrl_cmd_run(ictrl_cdc_downstream_t *ds)
+{
+    const ictrl_cmd_t *cmd = ds->cmd;
+    int rc = cmd->handler(ds->cmd_argc, ds->cmd_argv);
+
+    if (rc == ICTRL_CMD_MORE) {
+        ds->cmd_pass++;
         return;
     }
 
-    /* Some data received */
-    // assert(ds->rx_pending == 0);
+    if (rc) {
+        ictrl_printf("usage: ");
+        ictrl_cmd_usage(cmd);
+    }
 
-    if (ds->state == ICTRL_DS_STATE_SYNCING) {
-        // Scan RX for sync
-        int rd_idx = ds->ictrl_rd_idx;
-        int sync_idx = -1;
+    ds->cmd = NULL;
+    ictrl_print_out(ICTRL_PROMPT, sizeof(ICTRL_PROMPT) - 1);
+}
 
-        while(rd_idx != ds->usbd_wr_idx) {
-            if (ds->buff[rd_idx++] == '\r') {
-                sync_idx = rd_idx;
-                break;
-            }
-        }
-        if (sync_idx != -1) {
-            // Sync found shift remaining data to the buffer's start
-            int wr_idx = 0;
-            while(rd_idx != ds->usbd_wr_idx) {
-                ds->buff[wr_idx++]  = ds->buff[rd_idx++];
-            }
-            ds->usbd_wr_idx = wr_idx;
-            ds->state = ICTRL_DS_STATE_RX;
-            ictrl_printf_nonisr("\nictrl>");
+int ictrl_cmd_exec(char *line)
+{
+    ictrl_cdc_downstream_t *ds = &g_cdc_ictrl.ds;
+    char *argv[ICTRL_ARGC_MAX];
+    const ictrl_cmd_t *cmd;
+    int argc, rc;
+
+    argc = ictrl_tokenize(line, argv, ICTRL_ARGC_MAX);
+    if (argc <= 0 || !(cmd = ictrl_cmd_find(argv[0]))) {
+        return ICTRL_CMD_UNKNOWN;
+    }
+
+    /* Console commands wait while RPC runs, so the pass is free to use */
+    ds->cmd_pass = 0;
+    rc = cmd->handler(argc, argv);
+    if (rc < 0) {
+        ictrl_cmd_usage(cmd);
+    }
+
+    return rc;
+}
+
+/* Arguments point into the line, it isn't touched till the command is done */
+static void ictrl_on_command(ictrl_cdc_downstream_t *ds)
+{
+    const ictrl_cmd_t *ictrl_cmd;
+    int argc;
+
+    ictrl_print_out("\r\n", 2);
+
+    argc = ictrl_tokenize(ds->line, ds->cmd_argv, ICTRL_ARGC_MAX);
+    if (argc < 0) {
+        ictrl_printf("Too many arguments\r\n");
+    } else if (argc > 0) {
+        ictrl_cmd = ictrl_cmd_find(ds->cmd_argv[0]);
+        if (!ictrl_cmd) {
+            ictrl_printf("%s: unknown command, see help\r\n", ds->cmd_argv[0]);
         } else {
-            // Sync not found - discard all data and get next packet
-            ds->usbd_wr_idx = 0;
+            ds->cmd = ictrl_cmd;
+            ds->cmd_argc = argc;
+            ds->cmd_pass = 0;
+            ictrl_cmd_run(ds);
+            return;
         }
     }
 
-    if (ds->state == ICTRL_DS_STATE_RX) {
-        int rd_idx = ds->ictrl_rd_idx;
-        int cmd_idx = 0;
-        int echo_idx = 0;
+    ictrl_print_out(ICTRL_PROMPT, sizeof(ICTRL_PROMPT) - 1);
+}
 
-        while(rd_idx != ds->usbd_wr_idx) {
-            if (ds->buff[rd_idx] == '\r' || ds->buff[rd_idx] == '\n') {
-                // Command received. Make it zero terminated
-                ds->buff[rd_idx] = 0;
+/*
+ * Line editor. Input is taken from the downstream ring char by char,
+ * echo is collected and sent once per ring span.
+ */
+static void ictrl_echo_flush(ictrl_cdc_downstream_t *ds)
+{
+    if (ds->echo_len) {
+        ictrl_print_out(ds->echo, ds->echo_len);
+        ds->echo_len = 0;
+    }
+}
+
+static void ictrl_echo(ictrl_cdc_downstream_t *ds, const char *str, int len)
+{
+    while (len--) {
+        if (ds->echo_len == (int)sizeof(ds->echo)) {
+            ictrl_echo_flush(ds);
+        }
+        ds->echo[ds->echo_len++] = *str++;
+    }
+}
 
-                // Print out echo till the end of command
-                echo_idx = (cmd_idx == 0) ? ds->ictrl_rd_idx : cmd_idx;
-                ictrl_print_out((char*)&ds->buff[echo_idx], rd_idx - echo_idx);
+/* Redraw the line from the cursor, erasing erased chars past the end,
+ * then return the terminal cursor back */
+static void ictrl_line_redraw(ictrl_cdc_downstream_t *ds, int erased)
+{
+    int tail = ds->line_len - ds->cursor;
+    int i;
 
-                ictrl_on_command((char*)&ds->buff[cmd_idx], rd_idx - cmd_idx);
-                cmd_idx = rd_idx + 1;
+    ictrl_echo(ds, &ds->line[ds->cursor], tail);
+    for (i = 0; i < erased; i++) {
+        ictrl_echo(ds, " ", 1);
+    }
+    for (i = 0; i < tail + erased; i++) {
+        ictrl_echo(ds, "\b", 1);
+    }
+}
+
+static void ictrl_line_insert(ictrl_cdc_downstream_t *ds, char ch)
+{
+    if (ds->line_len == ICTRL_LINE_MAX - 1) {
+        ictrl_echo(ds, "\a", 1);
+        return;
+    }
+
+    memmove(&ds->line[ds->cursor + 1], &ds->line[ds->cursor], ds->line_len - ds->cursor);
+    ds->line[ds->cursor] = ch;
+    ds->line_len++;
+    ictrl_echo(ds, &ds->line[ds->cursor++], 1);
+    ictrl_line_redraw(ds, 0);
+}
+
+/* Remove the char under the cursor */
+static void ictrl_line_delete(ictrl_cdc_downstream_t *ds)
+{
+    if (ds->cursor == ds->line_len) {
+        return;
+    }
+
+    memmove(&ds->line[ds->cursor], &ds->line[ds->cursor + 1], ds->line_len - ds->cursor - 1);
+    ds->line_len--;
+    ictrl_line_redraw(ds, 1);
+}
+
+static void ictrl_line_left(ictrl_cdc_downstream_t *ds)
+{
+    if (ds->cursor) {
+        ds->cursor--;
+        ictrl_echo(ds, "\b", 1);
+    }
+}
+
+static void ictrl_line_right(ictrl_cdc_downstream_t *ds)
+{
+    if (ds->cursor < ds->line_len) {
+        ictrl_echo(ds, &ds->line[ds->cursor++], 1);
+    }
+}
+
+/* Replace the line, i.e. on history recall */
+static void ictrl_line_set(ictrl_cdc_downstream_t *ds, const char *str)
+{
+    ds->line_len = (int)strlen(str);
+    ds->cursor = ds->line_len;
+    memcpy(ds->line, str, ds->line_len);
+
+    ictrl_echo(ds, "\r\e[K" ICTRL_PROMPT, sizeof("\r\e[K" ICTRL_PROMPT) - 1);
+    ictrl_echo(ds, ds->line, ds->line_len);
+}
+
+/* Older on dir > 0, newer on dir < 0. Past the newest is an empty line */
+static void ictrl_hist_recall(ictrl_cdc_downstream_t *ds, int dir)
+{
+    unsigned int saved = (ds->hist_num < ICTRL_HIST_NUM) ? ds->hist_num : ICTRL_HIST_NUM;
+
+    if (dir > 0 && ds->hist_pos < saved) {
+        ds->hist_pos++;
+    } else if (dir < 0 && ds->hist_pos > 0) {
+        ds->hist_pos--;
+    } else {
+        return;
+    }
+
+    ictrl_line_set(ds, ds->hist_pos ?
+            ds->hist[(ds->hist_num - ds->hist_pos) % ICTRL_HIST_NUM] : "");
+}
+
+/* Repeated line isn't saved again */
+static void ictrl_hist_save(ictrl_cdc_downstream_t *ds)
+{
+    char *last = ds->hist[(ds->hist_num - 1) % ICTRL_HIST_NUM];
+
+    ds->hist_pos = 0;
+
+    if (!ds->line_len || (ds->hist_num && 0 == strcmp(last, ds->line))) {
+        return;
+    }
+
+    memcpy(ds->hist[ds->hist_num % ICTRL_HIST_NUM], ds->line, ds->line_len + 1);
+    ds->hist_num++;
+}
+
+/* VT100 cursor keys: ESC [ A..D, delete: ESC [ 3 ~. Others are skipped */
+static void ictrl_line_esc(ictrl_cdc_downstream_t *ds, char ch)
+{
+    switch (ds->esc_state) {
+    case ICTRL_ESC_START:
+        ds->esc_state = (ch == '[') ? ICTRL_ESC_CSI : ICTRL_ESC_NONE;
+        return;
+
+    case ICTRL_ESC_CSI:
+        ds->esc_state = ICTRL_ESC_NONE;
+        switch (ch) {
+        case 'A': ictrl_hist_recall(ds, 1);  break;
+        case 'B': ictrl_hist_recall(ds, -1); break;
+        case 'C': ictrl_line_right(ds);      break;
+        case 'D': ictrl_line_left(ds);       break;
+        case '3': ds->esc_state = ICTRL_ESC_DEL; break;
+        default:
+            if (ch >= '0' && ch <= '9') {
+                ds->esc_state = ICTRL_ESC_PARAM;
             }
-            rd_idx++;
+            break;
         }
+        return;
 
-        /*
-         *  Echo back typed data starting from the end of last
-         *  received command or, if no command were received from
-         *  the start of received data
-         */
-        echo_idx = (cmd_idx == 0) ? ds->ictrl_rd_idx : cmd_idx;
-        ictrl_print_out((char*)&ds->buff[echo_idx], ds->usbd_wr_idx - echo_idx);
-
-        if (cmd_idx) {
-            // One or more commands received. Shift remaining tail
-            int wr_idx = 0;
-            while(rd_idx != ds->usbd_wr_idx) {
-                ds->buff[wr_idx++]  = ds->buff[rd_idx++];
-            }
-            ds->usbd_wr_idx = wr_idx;
+    case ICTRL_ESC_DEL:
+        if (ch == '~') {
+            ictrl_line_delete(ds);
+        } else if (ch >= '0' && ch <= '9') {
+            ds->esc_state = ICTRL_ESC_PARAM;
+        }
+        /* fall through */
+    default:
+        /* Parameters end with a letter or ~ */
+        if (ch < '0' || ch > ';') {
+            ds->esc_state = ICTRL_ESC_NONE;
         }
+        return;
     }
+}
 
+/* Returns 1 if a command was run */
+static int ictrl_line_input(ictrl_cdc_downstream_t *ds, char ch)
+{
+    char last_ch = ds->last_ch;
 
-    {  // If no more space, then clear sync and reset buffer indices
-        int free_space = CDC_ICTRL_DS_BUFF_SIZE - ds->usbd_wr_idx - 1;
-        if (free_space < CDC_DATA_OUT_PACKET_SIZE) {
-            ds->state = ICTRL_DS_STATE_SYNCING;
-            ds->usbd_wr_idx = 0;
+    ds->last_ch = ch;
+
+    if (ds->esc_state != ICTRL_ESC_NONE) {
+        ictrl_line_esc(ds, ch);
+        return 0;
+    }
+
+    switch (ch) {
+    case '\n':
+        /* CR LF is a single line end */
+        if (last_ch == '\r') {
+            return 0;
+        }
+        /* fall through */
+    case '\r':
+        ds->line[ds->line_len] = 0;
+        ictrl_hist_save(ds);
+        ictrl_echo_flush(ds);
+        ictrl_on_command(ds);
+        ds->line_len = 0;
+        ds->cursor = 0;
+        return 1;
+
+    case '\b':
+    case 0x7F:
+        if (ds->cursor) {
+            ictrl_line_left(ds);
+            ictrl_line_delete(ds);
         }
+        return 0;
+
+    case 0x03:
+        /* Ctrl-C drops the line */
+        ictrl_echo(ds, "^C\r\n" ICTRL_PROMPT, sizeof("^C\r\n" ICTRL_PROMPT) - 1);
+        ds->line_len = 0;
+        ds->cursor = 0;
+        ds->hist_pos = 0;
+        return 0;
+
+    case '\e':
+        ds->esc_state = ICTRL_ESC_START;
+        return 0;
+
+    default:
+        if (ch >= ' ' && ch < 0x7F) {
+            ictrl_line_insert(ds, ch);
+        }
+        return 0;
     }
+}
 
-    // Mark all newly received data as processed
-    ds->ictrl_rd_idx = ds->usbd_wr_idx;
+/* RPC frames start with a byte never typed, the rest is console text.
+ * Returns 1 if a command or a request was run */
+static int ictrl_input(ictrl_cdc_downstream_t *ds, uint8_t ch)
+{
+    int rc = ictrl_rpc_input(ch);
 
-    if (USBD_OK == USBD_CDC_ReceivePacket(ds->hcdc)) {
-        ds->rx_pending = 1;
+    if (rc < 0) {
+        rc = ictrl_line_input(ds, (char)ch);
     }
 
+    return rc;
+}
+
+/*
+ * Feed the line editor and RPC from the downstream ring. Input is held in the
+ * ring, and the host is NAKed, while the console output is short of room,
+ * a command takes more passes or an RPC response is held back.
+ * So pasted scripts go at USB speed without losing input or output.
+ */
+static void ictrl_ds_on_idle(void)
+{
+    ictrl_cdc_downstream_t *ds = &g_cdc_ictrl.ds;
+    av_ring_t *out = &g_cdc_ictrl.us.log.ring;
+    uint8_t *rd_ptr;
+    uint32_t len, i;
+
+    if (ds->cmd && av_ring_free(out) >= out->size / 2) {
+        ictrl_cmd_run(ds);
+    }
+
+    while (!ds->cmd && !ictrl_rpc_flush() && av_ring_free(out) >= out->size / 2 &&
+           (len = av_ring_rd_span(&ds->rx, &rd_ptr)) != 0) {
+        /* Recheck the output room after each command */
+        for (i = 0; i < len; ) {
+            if (ictrl_input(ds, rd_ptr[i++])) {
+                break;
+            }
+        }
+        av_ring_consume(&ds->rx, i);
+        ictrl_echo_flush(ds);
+    }
+
+    /* Keep a packet free in the ring at any time, the CDC class
+     * prepares OUT endpoint at the write position on reconnect */
+    if (!ds->rx_pending && av_ring_free(&ds->rx) >= 2 * CDC_DATA_OUT_PACKET_SIZE) {
+        ds->rx_pending = 1;
+        if (USBD_OK != USBD_CDC_ReceivePacket(ds->hcdc)) {
+            ds->rx_pending = 0;
+        }
+    }
 }
 
 void  cdc_ictrl_dfi_on_idle (struct cdc_dfi_s *cdc_dfi)
 {
-    // ictrl_cdc_upstream_t *us = &cdc_dfi->ctx.cdc_ictrl->us;
-    ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
-	int bytes_available;
-
-	/* Send data upstream when available */
-	bytes_available = ICTRL_CDC_UPSTREAM_AVAILABLE(us);
-	if (bytes_available) {
-		uint32_t now = HAL_GetTick();
-		if ((now - us->last_tx_ts) > ICTRL_CDC_TX_TIMEOUT_MS ||
-			bytes_available >= CDC_DATA_IN_PACKET_SIZE) {
-			us->last_tx_ts = now;
-			cdc_ictrl_upstream_send(us);
-		}
-	}
+	uint32_t now = HAL_GetTick();
+
+	UNUSED(cdc_dfi);
+
+	ictrl_ds_on_idle();
 
-	ds_on_idle();
+	/* Input held in the ring doesn't make a request stall */
+	if (!av_ring_used(&g_cdc_ictrl.ds.rx)) {
+		ictrl_rpc_on_idle(now);
+	}
 
+	av_ring_sample(&g_cdc_ictrl.us.log.ring, now);
 	return;
 }
 
 /* ISR context */
 void cdc_ictrl_dfi_ds_on_control(struct cdc_dfi_s *cdc_dfi, uint8_t cmd, uint8_t* buf, uint16_t len)
 {
+	UNUSED(cdc_dfi);
+	UNUSED(cmd);
+	UNUSED(buf);
+	UNUSED(len);
 	return;
 #if 0
     // ictrl_cdc_upstream_t *us = &cdc_dfi->ctx.cdc_ictrl->us;
@@ -276,15 +681,17 @@ void cdc_ictrl_dfi_ds_on_rx(struct cdc_dfi_s *cdc_dfi, uint32_t len)
 {
     // ictrl_cdc_downstream_t *ds = &cdc_dfi->ctx.cdc_ictrl->ds;
     ictrl_cdc_downstream_t *ds = &g_cdc_ictrl.ds;
+    uint32_t wr_ofs = ds->rx.wr_idx & ds->rx.mask;
 
-    ds->usbd_wr_idx += len;
+    UNUSED(cdc_dfi);
 
-    if (ds->usbd_wr_idx > CDC_ICTRL_DS_BUFF_SIZE) {
-        // assert(0);
-        ds->usbd_wr_idx = 0;
+    /* Ran over the ring end, move the excess to the ring start */
+    if (wr_ofs + len > ds->rx.size) {
+        memcpy(&ds->buff[0], &ds->buff[ds->rx.size], wr_ofs + len - ds->rx.size);
     }
+    av_ring_produce(&ds->rx, len);
+    ds->stat_rx_bytes += len;
 
-    // assert(ds->rx_pending == 1);
     ds->rx_pending = 0;
 	return;
 }
@@ -296,107 +703,230 @@ void cdc_dfi_ictrl_init (cdc_dfi_t *cdc_dfi, cdc_ictrl_t *ictrl)
 	cdc_dfi->on_idle 		= cdc_ictrl_dfi_on_idle;
 	cdc_dfi->us_start_rx 	= cdc_ictrl_dfi_us_rx_start;
 	cdc_dfi->us_stop_rx 	= cdc_ictrl_dfi_us_rx_stop;
+	cdc_dfi->us_on_tx_cplt 	= cdc_ictrl_dfi_us_tx_cplt;
 	cdc_dfi->ds_get_buffer 	= cdc_ictrl_dfi_ds_get_buff;
 	cdc_dfi->ds_on_control  = cdc_ictrl_dfi_ds_on_control;
 	cdc_dfi->ds_on_rx 		= cdc_ictrl_dfi_ds_on_rx;
+	cdc_dfi->on_sof 		= cdc_ictrl_dfi_on_sof;
 }
 
-void ictrl_downstrem_init(ictrl_cdc_downstream_t *ds, USBD_CDC_Handle *hcdc)
+int ictrl_downstrem_init(ictrl_cdc_downstream_t *ds, USBD_CDC_Handle *hcdc,
+        av_pool_t *pool, uint32_t size)
 {
     memset(ds, 0, sizeof(ictrl_cdc_downstream_t));
+
+    if (!AV_RING_IS_POW2(size) || size < CDC_ICTRL_DS_BUFF_SIZE_MIN) {
+        return -1;
+    }
+
+    /* Extra tail for OUT packet received at the ring end */
+    ds->buff = av_pool_alloc(pool, size + CDC_DATA_OUT_PACKET_SIZE);
+    if (!ds->buff) {
+        return -1;
+    }
+
+    av_ring_init(&ds->rx, ds->buff, size);
     ds->hcdc = hcdc;
+    return 0;
 }
-void ictrl_upstream_init(ictrl_cdc_upstream_t *us, USBD_CDC_Handle *hcdc)
+
+int ictrl_upstream_init(ictrl_cdc_upstream_t *us, USBD_CDC_Handle *hcdc,
+        av_pool_t *pool, uint32_t size)
 {
     memset(us, 0, sizeof(ictrl_cdc_upstream_t));
+
+    if (!AV_RING_IS_POW2(size)) {
+        return -1;
+    }
+
+    us->buff = av_pool_alloc(pool, size);
+    if (!us->buff) {
+        return -1;
+    }
+
 	us->hcdc = hcdc;
+	av_mpring_init(&us->log, us->buff, size);
+	return 0;
 }
 
-void cdc_ictrl_init(USBD_CDC_Handle *hcdc)
+int cdc_ictrl_init(USBD_CDC_Handle *hcdc, av_pool_t *pool, uint32_t us_size, uint32_t ds_size)
 {
 	cdc_ictrl_t *ictrl = &g_cdc_ictrl;
 
 	cdc_dfi_ictrl_init(&ictrl->dfi, ictrl);
 
-	ictrl_downstrem_init(&ictrl->ds, hcdc);
-	ictrl_upstream_init(&ictrl->us, hcdc);
+	if (ictrl_downstrem_init(&ictrl->ds, hcdc, pool, ds_size) ||
+		ictrl_upstream_init(&ictrl->us, hcdc, pool, us_size) ||
+		ictrl_cmd_register(g_ictrl_core_cmds, COUNT_OF(g_ictrl_core_cmds)) ||
+		stats_register("ictrl", ictrl, g_ictrl_stats, COUNT_OF(g_ictrl_stats)) ||
+		ictrl_rpc_init(us_size)) {
+		return -1;
+	}
 
+	ictrl->pool = pool;
 	hcdc->dfi = &ictrl->dfi;
+	return 0;
 }
 
-/* Note: Care should be taken if global interrupts
- *       isn't always on.
- */
+static inline int ictrl_capturing(const ictrl_cdc_upstream_t *us)
+{
+    return us->cap_buff && __get_IPSR() == 0;
+}
 
-int ictrl_print_out(const char *in_buff, int in_buff_len)
+static void ictrl_capture_put(void *ctx, char ch)
+{
+    ictrl_cdc_upstream_t *us = (ictrl_cdc_upstream_t *)ctx;
+
+    if (us->cap_len < us->cap_size) {
+        us->cap_buff[us->cap_len++] = (uint8_t)ch;
+    } else {
+        us->cap_cut = 1;
+    }
+}
+
+void ictrl_capture_start(uint8_t *buff, uint32_t size)
+{
+    ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
+
+    us->cap_len = 0;
+    us->cap_size = size;
+    us->cap_cut = 0;
+    us->cap_buff = buff;
+}
+
+int ictrl_capture_stop(void)
 {
     ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
 
-    int dst_free;
-    int ovfl;
-    int till_border;
-    int ictrl_wr_idx;
-    int bytes_to_wr1, bytes_to_wr2;
+    us->cap_buff = NULL;
+    return us->cap_cut ? -1 : (int)us->cap_len;
+}
 
-    /* Complete index operation ASAP and release interrupts */
-    __disable_irq();
-    ictrl_wr_idx = us->ictrl_wr_idx;
-    dst_free = us->usbd_rd_idx - ictrl_wr_idx - 1;
-    if (dst_free < 0) dst_free += ICTRL_CDC_UPSTREAM_BUFF_SIZE;
+/* Any context. Whole message or nothing, dropped ones are counted by the ring */
+int ictrl_print_out(const char *in_buff, int in_buff_len)
+{
+    ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
+    int i;
 
-    /* Discard excessive data */
-    ovfl = in_buff_len - dst_free;
-    if (ovfl > 0) {
-        in_buff_len -= ovfl;
+    if (ictrl_capturing(us)) {
+        for (i = 0; i < in_buff_len; i++) {
+            ictrl_capture_put(us, in_buff[i]);
+        }
+        return in_buff_len;
     }
 
-    us->ictrl_wr_idx += in_buff_len;
-    if (us->ictrl_wr_idx >= ICTRL_CDC_UPSTREAM_BUFF_SIZE)
-        us->ictrl_wr_idx -= ICTRL_CDC_UPSTREAM_BUFF_SIZE;
-    __enable_irq();
+    return (int)av_mpring_write(&us->log, in_buff, (uint32_t)in_buff_len);
+}
+
+uint32_t ictrl_out_free(void)
+{
+    ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
 
-    if (ovfl > 0) {
-        us->ictrl_ovfl_bytes += ovfl;
-        us->ictrl_ovfl_cnt ++;
+    if (ictrl_capturing(us)) {
+        return us->cap_size - us->cap_len;
     }
 
-    /* Split write into 2 parts - till border and from begging */
-    till_border = ICTRL_CDC_UPSTREAM_BUFF_SIZE - ictrl_wr_idx;
+    return av_ring_free(&us->log.ring);
+}
 
-    bytes_to_wr1 = MIN(in_buff_len, till_border);
-    memcpy(&us->buff[ictrl_wr_idx], in_buff, bytes_to_wr1);
+/*
+ * Any context. Record goes into the ring whole or not at all,
+ * so the host decoder stays in sync.
+ */
+int ictrl_log_bin(uint32_t id, int nargs, ...)
+{
+    struct {
+        ictrl_log_hdr_t hdr;
+        uint32_t args[ICTRL_LOG_ARGS_MAX];
+    } rec;
+    va_list va_args;
+    int len;
+    int i;
+
+    if (nargs > ICTRL_LOG_ARGS_MAX) {
+        nargs = ICTRL_LOG_ARGS_MAX;
+    }
+
+    rec.hdr.magic = ICTRL_LOG_MAGIC;
+    rec.hdr.nargs = (uint8_t)nargs;
+    rec.hdr.id = (uint16_t)id;
+    rec.hdr.ts_ms = HAL_GetTick();
 
-    bytes_to_wr2 = in_buff_len - bytes_to_wr1;
-    if (bytes_to_wr2) {
-        memcpy(&us->buff[0], &in_buff[bytes_to_wr1], bytes_to_wr2);
+    va_start(va_args, nargs);
+    for (i = 0; i < nargs; i++) {
+        rec.args[i] = va_arg(va_args, uint32_t);
     }
+    va_end(va_args);
+
+    len = (int)sizeof(rec.hdr) + nargs * (int)sizeof(uint32_t);
+    return ictrl_print_out((const char *)&rec, len);
+}
+
+/* Reserved ring space being formatted into, wraps at the ring border */
+typedef struct ictrl_fmt_out_s {
+    av_ring_t *ring;
+    uint32_t idx;
+    uint32_t end;
+} ictrl_fmt_out_t;
 
-    us->stat_rx_bytes += in_buff_len;
+static void ictrl_fmt_put(void *ctx, char ch)
+{
+    ictrl_fmt_out_t *out = (ictrl_fmt_out_t *)ctx;
 
-    return in_buff_len;
+    /* Arguments changed since counted, i.e. a string updated by ISR */
+    if (out->idx == out->end) {
+        return;
+    }
+
+    out->ring->buff[out->idx++ & out->ring->mask] = (uint8_t)ch;
 }
 
 /*
- * Note: Should not be called from ISR context due to global upstream buffer
- *       usage. If necessary prepare data inside an interrupt and call
- *       ictrl_print_out()
+ * Any context. The message is counted first, then formatted straight
+ * into the reserved ring space, so there is no buffer and no copy.
+ * Whole message or nothing, like ictrl_print_out().
  */
-int ictrl_printf_nonisr(const char *format, ...)
+static int ictrl_vprintf(const char *format, va_list va_args)
 {
-    // ictrl_cdc_upstream_t *us = &((cdc_ictrl_t*)cdc_dfi->ctx)->us;
     ictrl_cdc_upstream_t *us = &g_cdc_ictrl.us;
+    ictrl_fmt_out_t out;
+    va_list va_count;
+    int len;
+
+    if (ictrl_capturing(us)) {
+        return av_vfmt(ictrl_capture_put, us, format, va_args);
+    }
+
+    va_copy(va_count, va_args);
+    len = av_vfmt(NULL, NULL, format, va_count);
+    va_end(va_count);
+
+    if (len <= 0 || av_mpring_reserve(&us->log, (uint32_t)len, &out.idx)) {
+        return 0;
+    }
+
+    out.ring = &us->log.ring;
+    out.end = out.idx + (uint32_t)len;
+    if (av_vfmt(ictrl_fmt_put, &out, format, va_args) != len) {
+        us->ictrl_err_cnt++;
+        /* Keep the reserved length, the tail is padded */
+        while (out.idx != out.end) {
+            ictrl_fmt_put(&out, ' ');
+        }
+    }
+
+    av_mpring_commit(&us->log);
+    return len;
+}
 
-    va_list  va_args;
-	int bytes_to_wr_tot;
+int ictrl_printf(const char *format, ...)
+{
+    va_list va_args;
+    int len;
 
     va_start(va_args, format);
-    bytes_to_wr_tot = vsnprintf(us->tmp_str_buff, sizeof(us->tmp_str_buff), format, va_args);
+    len = ictrl_vprintf(format, va_args);
     va_end(va_args);
 
-	if (bytes_to_wr_tot < 0) {
-		us->ictrl_err_cnt ++;
-		return -1;
-	}
-
-	return ictrl_print_out(us->tmp_str_buff, bytes_to_wr_tot);
+    return len;
 }
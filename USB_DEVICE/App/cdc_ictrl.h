@@ -1,53 +1,191 @@
 #pragma once
 
+#include "usbd_cdc.h"
+#include "av-mpring.h"
+#include "av-pool.h"
+
+/* Default ring size, power of 2 */
 #define ICTRL_CDC_UPSTREAM_BUFF_SIZE 512
 
 typedef struct ictrl_cdc_upstream_s {
 
 	USBD_CDC_Handle   *hcdc;
 
-	char tmp_str_buff[ICTRL_CDC_UPSTREAM_BUFF_SIZE];		/* Temporary buffer for printf. Must be less or equal to buff */
+	uint8_t *buff;              /* log.ring.size */
+	av_mpring_t log;            /* Produced from any context, consumed from SOF ISR.
+	                             * Messages which don't fit are dropped and counted */
+	volatile int usbd_tx_len;   /* Bytes passed to USB IN transfer, released on completion */
 
-	uint8_t buff[ICTRL_CDC_UPSTREAM_BUFF_SIZE];
-	int ictrl_wr_idx;
-	int usbd_rd_idx;
-	uint32_t last_tx_ts;
+	/* Main loop output captured instead, see ictrl_capture_start() */
+	uint8_t *cap_buff;
+	uint32_t cap_size;
+	uint32_t cap_len;
+	int cap_cut;                /* Output didn't fit */
 
 	/* Statistics counters */
-	uint32_t stat_rx_bytes;
 	uint32_t stat_tx_bytes;
 
 	/* Error counters */
-	uint32_t ictrl_err_cnt;
-	uint32_t ictrl_ovfl_cnt;
-	uint32_t ictrl_ovfl_bytes;
+	uint32_t ictrl_err_cnt;     /* Messages changed between counting and formatting */
 
 } ictrl_cdc_upstream_t;
 
+/* Default input ring, power of 2. A packet is kept free at any time */
 #define CDC_ICTRL_DS_BUFF_SIZE         256U
+#define CDC_ICTRL_DS_BUFF_SIZE_MIN     (4U * CDC_DATA_OUT_PACKET_SIZE)
+
+#define ICTRL_PROMPT        "ictrl>"
+#define ICTRL_LINE_MAX      80      /* Including zero terminator */
+#define ICTRL_HIST_NUM      4       /* Lines recalled by cursor up/down */
+#define ICTRL_ARGC_MAX      8
 
-enum ictrl_ds_state {
-    ICTRL_DS_STATE_SYNCING,
-    ICTRL_DS_STATE_RX
+enum ictrl_esc_state {
+    ICTRL_ESC_NONE,
+    ICTRL_ESC_START,                /* ESC received */
+    ICTRL_ESC_CSI,                  /* ESC [ */
+    ICTRL_ESC_DEL,                  /* ESC [ 3, delete if ~ follows */
+    ICTRL_ESC_PARAM,                /* Skipped till the final char */
 };
+
 typedef struct ictrl_cdc_downstream_s {
     USBD_CDC_Handle   *hcdc;
-    int rx_pending;
-    enum ictrl_ds_state state;
-    int usbd_wr_idx;
-    int ictrl_rd_idx;
-    uint8_t buff[CDC_ICTRL_DS_BUFF_SIZE];
+    volatile int rx_pending;        /* OUT endpoint is prepared at the ring write position */
+    uint8_t *buff;                  /* rx.size plus a packet, OUT packet received at the
+                                     * ring end runs over into the tail */
+    av_ring_t rx;                   /* Produced upon OUT packet received, consumed by the line editor */
+
+    /* Line editor, main loop context */
+    char line[ICTRL_LINE_MAX];
+    int line_len;
+    int cursor;
+    enum ictrl_esc_state esc_state;
+    char last_ch;
+    char echo[32];                  /* Echo collected while the ring span is processed */
+    int echo_len;
+
+    char hist[ICTRL_HIST_NUM][ICTRL_LINE_MAX];
+    unsigned int hist_num;          /* Lines saved, free running */
+    unsigned int hist_pos;          /* Lines back from the newest being recalled, 0 if none */
+
+    /* Command taking more passes, input waits till it's done */
+    const struct ictrl_cmd_s *cmd;
+    int cmd_argc;
+    char *cmd_argv[ICTRL_ARGC_MAX]; /* Point into line */
+    unsigned int cmd_pass;
+
+    /* Statistics counters */
+    uint32_t stat_rx_bytes;
 } ictrl_cdc_downstream_t;
 
 typedef struct cdc_ictrl_s {
 	ictrl_cdc_upstream_t	us;
 	ictrl_cdc_downstream_t	ds;
 	cdc_dfi_t dfi;
+	const av_pool_t *pool;      /* Buffers are allocated from, reported by "mem" */
 } cdc_ictrl_t;
 
+/* Pool space taken, including the alignment */
+#define CDC_ICTRL_POOL_SIZE(_us_size, _ds_size) \
+        ((_us_size) + (_ds_size) + CDC_DATA_OUT_PACKET_SIZE + 2U * AV_POOL_ALIGN)
+
 /* There is no reason to keep multiple ictrl instances, thus
  * don't pass its context to functions, but get the context
  * as a global variable instead */
-extern void cdc_ictrl_init(USBD_CDC_Handle *hcdc);
-extern int ictrl_printf_nonisr(const char *format, ...);
+/* Returns 0 on success, -1 if sizes are invalid or the pool is exhausted */
+extern int cdc_ictrl_init(USBD_CDC_Handle *hcdc, av_pool_t *pool, uint32_t us_size, uint32_t ds_size);
+/* Console output, any context. Messages are formatted by av-fmt.h straight
+ * into the ring, whole or dropped. Return bytes written, 0 if dropped */
+extern int ictrl_printf(const char *format, ...);
 extern int ictrl_print_out(const char *in_buff, int in_buff_len);
+/* Output ring room, main loop */
+extern uint32_t ictrl_out_free(void);
+/* Ring size, high-water mark and time above 75% in a line, main loop */
+extern void ictrl_ring_report(const char *name, const av_ring_t *r);
+
+/*
+ * Deferred logging, any context.
+ *
+ * With ICTRL_LOG_BINARY the device doesn't format anything. The format
+ * string goes into the .ictrl_log section, which isn't loaded to the
+ * target, and its offset there is the string ID. The record carrying the
+ * ID, a millisecond timestamp and raw arguments is put into the console
+ * stream as is, tools/ictrl_log_decode.py rebuilds the text from the ELF.
+ * Arguments are 32 bit integers, up to ICTRL_LOG_ARGS_MAX. %s isn't supported.
+ *
+ * Otherwise ICTRL_LOG() is ictrl_printf().
+ */
+#ifndef ICTRL_LOG_BINARY
+#define ICTRL_LOG_BINARY    0
+#endif
+
+#define ICTRL_LOG_ARGS_MAX  6
+#define ICTRL_LOG_MAGIC     0xF5U   /* Record start, never appears in ASCII or UTF-8 text */
+#define ICTRL_IMON_MAGIC    0xF6U   /* imon_rec_t, streamed in either mode */
+/* 0xF7 and 0xF8 start RPC frames, see ictrl_rpc.h */
+
+/* Binary record, little endian. Followed by nargs 32 bit arguments */
+#pragma pack(push, 1)
+typedef struct ictrl_log_hdr_s {
+    uint8_t magic;
+    uint8_t nargs;
+    uint16_t id;                            /* Format string offset in .ictrl_log */
+    uint32_t ts_ms;
+} ictrl_log_hdr_t;
+#pragma pack(pop)
+
+#define ICTRL_LOG_NARGS(...)    ICTRL_LOG_NARGS_(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define ICTRL_LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _n, ...) _n
+
+#if ICTRL_LOG_BINARY
+#define ICTRL_LOG(_fmt, ...) do { \
+        static const char _ictrl_log_fmt[] __attribute__((section(".ictrl_log"), used)) = _fmt; \
+        ictrl_log_bin((uint32_t)(uintptr_t)_ictrl_log_fmt, ICTRL_LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__); \
+    } while (0)
+#else
+#define ICTRL_LOG(_fmt, ...) ictrl_printf(_fmt, ##__VA_ARGS__)
+#endif
+
+/* Returns record length, 0 if it doesn't fit the ring and is dropped */
+extern int ictrl_log_bin(uint32_t id, int nargs, ...);
+
+/*
+ * Console commands. Modules register their tables at init, lookup is by
+ * exact name. The command line is split by blanks, argv[0] is the name.
+ */
+#define ICTRL_CMD_MAX   32
+
+/* Handler return value to be called again once the output is drained,
+ * for listings larger than the output ring. See ictrl_cmd_pass() */
+#define ICTRL_CMD_MORE  1
+
+typedef struct ictrl_cmd_s {
+    const char *name;
+    const char *args;                       /* Synopsis, "" if none */
+    const char *help;                       /* One line description */
+    int (*handler)(int argc, char *argv[]); /* Negative on bad arguments, usage is printed then */
+} ictrl_cmd_t;
+
+/* Table must stay valid. Returns -1 if the registry is full or a name is taken */
+extern int ictrl_cmd_register(const ictrl_cmd_t *cmds, unsigned int num);
+
+/* Decimal or 0x hex. Returns -1 if arg isn't a number */
+extern int ictrl_arg_uint(const char *arg, uint32_t *val);
+
+/* Calls of the running command before this one, 0 on the first */
+extern unsigned int ictrl_cmd_pass(void);
+
+/* Handler result for no such command or a bad line, ictrl_cmd_exec() only */
+#define ICTRL_CMD_UNKNOWN   2
+
+/*
+ * Runs a command line in a single pass, main loop. Returns the handler
+ * result, ICTRL_CMD_MORE if the command had more to say. Usage is printed
+ * on bad arguments.
+ * Used by RPC with the output captured.
+ */
+extern int ictrl_cmd_exec(char *line);
+
+/* Main loop output goes to buff until stopped, ISRs still print to the ring.
+ * Stop returns the captured length, -1 if output was cut */
+extern void ictrl_capture_start(uint8_t *buff, uint32_t size);
+extern int ictrl_capture_stop(void);
@@ -1,55 +1,105 @@
 #include "string.h"
 #include "cdc_uart.h"
+#include "cdc_uart_ll.h"
+#include "cdc_ictrl.h"
+#include "stats.h"
 #include "av-generic.h"
 
-cdc_uart_t g_cdc_uart1;
+cdc_uart_t g_cdc_uart[USBD_CDC_UART_NUM];
 
-static int UART_CDC_UPSTREAM_AVAILABLE(uart_cdc_upstream_t *us)
+/* UART instances which might be bridged. Index for huart -> bridge lookup */
+enum cdc_uart_inst_e {
+	CDC_UART_INST_USART1,
+	CDC_UART_INST_USART2,
+	CDC_UART_INST_LPUART1,
+	CDC_UART_INST_NUM
+};
+
+static cdc_uart_t *g_cdc_uart_by_inst[CDC_UART_INST_NUM];
+
+CTASSERT(AV_RING_IS_POW2(CDC_UART_FRAME_QUEUE_LEN));
+CTASSERT(CDC_UART_FRAME_BUFF_SIZE > sizeof(cdc_uart_frame_hdr_t));
+CTASSERT(CDC_UART_RTS_HIGH_WM(CDC_UART_UP_BUFF_SIZE_MIN) <= CDC_UART_UP_BUFF_SIZE_MIN / 2);
+CTASSERT(CDC_UART_RTS_LOW_WM(CDC_UART_UP_BUFF_SIZE_MIN) < CDC_UART_RTS_HIGH_WM(CDC_UART_UP_BUFF_SIZE_MIN));
+
+/* USART and LPUART BRR limits, RM0367 */
+#define CDC_UART_BRR_MIN    0x10U
+#define CDC_UART_BRR_MAX    0xFFFFU
+#define CDC_LPUART_BRR_MIN  0x300U
+#define CDC_LPUART_BRR_MAX  0xFFFFFU
+
+/* Any non-zero, the checker is self-synchronizing */
+#define CDC_UART_PRBS_SEED  0x7FFFU
+
+static int cdc_uart_inst_idx(const UART_HandleTypeDef *huart)
 {
-    /* Ensure usart_wr_idx read only once.
-     * Otherwise it need to protected by interrupt dis/en */
-    int uart_wr_idx = us->uart_wr_idx;
+	return (huart->Instance == USART1) ? CDC_UART_INST_USART1 :
+			(huart->Instance == USART2) ? CDC_UART_INST_USART2 :
+			(huart->Instance == LPUART1) ? CDC_UART_INST_LPUART1 : -1;
+}
 
-    return (uart_wr_idx >= us->usbd_rd_idx) ?
-                (uart_wr_idx - us->usbd_rd_idx) :
-                (uart_wr_idx - us->usbd_rd_idx + UART_CDC_UPSTREAM_BUFF_SIZE);
+/* USART1 is on APB2, the others are on APB1. All are clocked by PCLK */
+static uint32_t cdc_uart_pclk(const UART_HandleTypeDef *huart)
+{
+	return (huart->Instance == USART1) ?
+			HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
 }
 
+/* USART1/USART2 have receiver timeout, LPUART doesn't */
+static int cdc_uart_has_rto(const UART_HandleTypeDef *huart)
+{
+	return !UART_INSTANCE_LOWPOWER(huart);
+}
 
-static void cdc_uart_upstream_rx_cont(uart_cdc_upstream_t *upstream)
+/*
+ * Receiver timeout is counted in bit times, thus convert frames of
+ * the current line coding into bits. Called on init and line coding change.
+ */
+static void cdc_uart_rto_config(UART_HandleTypeDef *huart)
 {
-	int d_free, d_border;
-	int bytes_to_rx;
+	uint32_t frame_bits;
 
-	int uart_wr_idx = upstream->uart_wr_idx;
+	if (!cdc_uart_has_rto(huart)) {
+		return;
+	}
 
-	__disable_irq(); // AV: REmove me
+	/* Start bit, data bits including parity, stop bits. 1.5 is rounded up */
+	frame_bits = 1U +
+			((huart->Init.WordLength == UART_WORDLENGTH_9B) ? 9U :
+			 (huart->Init.WordLength == UART_WORDLENGTH_7B) ? 7U : 8U) +
+			((huart->Init.StopBits == UART_STOPBITS_1) ? 1U : 2U);
 
-	/* Get number of free bytes in buffer */
-	d_free = upstream->usbd_rd_idx - uart_wr_idx - 1;
-	if (d_free < 0) d_free += UART_CDC_UPSTREAM_BUFF_SIZE;
+	cdc_uart_ll_rto_set(huart, frame_bits * CDC_UART_RTO_CHARS);
+}
 
-	if (d_free == 0) {
-		/* Overflow - something wrong with buffer unloading */
-		/* Discard oldest chunk and continue RX as usually */
-		upstream->usbd_rd_idx += UART_CDC_UPSTREAM_CHUNK_SIZE;
-		if (upstream->usbd_rd_idx >= UART_CDC_UPSTREAM_BUFF_SIZE) {
-			upstream->usbd_rd_idx -= UART_CDC_UPSTREAM_BUFF_SIZE;
-		}
-		d_free = UART_CDC_UPSTREAM_CHUNK_SIZE;
-		upstream->uart_ovfl_bytes += UART_CDC_UPSTREAM_CHUNK_SIZE;
-		upstream->uart_ovfl_cnt ++;
+/*
+ * (Re)start circular DMA reception into the upstream buffer.
+ * DMA writes continuously into us->buff, and the ring write index is
+ * advanced from DMA HT/TC and USART IDLE events (see HAL_UARTEx_RxEventCallback).
+ */
+static void cdc_uart_upstream_rx_cont(uart_cdc_upstream_t *upstream)
+{
+	/* Circular DMA always starts from the buffer origin. Thus, the data
+	 * not yet sent to the host have to be flushed before the restart. */
+	if (av_ring_used(&upstream->ring) || upstream->frame_tx_left) {
+		upstream->flush = 1;
+		return;
 	}
 
-	/* Get number of free bytes till border */
-	d_border = UART_CDC_UPSTREAM_BUFF_SIZE - uart_wr_idx;
-
-	bytes_to_rx = MIN(UART_CDC_UPSTREAM_CHUNK_SIZE, d_free);
-	bytes_to_rx = MIN(bytes_to_rx, d_border);
+	/* Indices keep running, so frames queued before the restart
+	 * are seen as already consumed */
+	av_ring_rewind(&upstream->ring);
+	upstream->frame_end_idx = upstream->ring.wr_idx;
 
-	HAL_UART_Receive_IT(upstream->huart, &upstream->buff[uart_wr_idx], bytes_to_rx);
+	if (HAL_OK == HAL_UARTEx_ReceiveToIdle_DMA(upstream->huart,
+			upstream->buff, (uint16_t)upstream->ring.size)) {
+		upstream->cont_rx = 0;
 
-	__enable_irq(); // AV: REmove me
+		/* Flush on receiver timeout instead of IDLE line, see cdc_uart_irq_hook() */
+		if (cdc_uart_has_rto(upstream->huart)) {
+			cdc_uart_ll_rto_irq_enable(upstream->huart);
+		}
+	}
 
 	return;
 }
@@ -57,168 +107,582 @@ static void cdc_uart_upstream_rx_cont(uart_cdc_upstream_t *upstream)
 void cdc_uart_upstream_send (uart_cdc_upstream_t *us)
 {
 	USBD_Status usbd_rc;
-	int bytes_available;
+	uint8_t *rd_ptr;
 	int bytes_to_tx;
-	int till_border;
-	int uart_wr_idx = us->uart_wr_idx;  /* Ensure atomic usage */
-
-	__disable_irq(); // AV: TODO: remove me and test carefully
-	bytes_available = UART_CDC_UPSTREAM_AVAILABLE(us);
 
-	till_border = UART_CDC_UPSTREAM_BUFF_SIZE - us->usbd_rd_idx;
+	if (us->usbd_tx_len) {
+		/* Previous transfer is not completed yet */
+		return;
+	}
 
-	/* (CDC_DATA_IN_PACKET_SIZE - 1) is to avoid ZLP exchange. */
-	bytes_to_tx = MIN(CDC_DATA_IN_PACKET_SIZE - 1, bytes_available);
-	bytes_to_tx = MIN(bytes_to_tx, till_border);
+	/* Whole contiguous span at once. CDC class splits it to packets */
+	bytes_to_tx = av_ring_rd_span(&us->ring, &rd_ptr);
 
-	usbd_rc = USBD_CDC_TransmitPacket(
-			us->hcdc,
-			&us->buff[us->usbd_rd_idx],
-			(uint16_t)bytes_to_tx);
+	/* Ring data is released on transfer completion, which might
+	 * happen inside the call, i.e. when USB isn't configured */
+	us->usbd_tx_len = bytes_to_tx;
+	usbd_rc = USBD_CDC_TransmitPacket(us->hcdc, rd_ptr, (uint16_t)bytes_to_tx);
 
 	if (usbd_rc == USBD_OK) {
-		us->stat_usbd_tx_bytes += bytes_to_tx;
+		/* Nothing more to flush. Clear the flag first, so RX event
+		 * arrived in between isn't lost */
+		us->flush = 0;
+		AV_RING_BARRIER();
+		if (av_ring_used(&us->ring) > (uint32_t)us->usbd_tx_len) {
+			us->flush = 1;
+		}
+	} else {
+		us->usbd_tx_len = 0;
+	}
+}
 
-		us->usbd_rd_idx += bytes_to_tx;
-		assert_param(us->usbd_rd_idx <= UART_CDC_UPSTREAM_BUFF_SIZE);
-		if (us->usbd_rd_idx >= UART_CDC_UPSTREAM_BUFF_SIZE) {
-			us->usbd_rd_idx -= UART_CDC_UPSTREAM_BUFF_SIZE;
+/* Any context */
+static void cdc_uart_upstream_serial_event(uart_cdc_upstream_t *us, uint16_t events)
+{
+	__disable_irq();
+	us->serial_events |= events;
+	__enable_irq();
+}
+
+/*
+ * Circular DMA doesn't care about the reader. If it has overwritten
+ * the oldest data not yet sent to USB, then count and discard them.
+ * Called by the ring consumer: SOF ISR for raw upstream, the main loop
+ * for framed and PRBS ones. The other one doesn't touch the ring then.
+ */
+static void cdc_uart_upstream_ovfl_check(uart_cdc_upstream_t *us)
+{
+	uint32_t used, rd_idx, from, to;
+	uint32_t lost = 0;
+
+	used = av_ring_used(&us->ring);
+	if (used > us->ring.size) {
+		/* Overwritten are [rd_idx, to). Ones counted while a raw
+		 * transfer of them was in flight are counted up to ovfl_idx */
+		rd_idx = us->ring.rd_idx;
+		to = rd_idx + used - us->ring.size;
+		from = (us->ovfl_idx - rd_idx <= us->ring.size) ? us->ovfl_idx : rd_idx;
+		if ((int32_t)(to - from) > 0) {
+			lost = to - from;
+			us->ovfl_idx = to;
 		}
 
-		/* Stop t/o timer if no more data */
-		if (us->usbd_rd_idx == uart_wr_idx) {
-			us->timeout = -1;
+		/* Ring is consumed on raw USB TX completion, don't compete with it.
+		 * Framed data are copied out of the ring already */
+		if (!us->usbd_tx_len || us->usbd_tx_framed) {
+			av_ring_consume(&us->ring, used - us->ring.size);
 		}
 	}
-	__enable_irq(); // AV: TODO: remove me and test carefully
 
+	if (lost) {
+		us->uart_ovfl_bytes += lost;
+		us->uart_ovfl_cnt ++;
+		cdc_uart_upstream_serial_event(us, CDC_SERIAL_STATE_OVERRUN);
+	}
 }
 
-int8_t cdc_uart_get_line_encoding (UART_HandleTypeDef *huart, pstn_line_coding_t *lc)
+/* Active low line */
+static void cdc_uart_gpio_assert(const cdc_uart_gpio_t *gpio, int active)
 {
-	return 0;
+	HAL_GPIO_WritePin(gpio->port, gpio->pin, active ? GPIO_PIN_RESET : GPIO_PIN_SET);
 }
 
-int8_t cdc_uart_set_line_encoding (UART_HandleTypeDef *huart, pstn_line_coding_t *lc)
+static void cdc_uart_upstream_rts_write(uart_cdc_upstream_t *us)
 {
-	return 0;
+	if (us->modem) {
+		cdc_uart_gpio_assert(&us->modem->rts,
+				us->modem->flow_ctrl ? !us->throttled : us->host_rts);
+	}
 }
 
 /*
- * UART RX transaction not finished within reasonable time since
- * the last USB transaction.
- * Steal data from UART transaction and legalize them in the buffer.
- * The data will be transmitted in the idle loop
+ * ISR context. Throttle the target with RTS when the upstream ring
+ * fills up, instead of losing data on the ring overflow. Ring consumed
+ * by the main loop is rechecked on SOF.
  */
-static void uart_cdc_upstream_timer (uart_cdc_upstream_t *us)
+static void cdc_uart_upstream_rts_update(uart_cdc_upstream_t *us)
 {
-	UART_HandleTypeDef *huart = us->huart;
-	int bytes_avail;
+	uint32_t used;
 
-	if (us->timeout == 0) {
-		/* Timer already triggered */
+	if (!us->modem || !us->modem->flow_ctrl) {
 		return;
 	}
 
-	/*
-	 *  Check number of bytes received by UART.
-	 *  Timeout should be initialized at the very 1st byte received
-	 *  by the UART, but there is no callback in ISR. So, let's check it
-	 *  periodically.
-	 */
-	bytes_avail = huart->RxXferSize - huart->RxXferCount;
-	if (us->timeout == -1) {
-	    if (bytes_avail) {
-	        us->timeout = UART_CDC_TIMEOUT_PERIOD_MS;
-	        us->timeout_ts = HAL_GetTick() + UART_CDC_TIMEOUT_PERIOD_MS;
-	    }
-	    return;
+	used = av_ring_used(&us->ring);
+
+	if (!us->throttled && used >= CDC_UART_RTS_HIGH_WM(us->ring.size)) {
+		us->throttled = 1;
+	} else if (us->throttled && used <= CDC_UART_RTS_LOW_WM(us->ring.size)) {
+		us->throttled = 0;
+	} else {
+		return;
 	}
 
-    /* if (us->timeout == 1) */
-	/* Timer is running */
-	if (us->timeout_ts < HAL_GetTick() && bytes_avail) {
-		/* Timeout - steal data from UART */
-		us->timeout = 0;
+	cdc_uart_upstream_rts_write(us);
+}
 
-		__disable_irq();
-            huart->RxXferSize = huart->RxXferCount;
+static int cdc_uart_gpio_is_asserted(const cdc_uart_gpio_t *gpio)
+{
+	return !gpio->port || HAL_GPIO_ReadPin(gpio->port, gpio->pin) == GPIO_PIN_RESET;
+}
 
-            us->stat_uart_rx_bytes += bytes_avail;
-            us->uart_wr_idx += bytes_avail;
+/* DCD and DSR are reported as asserted if not wired */
+static uint16_t cdc_uart_upstream_modem_state(uart_cdc_upstream_t *us)
+{
+	uint16_t state = CDC_SERIAL_STATE_RX_CARRIER | CDC_SERIAL_STATE_TX_CARRIER;
 
-            assert_param(us->uart_wr_idx <= UART_CDC_UPSTREAM_BUFF_SIZE);
-            if (us->uart_wr_idx >= UART_CDC_UPSTREAM_BUFF_SIZE) {
-                us->uart_wr_idx -= UART_CDC_UPSTREAM_BUFF_SIZE;
-            }
-        __enable_irq();
+	if (us->modem) {
+		if (!cdc_uart_gpio_is_asserted(&us->modem->dcd)) {
+			state &= ~CDC_SERIAL_STATE_RX_CARRIER;
+		}
+		if (!cdc_uart_gpio_is_asserted(&us->modem->dsr)) {
+			state &= ~CDC_SERIAL_STATE_TX_CARRIER;
+		}
 	}
 
-	return;
+	return state;
+}
 
+/*
+ * Send SERIAL_STATE notification upon line errors or DCD/DSR change.
+ * Events arrived while the notification is in progress go with the next one.
+ */
+static void cdc_uart_upstream_notify(uart_cdc_upstream_t *us)
+{
+	uint16_t events = us->serial_events;
+	uint16_t state = cdc_uart_upstream_modem_state(us);
+
+	if (!events && state == us->serial_state) {
+		return;
+	}
+
+	if (USBD_OK != USBD_CDC_SerialState(us->hcdc, state | events)) {
+		return;
+	}
+
+	__disable_irq();
+	us->serial_events &= ~events;
+	__enable_irq();
+
+	us->serial_state = state;
+}
+
+/*
+ * PRBS test. Received data are consumed by the checker instead of USB.
+ * USB IN transfer started before the test is let to complete first.
+ */
+static void cdc_uart_upstream_prbs_check(uart_cdc_upstream_t *us)
+{
+	uint8_t *rd_ptr;
+	uint32_t len;
+
+	if (us->usbd_tx_len) {
+		return;
+	}
+
+	while ((len = av_ring_rd_span(&us->ring, &rd_ptr)) != 0) {
+		av_prbs_check(us->prbs_chk, rd_ptr, len);
+		av_ring_consume(&us->ring, len);
+	}
 }
 
+/*
+ * Copy queued frames out of the ring into frame_buff, each preceded by
+ * a header. A record longer than frame_buff continues in the next transfer.
+ * Bytes of the record lost on the ring overflow are sent as zeros, so the
+ * host stays in sync with the record length.
+ * Returns number of bytes filled.
+ */
+static uint32_t cdc_uart_upstream_frame_fill(uart_cdc_upstream_t *us)
+{
+	cdc_uart_frame_hdr_t hdr;
+	cdc_uart_frame_t *frame;
+	uint8_t *rd_ptr;
+	uint32_t fill = 0;
+	uint32_t len;
+	int32_t in_ring;
+
+	while (fill < CDC_UART_FRAME_BUFF_SIZE) {
+		if (!us->frame_tx_left) {
+			if (us->frame_rd_idx == us->frame_wr_idx ||
+				fill + sizeof(hdr) > CDC_UART_FRAME_BUFF_SIZE) {
+				break;
+			}
+
+			frame = &us->frames[us->frame_rd_idx & (CDC_UART_FRAME_QUEUE_LEN - 1)];
+			in_ring = (int32_t)(frame->end_idx - us->ring.rd_idx);
+			us->frame_rd_idx++;
+
+			/* Wholly lost on overflow */
+			if (in_ring <= 0) {
+				continue;
+			}
+
+			hdr.len = (uint16_t)in_ring;
+			hdr.flags = frame->flags | (((uint32_t)in_ring < frame->len) ? CDC_UART_FRAME_TRUNCATED : 0);
+			hdr.ts_us = frame->ts_us;
+			memcpy(&us->frame_buff[fill], &hdr, sizeof(hdr));
+			fill += sizeof(hdr);
+
+			us->frame_tx_end = frame->end_idx;
+			us->frame_tx_left = (uint32_t)in_ring;
+			continue;
+		}
+
+		len = CDC_UART_FRAME_BUFF_SIZE - fill;
+		if (len > us->frame_tx_left) {
+			len = us->frame_tx_left;
+		}
+
+		in_ring = (int32_t)(us->frame_tx_end - us->ring.rd_idx);
+		if (in_ring < (int32_t)us->frame_tx_left) {
+			/* Overflow has taken the head of the rest */
+			if (in_ring < 0) {
+				in_ring = 0;
+			}
+			if (len > us->frame_tx_left - (uint32_t)in_ring) {
+				len = us->frame_tx_left - (uint32_t)in_ring;
+			}
+			memset(&us->frame_buff[fill], 0, len);
+		} else {
+			uint32_t span = av_ring_rd_span(&us->ring, &rd_ptr);
+			if (len > span) {
+				len = span;
+			}
+			memcpy(&us->frame_buff[fill], rd_ptr, len);
+			av_ring_consume(&us->ring, len);
+		}
+
+		fill += len;
+		us->frame_tx_left -= len;
+	}
+
+	return fill;
+}
+
+static void cdc_uart_upstream_frame_send(uart_cdc_upstream_t *us)
+{
+	if (us->usbd_tx_len) {
+		/* Previous transfer is not completed yet */
+		return;
+	}
+
+	if (!us->frame_buff_len) {
+		us->frame_buff_len = cdc_uart_upstream_frame_fill(us);
+	}
+
+	if (!us->frame_buff_len) {
+		return;
+	}
+
+	/* Might be completed inside the call, i.e. when USB isn't configured */
+	us->usbd_tx_len = us->frame_buff_len;
+	us->usbd_tx_framed = 1;
+
+	if (USBD_OK == USBD_CDC_TransmitPacket(us->hcdc, us->frame_buff, (uint16_t)us->frame_buff_len)) {
+		us->frame_buff_len = 0;
+	} else {
+		us->usbd_tx_len = 0;
+		us->usbd_tx_framed = 0;
+	}
+}
+
+/*
+ * Raw upstream is sent from SOF ISR only, framed and PRBS ones are
+ * copied out of the ring here. Both modes are switched from the main loop.
+ */
 static void cdc_uart_upstream_on_idle(uart_cdc_upstream_t *us)
 {
-	int bytes_available;
+	if (us->prbs_chk) {
+		cdc_uart_upstream_ovfl_check(us);
+		cdc_uart_upstream_prbs_check(us);
+	} else if (us->framing != CDC_UART_FRAMING_NONE) {
+		cdc_uart_upstream_ovfl_check(us);
+		cdc_uart_upstream_frame_send(us);
+	}
 
-	/* Initiate new RX transaction on UART if previous finished */
-	if (us->cont_rx) {
-		us->cont_rx = 0;
-		cdc_uart_upstream_rx_cont(us);
+	cdc_uart_upstream_notify(us);
+}
+
+/*
+ * ISR context. Start UART DMA on the largest contiguous span of the ring,
+ * if not running yet.
+ */
+static void cdc_uart_downstream_tx_kick(uart_cdc_downstream_t *ds)
+{
+	uint8_t *buff;
+	uint32_t len;
+
+	if (ds->uart_tx_busy || ds->uart_tx_hold ||
+		(!ds->prbs_tx && !av_ring_used(&ds->ring))) {
+		return;
+	}
+
+	/* CTS is checked per transfer, i.e. the target might receive up to
+	 * CDC_UART_DOWN_CTS_CHUNK bytes after deasserting CTS */
+	if (ds->modem && ds->modem->flow_ctrl &&
+		HAL_GPIO_ReadPin(ds->modem->cts.port, ds->modem->cts.pin) != GPIO_PIN_RESET) {
+		return;
+	}
+
+	if (ds->prbs_tx) {
+		/* PRBS test, the generator stands for the USB host */
+		av_prbs_fill(&ds->prbs_gen, ds->prbs_buff, sizeof(ds->prbs_buff));
+		buff = ds->prbs_buff;
+		len = sizeof(ds->prbs_buff);
+	} else {
+		len = av_ring_rd_span(&ds->ring, &buff);
+		if (ds->modem && ds->modem->flow_ctrl && len > CDC_UART_DOWN_CTS_CHUNK) {
+			len = CDC_UART_DOWN_CTS_CHUNK;
+		}
+	}
+
+	if (HAL_OK == HAL_UART_Transmit_DMA(ds->huart, buff, (uint16_t)len)) {
+		ds->uart_tx_busy = 1;
+		ds->uart_tx_prbs = ds->prbs_tx;
+		ds->uart_tx_len = ds->prbs_tx ? 0 : len;
+	}
+}
+
+/*
+ * ISR context. Request next packet from USB host, if a whole one fits the ring.
+ */
+static void cdc_uart_downstream_rx_kick(uart_cdc_downstream_t *ds)
+{
+	if (ds->prbs_tx || ds->usbd_rx_armed ||
+		av_ring_free(&ds->ring) < CDC_DATA_OUT_PACKET_SIZE) {
+		return;
+	}
+
+	if (USBD_OK == USBD_CDC_ReceivePacket(ds->hcdc)) {
+		ds->usbd_rx_armed = 1;
+	}
+}
+
+/* Both USB and UART must be stopped. Line coding hold is kept */
+static void cdc_uart_downstream_reset(uart_cdc_downstream_t *ds)
+{
+	av_ring_reset(&ds->ring);
+	ds->uart_tx_len = 0;
+	ds->usbd_rx_armed = 0;
+	ds->uart_tx_busy = 0;
+	ds->uart_tx_prbs = 0;
+}
+
+static void cdc_uart_get_line_encoding (cdc_uart_t *cdc_uart, pstn_line_coding_t *lc)
+{
+	*lc = cdc_uart->line_coding;
+}
+
+/*
+ * ISR context. Settings are applied later from the main loop, see
+ * cdc_uart_line_coding_on_idle(). Downstream is held meanwhile.
+ */
+static void cdc_uart_set_line_encoding (cdc_uart_t *cdc_uart, const pstn_line_coding_t *lc)
+{
+	cdc_uart->line_coding_req = *lc;
+	cdc_uart->ds.uart_tx_hold = 1;
+	cdc_uart->line_coding_pending = 1;
+}
+
+/*
+ * Reprogram USART frame format and baud rate on the fly.
+ * Circular RX DMA keeps running, USART just doesn't issue requests while
+ * disabled. Thus the data already in the upstream ring are kept intact.
+ * Returns 0 on success, -1 if the line coding isn't supported.
+ */
+static int cdc_uart_line_coding_apply(UART_HandleTypeDef *huart, const pstn_line_coding_t *lc)
+{
+	uint32_t pclk = cdc_uart_pclk(huart);
+	uint32_t word_len, parity, stop_bits, over8;
+	uint32_t usartdiv, brr;
+
+	switch (lc->bParityType) {
+	case 0: parity = UART_PARITY_NONE; break;
+	case 1: parity = UART_PARITY_ODD;  break;
+	case 2: parity = UART_PARITY_EVEN; break;
+	default:
+		/* Mark and space parity aren't supported by USART */
+		return -1;
+	}
+
+	switch (lc->bCharFormat) {
+	case 0: stop_bits = UART_STOPBITS_1;   break;
+	case 1:
+		/* STOP=01 is reserved on LPUART */
+		if (UART_INSTANCE_LOWPOWER(huart)) {
+			return -1;
+		}
+		stop_bits = UART_STOPBITS_1_5;
+		break;
+	case 2: stop_bits = UART_STOPBITS_2;   break;
+	default:
+		return -1;
+	}
+
+	/* USART word length includes parity bit */
+	switch (lc->bDataBits) {
+	case 7:
+		word_len = (parity == UART_PARITY_NONE) ? UART_WORDLENGTH_7B : UART_WORDLENGTH_8B;
+		break;
+	case 8:
+		word_len = (parity == UART_PARITY_NONE) ? UART_WORDLENGTH_8B : UART_WORDLENGTH_9B;
+		break;
+	default:
+		return -1;
 	}
 
-	/* Send data upstream when available */
-	bytes_available = UART_CDC_UPSTREAM_AVAILABLE(us);
-	if (bytes_available) {
-		if (us->timeout == 0 || bytes_available >= CDC_DATA_IN_PACKET_SIZE) {
-			cdc_uart_upstream_send(us);
+	if (lc->dwDTERate == 0) {
+		return -1;
+	}
+
+	if (UART_INSTANCE_LOWPOWER(huart)) {
+		/* LPUART has no oversampling, max baud rate is PCLK/3 */
+		usartdiv = (uint32_t)UART_DIV_LPUART(pclk, lc->dwDTERate);
+		if (usartdiv < CDC_LPUART_BRR_MIN || usartdiv > CDC_LPUART_BRR_MAX) {
+			return -1;
+		}
+		over8 = UART_OVERSAMPLING_16;
+		brr = usartdiv;
+	} else {
+		/* Oversampling by 16 is more noise tolerant, use it while possible.
+		 * Oversampling by 8 doubles the max baud rate, i.e. up to PCLK/8 */
+		usartdiv = UART_DIV_SAMPLING16(pclk, lc->dwDTERate);
+		if (usartdiv >= CDC_UART_BRR_MIN) {
+			over8 = UART_OVERSAMPLING_16;
+			brr = usartdiv;
+		} else {
+			usartdiv = UART_DIV_SAMPLING8(pclk, lc->dwDTERate);
+			if (usartdiv < CDC_UART_BRR_MIN) {
+				return -1;
+			}
+			over8 = UART_OVERSAMPLING_8;
+			brr = (usartdiv & 0xFFF0U) | ((usartdiv & 0x000FU) >> 1U);
+		}
+
+		if (usartdiv > CDC_UART_BRR_MAX) {
+			return -1;
 		}
 	}
 
-	uart_cdc_upstream_timer(us);
+	cdc_uart_ll_frame_set(huart, word_len, parity, stop_bits, over8, brr);
+
+	/* Keep HAL handle consistent */
+	huart->Init.BaudRate = lc->dwDTERate;
+	huart->Init.WordLength = word_len;
+	huart->Init.Parity = parity;
+	huart->Init.StopBits = stop_bits;
+	huart->Init.OverSampling = over8;
+
+	cdc_uart_rto_config(huart);
+
+	return 0;
 }
 
-static void cdc_uart_downstream_on_idle (uart_cdc_downstream_t *ds)
+static void cdc_uart_line_coding_on_idle(cdc_uart_t *cdc_uart)
 {
-    if (ds->uart_ready_to_tx) {
-    	/* If no more data for UART TX, then request next data bunch from USB */
-	    if (USBD_OK == USBD_CDC_ReceivePacket(ds->hcdc)) {
-	  	    ds->uart_ready_to_tx = 0;
-	    }
-    }
+	uart_cdc_downstream_t *ds = &cdc_uart->ds;
+	pstn_line_coding_t lc;
 
-    if (ds->cdc_data_received) {
-    	__disable_irq();
+	if (!cdc_uart->line_coding_pending) {
+		return;
+	}
 
-    	HAL_UART_Transmit_DMA(ds->huart,
-            ds->buff, ds->cdc_data_received);
+	/* Let the span being sent go out with the old settings.
+	 * Queued data are sent with the new ones. */
+	if (ds->uart_tx_busy) {
+		return;
+	}
 
-	    ds->cdc_data_received = 0;
+	__disable_irq();
+	lc = cdc_uart->line_coding_req;
+	cdc_uart->line_coding_pending = 0;
+	__enable_irq();
 
-	    __enable_irq();
+	/* Unsupported line coding is ignored. GET_LINE_CODING reports
+	 * the settings actually in use */
+	if (cdc_uart_line_coding_apply(ds->huart, &lc) == 0) {
+		cdc_uart->line_coding = lc;
+	}
 
-    }
+	/* Another request might have arrived in between, keep holding then */
+	__disable_irq();
+	if (!cdc_uart->line_coding_pending) {
+		ds->uart_tx_hold = 0;
+		cdc_uart_downstream_tx_kick(ds);
+	}
+	__enable_irq();
 }
 
+/* Report the settings made by MX_USARTx_UART_Init() */
+static void cdc_uart_line_coding_init(cdc_uart_t *cdc_uart, UART_HandleTypeDef *huart)
+{
+	pstn_line_coding_t *lc = &cdc_uart->line_coding;
+
+	lc->dwDTERate = huart->Init.BaudRate;
+	lc->bCharFormat = (huart->Init.StopBits == UART_STOPBITS_2) ? 2 :
+			(huart->Init.StopBits == UART_STOPBITS_1_5) ? 1 : 0;
+	lc->bParityType = (huart->Init.Parity == UART_PARITY_ODD) ? 1 :
+			(huart->Init.Parity == UART_PARITY_EVEN) ? 2 : 0;
+	lc->bDataBits = (huart->Init.WordLength == UART_WORDLENGTH_9B) ? 8 :
+			(huart->Init.WordLength == UART_WORDLENGTH_7B) ? 7 :
+			(huart->Init.Parity == UART_PARITY_NONE) ? 8 : 7;
+
+	cdc_uart->line_coding_pending = 0;
+}
 
-void cdc_uart_downstream_init (
+int cdc_uart_downstream_init (
 		uart_cdc_downstream_t *ds,
 		USBD_CDC_Handle *hcdc,
-		UART_HandleTypeDef *huart)
+		UART_HandleTypeDef *huart,
+		const cdc_uart_modem_t *modem,
+		av_pool_t *pool,
+		uint32_t size)
 {
+	if (!AV_RING_IS_POW2(size) ||
+		size < CDC_UART_DOWN_BUFF_SIZE_MIN || size > CDC_UART_DOWN_BUFF_SIZE_MAX) {
+		return -1;
+	}
+
+	/* Extra tail for OUT packet received at the ring end */
+	ds->buff = av_pool_alloc(pool, size + CDC_DATA_OUT_PACKET_SIZE);
+	if (!ds->buff) {
+		return -1;
+	}
+
 	ds->hcdc = hcdc;
 	ds->huart = huart;
-	ds->uart_ready_to_tx = 1;
+	ds->modem = modem;
+	ds->uart_tx_hold = 0;
+	av_ring_init(&ds->ring, ds->buff, size);
+	cdc_uart_downstream_reset(ds);
+	return 0;
 }
 
-void cdc_uart_upstream_init (
+int cdc_uart_upstream_init (
 		uart_cdc_upstream_t *us,
 		USBD_CDC_Handle *hcdc,
-		UART_HandleTypeDef *huart)
+		UART_HandleTypeDef *huart,
+		const cdc_uart_modem_t *modem,
+		av_pool_t *pool,
+		uint32_t size)
 {
+	/* DMA HT/TC granularity and 16 bit HAL transfer size */
+	if (!AV_RING_IS_POW2(size) || size < CDC_UART_UP_BUFF_SIZE_MIN || size > 0x8000U) {
+		return -1;
+	}
+
+	us->buff = av_pool_alloc(pool, size);
+	if (!us->buff) {
+		return -1;
+	}
+
 	us->hcdc = hcdc;
 	us->huart = huart;
+	us->modem = modem;
+	av_ring_init(&us->ring, us->buff, size);
+	cdc_uart_rto_config(huart);
+	return 0;
 }
 
 
@@ -228,106 +692,317 @@ void cdc_uart_upstream_init (
  *****************************************************************************/
 static uart_cdc_upstream_t *get_us_by_dfi (cdc_dfi_t *dfi)
 {
-#if MULTI_UART
-    uart_cdc_upstream_t *us = &((cdc_uart_t)dfi->ctx)->us;
-    return us;
-#else
-    return &g_cdc_uart1.us;
-#endif
+    return &dfi->ctx.cdc_uart->us;
 }
 
 static uart_cdc_downstream_t *get_ds_by_dfi (cdc_dfi_t *dfi)
 {
-#if MULTI_UART
-    uart_cdc_downstream_t *ds = &((cdc_uart_t)dfi->ctx)->ds;
-    return us;
-#else
-    return &g_cdc_uart1.ds;
-#endif
+    return &dfi->ctx.cdc_uart->ds;
+}
+
+/* NULL if the UART isn't bridged */
+static cdc_uart_t *get_cdc_uart_by_huart(UART_HandleTypeDef *huart)
+{
+    int idx = cdc_uart_inst_idx(huart);
+    return (idx < 0) ? NULL : g_cdc_uart_by_inst[idx];
 }
 
 static uart_cdc_upstream_t *get_us_by_huart(UART_HandleTypeDef *huart)
 {
-#if MULTI_UART
-    uart_cdc_upstream_t *us =
-            (g_cdc_uart1.us.huart == huart) ? &g_cdc_uart1.us : NULL;
-    assert(us);
-    return us;
-#else
-    return &g_cdc_uart1.us;
-#endif
+    cdc_uart_t *cdc_uart = get_cdc_uart_by_huart(huart);
+    return cdc_uart ? &cdc_uart->us : NULL;
 }
 
 static uart_cdc_downstream_t *get_ds_by_huart(UART_HandleTypeDef *huart)
 {
-#if MULTI_UART
-    uart_cdc_downstream_t *ds =
-            (g_cdc_uart1.ds.huart == huart) ? &g_cdc_uart1.ds : NULL;
-    assert(ds);
-    return ds;
-#else
-    return &g_cdc_uart1.ds;
-#endif
+    cdc_uart_t *cdc_uart = get_cdc_uart_by_huart(huart);
+    return cdc_uart ? &cdc_uart->ds : NULL;
 }
 
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 {
 	uart_cdc_downstream_t *ds = get_ds_by_huart(huart);
-	ds->uart_ready_to_tx = 1;
+
+	if (!ds) {
+		return;
+	}
+
+	/* PRBS generator output isn't in the ring, uart_tx_len is 0 then */
+	av_ring_consume(&ds->ring, ds->uart_tx_len);
+	ds->stat_uart_tx_bytes += huart->TxXferSize;
+	ds->uart_tx_len = 0;
+	ds->uart_tx_busy = 0;
+	ds->uart_tx_prbs = 0;
+
+	/* Chain the next span, then let USB refill the drained space */
+	cdc_uart_downstream_tx_kick(ds);
+	cdc_uart_downstream_rx_kick(ds);
+}
+
+/*
+ * ISR context. Count line errors, USART_ISR_xxx, and map them to
+ * SERIAL_STATE events. Errored byte is delivered by DMA as is.
+ * USART reports break as a framing error on all-zero frame, thus
+ * check the last received byte.
+ */
+static void cdc_uart_upstream_line_errors(uart_cdc_upstream_t *us,
+		UART_HandleTypeDef *huart, uint32_t errors)
+{
+	uint16_t events = 0;
+	uint32_t dma_pos;
+
+	if (errors & USART_ISR_PE) {
+		us->uart_pe_cnt++;
+		events |= CDC_SERIAL_STATE_PARITY;
+	}
+	if (errors & USART_ISR_NE) {
+		/* Byte is likely valid, sampling has just disagreed */
+		us->uart_ne_cnt++;
+	}
+	if (errors & USART_ISR_ORE) {
+		us->uart_ore_cnt++;
+		events |= CDC_SERIAL_STATE_OVERRUN;
+	}
+	if (errors & USART_ISR_FE) {
+		dma_pos = cdc_uart_ll_rx_dma_pos(huart, us->ring.size);
+		if (us->buff[(dma_pos - 1) & us->ring.mask] == 0) {
+			us->uart_brk_cnt++;
+			events |= CDC_SERIAL_STATE_BREAK;
+		} else {
+			us->uart_fe_cnt++;
+			events |= CDC_SERIAL_STATE_FRAMING;
+		}
+	}
+
+	if (events) {
+		cdc_uart_upstream_serial_event(us, events);
+	}
 }
 
+/*
+ * Line errors are handled by cdc_uart_irq_hook(), so HAL gets here on
+ * DMA errors only, with the reception aborted. Restart it right away,
+ * unless the ring has data to flush first, then SOF does it.
+ */
 void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
 {
 	uart_cdc_upstream_t *us = get_us_by_huart(huart);
+
+	if (!us) {
+		return;
+	}
+
 	us->uart_err_cnt++;
+	ICTRL_LOG("bridge%d DMA error 0x%lx\r\n",
+			(int)(get_cdc_uart_by_huart(huart) - g_cdc_uart), huart->ErrorCode);
+
+	if (huart->RxState == HAL_UART_STATE_READY) {
+		us->cont_rx = 1;
+		cdc_uart_upstream_rx_cont(us);
+	}
 }
 
-void HAL_UART_RxCpltCallback (UART_HandleTypeDef *huart)
+/* ISR context. Queue a frame ending at the ring index end_idx */
+static void cdc_uart_upstream_frame_end(uart_cdc_upstream_t *us,
+		uint32_t end_idx, uint32_t ts_us, uint16_t flags)
 {
-    uart_cdc_upstream_t *us = get_us_by_huart(huart);
+	cdc_uart_frame_t *frame;
 
-	us->stat_uart_rx_bytes += huart->RxXferSize;
-	us->uart_wr_idx += huart->RxXferSize;
-	assert_param(us->uart_wr_idx <= UART_CDC_UPSTREAM_BUFF_SIZE);
-	if (us->uart_wr_idx >= UART_CDC_UPSTREAM_BUFF_SIZE) {
-		us->uart_wr_idx -= UART_CDC_UPSTREAM_BUFF_SIZE;
+	/* Nothing since the last one, i.e. line went silent after a delimiter */
+	if (end_idx == us->frame_end_idx) {
+		return;
 	}
 
-	/* Restart timer if stopped */
-	if (us->timeout == -1 ) {
-        us->timeout = 1;
-        us->timeout_ts = UART_CDC_TIMEOUT_PERIOD_MS + HAL_GetTick();
+	/* Merged with the next frame */
+	if (us->frame_wr_idx - us->frame_rd_idx >= CDC_UART_FRAME_QUEUE_LEN) {
+		us->frame_merge_cnt++;
+		return;
 	}
 
-	huart->RxXferSize = 0;
-	huart->RxXferCount = 0;
-	us->cont_rx = 1;
+	frame = &us->frames[us->frame_wr_idx & (CDC_UART_FRAME_QUEUE_LEN - 1)];
+	frame->end_idx = end_idx;
+	frame->len = end_idx - us->frame_end_idx;
+	frame->ts_us = ts_us;
+	frame->flags = flags;
+	us->frame_end_idx = end_idx;
+
+	AV_RING_BARRIER();
+	us->frame_wr_idx++;
+}
+
+/*
+ * ISR context. Find frame ends in the data just received, starting from
+ * the ring index from_idx. All frames ended within a reception event get
+ * the event time, i.e. timestamp resolution is the event granularity.
+ */
+static void cdc_uart_upstream_frame_detect(uart_cdc_upstream_t *us, uint32_t from_idx, int line_idle)
+{
+	uint32_t ts_us = cdc_uart_ll_time_us();
+	uint32_t wr_idx = us->ring.wr_idx;
+	uint32_t ofs, len;
+	uint8_t *delim;
+
+	if (us->framing == CDC_UART_FRAMING_DELIM) {
+		while (from_idx != wr_idx) {
+			ofs = from_idx & us->ring.mask;
+			len = wr_idx - from_idx;
+			if (len > us->ring.size - ofs) {
+				len = us->ring.size - ofs;
+			}
+
+			delim = memchr(&us->buff[ofs], us->frame_delim, len);
+			if (delim) {
+				from_idx += (uint32_t)(delim - &us->buff[ofs]) + 1U;
+				cdc_uart_upstream_frame_end(us, from_idx, ts_us, 0);
+			} else {
+				from_idx += len;
+			}
+		}
+	} else if (line_idle) {
+		cdc_uart_upstream_frame_end(us, wr_idx, ts_us, 0);
+	}
+
+	/* Don't let a frame without an end overflow the ring */
+	if (wr_idx - us->frame_end_idx >= CDC_UART_FRAME_MAX_LEN(us->ring.size)) {
+		cdc_uart_upstream_frame_end(us, wr_idx, ts_us, CDC_UART_FRAME_SPLIT);
+	}
+}
+
+/*
+ * Circular DMA reception event.
+ * dma_pos is a current DMA write position in the upstream buffer.
+ * line_idle is set if the event is due to the line silence.
+ */
+static void cdc_uart_upstream_rx_event(uart_cdc_upstream_t *us, uint32_t dma_pos, int line_idle)
+{
+	uint32_t wr_idx = us->ring.wr_idx;
+	uint32_t bytes_rx;
+
+	/* DMA position always matches masked write index. The distance
+	 * is less than the buffer size due to HT/TC events. Overflow,
+	 * if any, is handled by the reader. */
+	bytes_rx = (dma_pos - us->ring.wr_idx) & us->ring.mask;
+
+	av_ring_produce(&us->ring, bytes_rx);
+	us->stat_uart_rx_bytes += bytes_rx;
+	cdc_uart_upstream_rts_update(us);
+
+	if (us->framing != CDC_UART_FRAMING_NONE) {
+		cdc_uart_upstream_frame_detect(us, wr_idx, line_idle);
+	}
+
+	/* Line is idle or a half of the buffer is filled - don't wait for more */
+	us->flush = 1;
+}
+
+/*
+ * Called from USARTx_IRQHandler() prior to HAL_UART_IRQHandler().
+ * HAL treats line errors and receiver timeout as blocking errors in DMA
+ * mode and aborts the reception. Circular DMA doesn't need that: line
+ * errors are just counted and receiver timeout is a flush event.
+ * So handle them before HAL sees them, reception goes on uninterrupted.
+ */
+void cdc_uart_irq_hook(UART_HandleTypeDef *huart)
+{
+	uart_cdc_upstream_t *us = get_us_by_huart(huart);
+	uint32_t errors;
+
+	if (!us) {
+		return;
+	}
+
+	errors = cdc_uart_ll_errors_fetch(huart);
+	if (errors) {
+		cdc_uart_upstream_line_errors(us, huart, errors);
+	}
+
+	if (!cdc_uart_has_rto(huart) || !cdc_uart_ll_rto_fetch(huart) ||
+		huart->RxState != HAL_UART_STATE_BUSY_RX) {
+		return;
+	}
+
+	cdc_uart_upstream_rx_event(us,
+			cdc_uart_ll_rx_dma_pos(huart, us->ring.size), 1);
+}
+
+/*
+ * Circular DMA reception event: DMA HT, DMA TC or USART IDLE line.
+ * Size is a current DMA write position in the upstream buffer.
+ * HAL doesn't tell IDLE from DMA events. IDLE is only enabled without
+ * receiver timeout and is assumed if not at a half of the buffer.
+ */
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	uart_cdc_upstream_t *us = get_us_by_huart(huart);
 
+	if (!us) {
+		return;
+	}
+
+	cdc_uart_upstream_rx_event(us, Size, !cdc_uart_has_rto(huart) &&
+			Size != us->ring.size / 2 && Size != us->ring.size);
 }
 
+/*
+ * ISR context on OUT transfer completed
+ * DFI callback
+ */
 void cdc_uart_dfi_ds_on_rx (cdc_dfi_t *cdc_dfi, uint32_t len)
 {
 	uart_cdc_downstream_t *ds = get_ds_by_dfi(cdc_dfi);
-	ds->cdc_data_received = len;
+	uint32_t wr_ofs = ds->ring.wr_idx & ds->ring.mask;
+
+	ds->usbd_rx_armed = 0;
+	ds->stat_usbd_rx_bytes += len;
+
+	if (ds->prbs_chk) {
+		av_prbs_check(ds->prbs_chk, &ds->buff[wr_ofs], len);
+	}
+
+	/* ZLP carries nothing for UART.
+	 * Packet armed before PRBS generator took over UART TX is dropped */
+	if (len && !ds->prbs_tx) {
+		/* Ran over the ring end, move the excess to the ring start */
+		if (wr_ofs + len > ds->ring.size) {
+			memcpy(&ds->buff[0], &ds->buff[ds->ring.size],
+					wr_ofs + len - ds->ring.size);
+		}
+		av_ring_produce(&ds->ring, len);
+		cdc_uart_downstream_tx_kick(ds);
+	}
+
+	cdc_uart_downstream_rx_kick(ds);
 }
 
 static void cdc_uart_dfi_on_control(cdc_dfi_t *cdc_dfi, uint8_t cmd, uint8_t *buf, uint16_t length)
 {
-	uart_cdc_upstream_t *us = get_us_by_dfi(cdc_dfi);
-	UART_HandleTypeDef *huart = us->huart;
+	cdc_uart_t *cdc_uart = cdc_dfi->ctx.cdc_uart;
 
 	switch (cmd) {
 	case CDC_SET_LINE_CODING:
-		/* assert(length == sizeof(pstn_line_coding_t)) */
- 		cdc_uart_set_line_encoding(huart, (pstn_line_coding_t*) buf);
+		if (length >= sizeof(pstn_line_coding_t)) {
+			cdc_uart_set_line_encoding(cdc_uart, (pstn_line_coding_t*) buf);
+		}
 		break;
 
 	case CDC_GET_LINE_CODING:
 		/* assert length == sizeof(pstn_line_coding_t) */
-		cdc_uart_get_line_encoding(huart, (pstn_line_coding_t*) buf);
+		cdc_uart_get_line_encoding(cdc_uart, (pstn_line_coding_t*) buf);
 		break;
 
-	case CDC_SET_CONTROL_LINE_STATE:
+	case CDC_SET_CONTROL_LINE_STATE: {
+		/* No data stage, line state is in wValue: D0 - DTR, D1 - RTS */
+		USBD_SetupReq *req = (USBD_SetupReq *) buf;
+		uart_cdc_upstream_t *us = &cdc_uart->us;
+
+		us->host_rts = !!(req->wValue & 0x02U);
+		cdc_uart_upstream_rts_write(us);
+		if (us->modem) {
+			cdc_uart_gpio_assert(&us->modem->dtr, req->wValue & 0x01U);
+		}
+		break;
+	}
+
 	case CDC_SEND_ENCAPSULATED_COMMAND:
 	case CDC_GET_ENCAPSULATED_RESPONSE:
 	case CDC_SET_COMM_FEATURE:
@@ -344,7 +1019,7 @@ static void cdc_uart_dfi_on_control(cdc_dfi_t *cdc_dfi, uint8_t cmd, uint8_t *bu
 static uint8_t* cdc_uart_dfi_ds_get_buff(struct cdc_dfi_s *cdc_dfi)
 {
 	uart_cdc_downstream_t *ds = get_ds_by_dfi(cdc_dfi);
-	return ds->buff;
+	return &ds->buff[ds->ring.wr_idx & ds->ring.mask];
 }
 
 /*
@@ -354,15 +1029,42 @@ static uint8_t* cdc_uart_dfi_ds_get_buff(struct cdc_dfi_s *cdc_dfi)
 static void cdc_uart_dfi_us_rx_start(struct cdc_dfi_s *cdc_dfi)
 {
 	uart_cdc_upstream_t *us = get_us_by_dfi(cdc_dfi);
+	uart_cdc_downstream_t *ds = get_ds_by_dfi(cdc_dfi);
 
-	us->usbd_rd_idx = 0;
-	us->uart_wr_idx = 0;
+	/* CDC class prepares OUT endpoint right after this call */
+	cdc_uart_downstream_reset(ds);
+	ds->usbd_rx_armed = 1;
+
+	av_ring_reset(&us->ring);
+	us->usbd_tx_len = 0;
+	us->usbd_tx_framed = 0;
+
+	us->frame_end_idx = 0;
+	us->frame_rd_idx = us->frame_wr_idx;
+	us->frame_tx_left = 0;
+	us->frame_buff_len = 0;
 
 	us->uart_err_cnt = 0;
+	us->uart_pe_cnt = 0;
+	us->uart_fe_cnt = 0;
+	us->uart_ne_cnt = 0;
+	us->uart_ore_cnt = 0;
+	us->uart_brk_cnt = 0;
 	us->uart_ovfl_bytes = 0;
 	us->uart_ovfl_cnt = 0;
-	us->timeout = -1;
+	us->ovfl_idx = us->ring.rd_idx;
+	us->flush = 0;
+
+	us->throttled = 0;
+	cdc_uart_upstream_rts_write(us);
+
+	/* Report DCD/DSR state on connect */
+	us->serial_events = 0;
+	us->serial_state = 0;
+
+	/* Retried on SOF if fails */
 	us->cont_rx = 1;
+	cdc_uart_upstream_rx_cont(us);
 }
 
 /*
@@ -372,8 +1074,65 @@ static void cdc_uart_dfi_us_rx_start(struct cdc_dfi_s *cdc_dfi)
 static void cdc_uart_dfi_us_rx_stop(struct cdc_dfi_s *cdc_dfi)
 {
 	uart_cdc_upstream_t *us = get_us_by_dfi(cdc_dfi);
+	uart_cdc_downstream_t *ds = get_ds_by_dfi(cdc_dfi);
+
+	/* Aborts downstream DMA as well */
+	cdc_uart_ll_rto_irq_disable(us->huart);
 	HAL_UART_Abort_IT(us->huart);
-	us->timeout = -1;
+	cdc_uart_downstream_reset(ds);
+	us->cont_rx = 0;
+	us->flush = 0;
+}
+
+/*
+ * ISR context on IN transfer completed
+ * DFI callback
+ */
+static void cdc_uart_dfi_us_tx_cplt(struct cdc_dfi_s *cdc_dfi)
+{
+	uart_cdc_upstream_t *us = get_us_by_dfi(cdc_dfi);
+
+	us->stat_usbd_tx_bytes += us->usbd_tx_len;
+	if (!us->usbd_tx_framed) {
+		av_ring_consume(&us->ring, us->usbd_tx_len);
+	}
+	us->usbd_tx_len = 0;
+	us->usbd_tx_framed = 0;
+	cdc_uart_upstream_rts_update(us);
+}
+
+/*
+ * ISR context once per USB frame
+ * DFI callback
+ */
+static void cdc_uart_dfi_on_sof(struct cdc_dfi_s *cdc_dfi)
+{
+	uart_cdc_upstream_t *us = get_us_by_dfi(cdc_dfi);
+	uart_cdc_downstream_t *ds = get_ds_by_dfi(cdc_dfi);
+	int bytes_available;
+
+	/* CTS isn't interrupt driven. Resume downstream held by CTS */
+	cdc_uart_downstream_tx_kick(ds);
+
+	/* (Re)start circular RX on UART if not running. Might be restarted
+	 * from UART error ISR as well */
+	if (us->cont_rx) {
+		cdc_uart_upstream_rx_cont(us);
+	}
+
+	/* Framed and PRBS upstreams are copied out of the ring by the main loop */
+	if (us->prbs_chk || us->framing != CDC_UART_FRAMING_NONE) {
+		cdc_uart_upstream_rts_update(us);
+		return;
+	}
+
+	/* The only place raw IN transfers are started. Whole contiguous
+	 * span goes at once, so nothing is gained by an earlier start */
+	cdc_uart_upstream_ovfl_check(us);
+	bytes_available = av_ring_used(&us->ring) - us->usbd_tx_len;
+	if (bytes_available && us->flush) {
+		cdc_uart_upstream_send(us);
+	}
 }
 
 /*
@@ -382,11 +1141,15 @@ static void cdc_uart_dfi_us_rx_stop(struct cdc_dfi_s *cdc_dfi)
  */
 static void cdc_uart_dfi_on_idle (struct cdc_dfi_s *cdc_dfi)
 {
-	uart_cdc_downstream_t *ds = get_ds_by_dfi(cdc_dfi);
 	uart_cdc_upstream_t *us = get_us_by_dfi(cdc_dfi);
+	uart_cdc_downstream_t *ds = get_ds_by_dfi(cdc_dfi);
 
-	cdc_uart_downstream_on_idle(ds);
+	/* Downstream is driven from ISR context */
+	cdc_uart_line_coding_on_idle(cdc_dfi->ctx.cdc_uart);
 	cdc_uart_upstream_on_idle(us);
+
+	av_ring_sample(&us->ring, HAL_GetTick());
+	av_ring_sample(&ds->ring, HAL_GetTick());
 }
 
 void cdc_dfi_uart_init (cdc_dfi_t *cdc_dfi, cdc_uart_t *cdc_uart)
@@ -394,18 +1157,286 @@ void cdc_dfi_uart_init (cdc_dfi_t *cdc_dfi, cdc_uart_t *cdc_uart)
 	cdc_dfi->on_idle       = cdc_uart_dfi_on_idle;
 	cdc_dfi->us_start_rx   = cdc_uart_dfi_us_rx_start;
 	cdc_dfi->us_stop_rx    = cdc_uart_dfi_us_rx_stop;
+	cdc_dfi->us_on_tx_cplt = cdc_uart_dfi_us_tx_cplt;
 	cdc_dfi->ds_on_rx      = cdc_uart_dfi_ds_on_rx;
 	cdc_dfi->ds_get_buffer = cdc_uart_dfi_ds_get_buff;
 	cdc_dfi->ds_on_control = cdc_uart_dfi_on_control;
+	cdc_dfi->on_sof        = cdc_uart_dfi_on_sof;
 	cdc_dfi->ctx.cdc_uart  = cdc_uart;
 }
 
-void cdc_uart_init(cdc_uart_t *cdc_uart, USBD_CDC_Handle *hcdc, UART_HandleTypeDef *huart)
+/*
+ * Main loop context. Switch between the bridge and PRBS test modes.
+ * Checker is restarted on any switch, statistics counters are kept
+ * running, so rates are obtained from their deltas.
+ */
+void cdc_uart_set_mode(cdc_uart_t *cdc_uart, cdc_uart_mode_t mode)
+{
+	uart_cdc_upstream_t *us = &cdc_uart->us;
+	uart_cdc_downstream_t *ds = &cdc_uart->ds;
+
+	__disable_irq();
+
+	cdc_uart->mode = mode;
+	av_prbs_chk_reset(&cdc_uart->prbs_chk);
+	av_prbs_init(&ds->prbs_gen, CDC_UART_PRBS_SEED);
+
+	/* Don't check the data received before the test */
+	if (mode == CDC_UART_MODE_PRBS_UART && !us->usbd_tx_len) {
+		av_ring_consume(&us->ring, av_ring_used(&us->ring));
+	}
+
+	us->prbs_chk = (mode == CDC_UART_MODE_PRBS_UART) ? &cdc_uart->prbs_chk : NULL;
+	ds->prbs_chk = (mode == CDC_UART_MODE_PRBS_USB) ? &cdc_uart->prbs_chk : NULL;
+	ds->prbs_tx = (mode == CDC_UART_MODE_PRBS_UART);
+
+	/* Start the generator, or resume USB OUT when back to the bridge */
+	cdc_uart_downstream_tx_kick(ds);
+	cdc_uart_downstream_rx_kick(ds);
+
+	__enable_irq();
+}
+
+/*
+ * Main loop context. Select upstream framing, delim is used by
+ * CDC_UART_FRAMING_DELIM only. Data received so far make the first frame.
+ */
+void cdc_uart_set_framing(cdc_uart_t *cdc_uart, cdc_uart_framing_t framing, uint8_t delim)
 {
-	cdc_uart_downstream_init(&cdc_uart->ds, hcdc, huart);
-	cdc_uart_upstream_init(&cdc_uart->us, hcdc, huart);
+	uart_cdc_upstream_t *us = &cdc_uart->us;
+
+	__disable_irq();
+
+	/* Raw USB IN transfer in progress still holds its ring data */
+	us->frame_end_idx = us->ring.rd_idx + (us->usbd_tx_framed ? 0 : us->usbd_tx_len);
+	us->frame_rd_idx = us->frame_wr_idx;
+	us->frame_tx_left = 0;
+	us->frame_buff_len = 0;
+	us->frame_delim = delim;
+	us->framing = framing;
+
+	__enable_irq();
+}
+
+int cdc_uart_init(cdc_uart_t *cdc_uart, USBD_CDC_Handle *hcdc,
+		UART_HandleTypeDef *huart, const cdc_uart_modem_t *modem,
+		av_pool_t *pool, const cdc_uart_cfg_t *cfg)
+{
+	if (cdc_uart_inst_idx(huart) < 0) {
+		return -1;
+	}
+
+	if (cdc_uart_downstream_init(&cdc_uart->ds, hcdc, huart, modem, pool, cfg->ds_size) ||
+		cdc_uart_upstream_init(&cdc_uart->us, hcdc, huart, modem, pool, cfg->us_size)) {
+		return -1;
+	}
+
+	cdc_uart_line_coding_init(cdc_uart, huart);
+	cdc_uart->mode = CDC_UART_MODE_BRIDGE;
+	av_prbs_chk_reset(&cdc_uart->prbs_chk);
 
 	cdc_dfi_uart_init(&cdc_uart->dfi, cdc_uart);
 
 	hcdc->dfi = &cdc_uart->dfi;
+
+	g_cdc_uart_by_inst[cdc_uart_inst_idx(huart)] = cdc_uart;
+	return 0;
+}
+
+
+/*****************************************************************************
+ * Console commands
+ *
+ *****************************************************************************/
+
+/* Bridge by the optional index argument, the first one by default. NULL if invalid */
+static cdc_uart_t *cdc_uart_cmd_bridge(int argc, char *argv[], int arg_idx)
+{
+	uint32_t idx = 0;
+
+	if (arg_idx < argc &&
+		(ictrl_arg_uint(argv[arg_idx], &idx) || idx >= USBD_CDC_UART_NUM)) {
+		return NULL;
+	}
+
+	return &g_cdc_uart[idx];
+}
+
+/* Bytes per second since the previous call */
+static uint32_t cdc_uart_cmd_rate(uint32_t bytes, uint32_t *last_bytes, uint32_t dt_ms)
+{
+	uint32_t delta = bytes - *last_bytes;
+
+	*last_bytes = bytes;
+	return dt_ms ? (uint32_t)((uint64_t)delta * 1000U / dt_ms) : 0;
+}
+
+static void cdc_uart_cmd_report(unsigned int idx)
+{
+	uart_cdc_upstream_t *us = &g_cdc_uart[idx].us;
+	uart_cdc_downstream_t *ds = &g_cdc_uart[idx].ds;
+
+	ictrl_printf("UART%u rx %lu tx %lu, USB rx %lu tx %lu\r\n",
+			idx, us->stat_uart_rx_bytes, ds->stat_uart_tx_bytes,
+			ds->stat_usbd_rx_bytes, us->stat_usbd_tx_bytes);
+	ictrl_printf("PE %lu FE %lu NE %lu ORE %lu BRK %lu, DMA %lu, ovfl %lu/%lu bytes\r\n",
+			us->uart_pe_cnt, us->uart_fe_cnt, us->uart_ne_cnt, us->uart_ore_cnt,
+			us->uart_brk_cnt, us->uart_err_cnt, us->uart_ovfl_cnt, us->uart_ovfl_bytes);
+	ictrl_ring_report("up", &us->ring);
+	ictrl_ring_report("down", &ds->ring);
+}
+
+static int cdc_uart_cmd_uart(int argc, char *argv[])
+{
+	cdc_uart_t *cdc_uart = cdc_uart_cmd_bridge(argc, argv, 1);
+	unsigned int i;
+
+	if (argc > 2 || !cdc_uart) {
+		return -1;
+	}
+
+	if (argc == 2) {
+		cdc_uart_cmd_report((unsigned int)(cdc_uart - g_cdc_uart));
+	} else {
+		for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+			cdc_uart_cmd_report(i);
+		}
+	}
+
+	return 0;
+}
+
+/* Counter readings at the previous PRBS report of the bridge */
+typedef struct cdc_uart_prbs_last_s {
+	uint32_t ts, uart_tx, uart_rx, usbd_rx, usbd_tx;
+} cdc_uart_prbs_last_t;
+
+static cdc_uart_prbs_last_t g_cdc_uart_prbs_last[USBD_CDC_UART_NUM];
+
+/* "stat reset" zeroed the counters, rates start over */
+static void cdc_uart_cmd_stats_reset(void)
+{
+	uint32_t now = HAL_GetTick();
+	unsigned int i;
+
+	memset(g_cdc_uart_prbs_last, 0, sizeof(g_cdc_uart_prbs_last));
+	for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+		g_cdc_uart_prbs_last[i].ts = now;
+	}
+}
+
+/* Rates are averaged since the previous report of the bridge */
+static void cdc_uart_cmd_prbs_report(cdc_uart_t *cdc_uart)
+{
+	static const char *mode_names[] = { "off", "uart", "usb" };
+	cdc_uart_prbs_last_t *last = g_cdc_uart_prbs_last;
+	unsigned int idx = (unsigned int)(cdc_uart - g_cdc_uart);
+	av_prbs_chk_t *chk = &cdc_uart->prbs_chk;
+	uint32_t now = HAL_GetTick();
+	uint32_t dt_ms = now - last[idx].ts;
+
+	last[idx].ts = now;
+
+	ictrl_printf("PRBS%u %s: UART tx %lu rx %lu, USB rx %lu tx %lu B/s\r\n",
+			idx, mode_names[cdc_uart->mode],
+			cdc_uart_cmd_rate(cdc_uart->ds.stat_uart_tx_bytes, &last[idx].uart_tx, dt_ms),
+			cdc_uart_cmd_rate(cdc_uart->us.stat_uart_rx_bytes, &last[idx].uart_rx, dt_ms),
+			cdc_uart_cmd_rate(cdc_uart->ds.stat_usbd_rx_bytes, &last[idx].usbd_rx, dt_ms),
+			cdc_uart_cmd_rate(cdc_uart->us.stat_usbd_tx_bytes, &last[idx].usbd_tx, dt_ms));
+
+	if (chk->err_bytes) {
+		ictrl_printf("checked %lu, errors %lu bytes %lu bits, first at %lu\r\n",
+				chk->bytes, chk->err_bytes, chk->err_bits, chk->first_err_ofs);
+	} else {
+		ictrl_printf("checked %lu, no errors\r\n", chk->bytes);
+	}
+}
+
+/* prbs [off|uart|usb [bridge]] - switch the mode, report without arguments */
+static int cdc_uart_cmd_prbs(int argc, char *argv[])
+{
+	cdc_uart_t *cdc_uart = cdc_uart_cmd_bridge(argc, argv, 2);
+
+	if (argc > 3 || !cdc_uart) {
+		return -1;
+	}
+
+	if (argc >= 2) {
+		if (0 == strcmp(argv[1], "off")) {
+			cdc_uart_set_mode(cdc_uart, CDC_UART_MODE_BRIDGE);
+		} else if (0 == strcmp(argv[1], "uart")) {
+			cdc_uart_set_mode(cdc_uart, CDC_UART_MODE_PRBS_UART);
+		} else if (0 == strcmp(argv[1], "usb")) {
+			cdc_uart_set_mode(cdc_uart, CDC_UART_MODE_PRBS_USB);
+		} else {
+			return -1;
+		}
+	}
+
+	cdc_uart_cmd_prbs_report(cdc_uart);
+	return 0;
+}
+
+static int cdc_uart_cmd_frame(int argc, char *argv[])
+{
+	cdc_uart_t *cdc_uart = cdc_uart_cmd_bridge(argc, argv, 2);
+
+	if (argc < 2 || argc > 3 || !cdc_uart) {
+		return -1;
+	}
+
+	if (0 == strcmp(argv[1], "off")) {
+		cdc_uart_set_framing(cdc_uart, CDC_UART_FRAMING_NONE, 0);
+	} else if (0 == strcmp(argv[1], "gap")) {
+		cdc_uart_set_framing(cdc_uart, CDC_UART_FRAMING_GAP, 0);
+	} else if (0 == strcmp(argv[1], "slip")) {
+		cdc_uart_set_framing(cdc_uart, CDC_UART_FRAMING_DELIM, CDC_UART_SLIP_END);
+	} else if (0 == strcmp(argv[1], "cobs")) {
+		cdc_uart_set_framing(cdc_uart, CDC_UART_FRAMING_DELIM, CDC_UART_COBS_DELIM);
+	} else {
+		return -1;
+	}
+
+	ictrl_printf("Framing %s\r\n", argv[1]);
+	return 0;
+}
+
+static const ictrl_cmd_t g_cdc_uart_cmds[] = {
+	{ "frame", "off|gap|slip|cobs [bridge]",  "Upstream framing",                       cdc_uart_cmd_frame },
+	{ "prbs",  "[off|uart|usb [bridge]]",     "PRBS test mode, report if no arguments", cdc_uart_cmd_prbs },
+	{ "uart",  "[bridge]",                    "Bridge counters and ring levels",        cdc_uart_cmd_uart },
+};
+
+static const stats_desc_t g_cdc_uart_stats[] = {
+	STATS_DESC(cdc_uart_t, us.stat_uart_rx_bytes),
+	STATS_DESC(cdc_uart_t, us.stat_usbd_tx_bytes),
+	STATS_DESC(cdc_uart_t, us.uart_err_cnt),
+	STATS_DESC(cdc_uart_t, us.uart_pe_cnt),
+	STATS_DESC(cdc_uart_t, us.uart_fe_cnt),
+	STATS_DESC(cdc_uart_t, us.uart_ne_cnt),
+	STATS_DESC(cdc_uart_t, us.uart_ore_cnt),
+	STATS_DESC(cdc_uart_t, us.uart_brk_cnt),
+	STATS_DESC(cdc_uart_t, us.uart_ovfl_cnt),
+	STATS_DESC(cdc_uart_t, us.uart_ovfl_bytes),
+	STATS_DESC(cdc_uart_t, us.frame_merge_cnt),
+	STATS_DESC(cdc_uart_t, ds.stat_usbd_rx_bytes),
+	STATS_DESC(cdc_uart_t, ds.stat_uart_tx_bytes),
+};
+
+static const char *g_cdc_uart_stats_names[] = { "uart0", "uart1" };
+CTASSERT(COUNT_OF(g_cdc_uart_stats_names) >= USBD_CDC_UART_NUM);
+
+/* Commands and counters of all bridges */
+int cdc_uart_cmd_register(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+		if (stats_register(g_cdc_uart_stats_names[i], &g_cdc_uart[i], g_cdc_uart_stats, COUNT_OF(g_cdc_uart_stats))) {
+			return -1;
+		}
+	}
+
+	return stats_reset_hook(cdc_uart_cmd_stats_reset) ||
+		ictrl_cmd_register(g_cdc_uart_cmds, COUNT_OF(g_cdc_uart_cmds));
 }
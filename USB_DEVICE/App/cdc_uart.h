@@ -2,68 +2,241 @@
 
 #include "usbd_def.h"
 #include "usbd_cdc.h"
+#include "av-ring.h"
+#include "av-prbs.h"
+#include "av-pool.h"
 
-#define UART_CDC_TIMEOUT_PERIOD_MS 16
-#if 0
-#define UART_CDC_UPSTREAM_AVAILABLE(up) \
-        (up->uart_wr_idx >= up->usbd_rd_idx ? \
-        (up->uart_wr_idx - up->usbd_rd_idx) : \
-        (up->uart_wr_idx - up->usbd_rd_idx + UART_CDC_UPSTREAM_BUFF_SIZE))
+/* Default upstream ring, power of 2. See cdc_uart_cfg_t */
+#ifndef UART_CDC_UPSTREAM_BUFF_SIZE
+#define UART_CDC_UPSTREAM_BUFF_SIZE     1024U
 #endif
+#define CDC_UART_UP_BUFF_SIZE_MIN       512U
 
-#define UART_CDC_UPSTREAM_BUFF_SIZE     1024
-#define UART_CDC_UPSTREAM_CHUNK_SIZE    16
+/* RTS/CTS flow control is off by default, RTS follows the host then */
+#ifndef CDC_UART_FLOW_CTRL
+#define CDC_UART_FLOW_CTRL              0
+#endif
+
+/* Upstream ring levels to deassert/assert RTS on, by the ring size.
+ * Ring level is known upon DMA HT/TC events only, i.e. with a half of
+ * the buffer granularity. High watermark leaves room for the bytes
+ * already sent by the target. */
+#ifndef CDC_UART_RTS_HIGH_WM
+#define CDC_UART_RTS_HIGH_WM(_size)     ((_size) / 2 - 64U)
+#endif
+#ifndef CDC_UART_RTS_LOW_WM
+#define CDC_UART_RTS_LOW_WM(_size)      ((_size) / 4)
+#endif
 
-#define CDC_UART_DOWN_BUFF_SIZE         64U
+/* Upstream is flushed to the host once the line is silent for this
+ * number of frames (character times) of the current line coding.
+ * Enforced by USART receiver timeout. LPUART has none, thus flushes
+ * on IDLE line, i.e. after a single frame. */
+#ifndef CDC_UART_RTO_CHARS
+#define CDC_UART_RTO_CHARS              3U
+#endif
 
+/* Default downstream ring, power of 2. Host writes up to this size are
+ * accepted at once and go out to the line back to back */
+#ifndef CDC_UART_DOWN_BUFF_SIZE
+#define CDC_UART_DOWN_BUFF_SIZE         2048U
+#endif
+#define CDC_UART_DOWN_BUFF_SIZE_MIN     (2U * CDC_DATA_OUT_PACKET_SIZE)
+#define CDC_UART_DOWN_BUFF_SIZE_MAX     0x8000U /* HAL transfer size is 16 bit */
+
+/* Per instance ring sizes, bytes, power of 2 */
+typedef struct cdc_uart_cfg_s {
+    uint32_t us_size;                       /* Upstream, CDC_UART_UP_BUFF_SIZE_MIN..32K */
+    uint32_t ds_size;                       /* Downstream, CDC_UART_DOWN_BUFF_SIZE_MIN..MAX */
+} cdc_uart_cfg_t;
+
+/* Pool space taken by an instance, including the alignment */
+#define CDC_UART_POOL_SIZE(_us_size, _ds_size) \
+        ((_us_size) + (_ds_size) + CDC_DATA_OUT_PACKET_SIZE + 2U * AV_POOL_ALIGN)
+
+/* CTS is checked per UART transfer, keep them short with flow control */
+#define CDC_UART_DOWN_CTS_CHUNK         CDC_DATA_OUT_PACKET_SIZE
+
+/* Bridge mode, see cdc_uart_set_mode() */
+typedef enum cdc_uart_mode_e {
+    CDC_UART_MODE_BRIDGE,                   /* USB <-> UART bridge */
+    CDC_UART_MODE_PRBS_UART,                /* PRBS out of UART TX, checked on UART RX. Needs TX-RX jumper.
+                                             * USB OUT data are dropped, UART RX isn't sent to USB */
+    CDC_UART_MODE_PRBS_USB,                 /* Bridge, USB OUT data are checked for PRBS on the way */
+} cdc_uart_mode_t;
+
+/* Framed upstream, see cdc_uart_set_framing() */
+typedef enum cdc_uart_framing_e {
+    CDC_UART_FRAMING_NONE,                  /* Raw byte stream */
+    CDC_UART_FRAMING_GAP,                   /* Frame ends when the line is silent, see CDC_UART_RTO_CHARS */
+    CDC_UART_FRAMING_DELIM,                 /* Frame ends with the delimiter byte, included into the frame */
+} cdc_uart_framing_t;
+
+#define CDC_UART_SLIP_END               0xC0U
+#define CDC_UART_COBS_DELIM             0x00U
+
+#ifndef CDC_UART_FRAME_QUEUE_LEN
+#define CDC_UART_FRAME_QUEUE_LEN        16U     /* Power of 2 */
+#endif
+#define CDC_UART_FRAME_BUFF_SIZE        256U    /* Framed upstream IN transfer */
+#define CDC_UART_FRAME_MAX_LEN(_size)   ((_size) / 2)   /* By the upstream ring size */
+
+/* Framed upstream record, little endian. Followed by len bytes of the frame */
+#pragma pack(push, 1)
+typedef struct cdc_uart_frame_hdr_s {
+    uint16_t len;
+    uint16_t flags;                         /* CDC_UART_FRAME_xxx */
+    uint32_t ts_us;                         /* Frame end detected, microseconds. Wraps around */
+} cdc_uart_frame_hdr_t;
+#pragma pack(pop)
+
+#define CDC_UART_FRAME_SPLIT            0x0001U /* Reached CDC_UART_FRAME_MAX_LEN, continues in the next record */
+#define CDC_UART_FRAME_TRUNCATED        0x0002U /* Head of the frame is lost on upstream overflow */
+
+typedef struct cdc_uart_frame_s {
+    uint32_t end_idx;                       /* Upstream ring index past the frame end */
+    uint32_t len;
+    uint32_t ts_us;
+    uint16_t flags;
+} cdc_uart_frame_t;
+
+typedef struct cdc_uart_gpio_s {
+    GPIO_TypeDef *port;
+    uint16_t pin;
+} cdc_uart_gpio_t;
+
+/* Modem control lines, all are active low */
+typedef struct cdc_uart_modem_s {
+    cdc_uart_gpio_t dtr;                    /* Output, follows host DTR */
+    cdc_uart_gpio_t rts;                    /* Output, follows host RTS, or upstream ring level if flow_ctrl */
+    cdc_uart_gpio_t cts;                    /* Input, holds downstream if flow_ctrl */
+    cdc_uart_gpio_t dsr;                    /* Input, reported by SERIAL_STATE. Asserted if port is NULL */
+    cdc_uart_gpio_t dcd;                    /* Input, reported by SERIAL_STATE. Asserted if port is NULL */
+    int flow_ctrl;
+} cdc_uart_modem_t;
+
+/*
+ * Downstream is a byte ring. OUT packets are received right at the ring
+ * write position. UART DMA sends the largest contiguous span at once and
+ * the next span is chained from TX complete, so the line has no gaps
+ * between packets and the host isn't NAKed for the UART transmit time.
+ * The ring is produced and consumed from ISR context only
+ * (USB and UART IRQs have the same priority).
+ */
 typedef struct uart_cdc_downstream_s {
 
     UART_HandleTypeDef *huart;
     USBD_CDC_Handle   *hcdc;
 
-    int uart_ready_to_tx;                   /* Flag is set by UART upon DMA transfer completed.
-                                             * Cleared when new data bunch requested from USB host. */
+    av_ring_t ring;                         /* Produced upon OUT packet received.
+                                             * Consumed upon UART DMA transfer completed */
+    volatile uint32_t uart_tx_len;          /* Bytes of the ring being sent by UART DMA */
+
+    volatile int usbd_rx_armed;             /* OUT endpoint is prepared to receive at the ring write position */
+    volatile int uart_tx_busy;              /* UART DMA transfer is in progress */
+    volatile int uart_tx_hold;              /* Don't start new UART DMA transfers, i.e. line coding change */
+    const cdc_uart_modem_t *modem;          /* NULL if no modem lines */
 
-    int cdc_data_received;                  /* Set upon new data bunch received from USB host.
-                                             * Cleared when newly received data bunch passed to UART DMA */
+    volatile int prbs_tx;                   /* PRBS test: UART TX is fed by the generator instead of USB */
+    volatile int uart_tx_prbs;              /* UART DMA transfer in progress is from prbs_buff */
+    av_prbs_chk_t *volatile prbs_chk;       /* PRBS test: USB OUT data are checked. NULL if not */
+    av_prbs_t prbs_gen;
 
-    uint8_t buff[CDC_UART_DOWN_BUFF_SIZE];  /* Buffer to hold data forwarded from a USBD host to the USART */
+    /* Statistics counters */
+    uint32_t stat_usbd_rx_bytes;
+    uint32_t stat_uart_tx_bytes;
+
+    /* Data forwarded from a USBD host to the USART, ring.size plus a packet.
+     * OUT packet received at the ring end runs over into the extra tail
+     * and is moved to the ring start */
+    uint8_t *buff;
+    uint8_t prbs_buff[CDC_DATA_OUT_PACKET_SIZE];  /* PRBS generator output, UART DMA source */
 } uart_cdc_downstream_t;
 
 typedef struct uart_cdc_upstream_s {
     UART_HandleTypeDef *huart;
     USBD_CDC_Handle *hcdc;
 
-    uint8_t buff[UART_CDC_UPSTREAM_BUFF_SIZE];
-
-    volatile int uart_wr_idx;               /* Updated from ISR context */
-    int usbd_rd_idx;
-    int timeout;                            /* T>0 waiting; T==0 timeout; T<0 stopped
-                                             * Timer to steal data from UART buffer if transfer is too slow
-                                             * Also works as a timer to initiate transaction when received
-                                             * less data than USB_PACKET_SIZE.
+    uint8_t *buff;                          /* Circular DMA destination, ring.size */
+    av_ring_t ring;                         /* Produced from ISR context on DMA HT/TC and USART IDLE events.
+                                             * Consumed by USB upstream upon IN transfer completed */
+    volatile int usbd_tx_len;               /* Bytes passed to USB IN transfer. Kept in the ring
+                                             * until the transfer is completed */
+    volatile int flush;                     /* Set on any RX event. Allows to send less data than
+                                             * USB packet size, i.e. line is idle, don't wait for more.
+                                             * Cleared when the buffer is emptied.
                                              */
-    uint32_t timeout_ts;
-    int cont_rx;
+    volatile int cont_rx;                   /* Set when circular reception has to be (re)started */
+
+    const cdc_uart_modem_t *modem;          /* NULL if no modem lines */
+    volatile int throttled;                 /* RTS deasserted due to the ring level */
+    volatile int host_rts;                  /* RTS state requested by the host */
+
+    volatile uint16_t serial_events;        /* CDC_SERIAL_STATE_EVENTS not notified to the host yet */
+    uint16_t serial_state;                  /* DCD/DSR state last notified to the host */
+
+    av_prbs_chk_t *volatile prbs_chk;       /* PRBS test: UART RX is checked instead of sent to USB. NULL if not */
+
+    /* Framed upstream. Frame ends are queued from ISR context. The main loop
+     * copies frames out of the ring into frame_buff, each with a header */
+    volatile cdc_uart_framing_t framing;
+    volatile uint8_t frame_delim;
+    uint32_t frame_end_idx;                 /* ISR owned. Ring index past the last frame queued */
+    volatile uint32_t frame_wr_idx;         /* Frame queue indices, free running */
+    volatile uint32_t frame_rd_idx;
+    cdc_uart_frame_t frames[CDC_UART_FRAME_QUEUE_LEN];
+    uint32_t frame_tx_end;                  /* Ring index past the frame being copied out */
+    uint32_t frame_tx_left;                 /* Its bytes not copied out yet */
+    uint32_t frame_buff_len;                /* Filled, but not passed to USB yet */
+    volatile int usbd_tx_framed;            /* USB IN transfer in progress is from frame_buff */
+    uint8_t frame_buff[CDC_UART_FRAME_BUFF_SIZE];
 
     /* Statistics counters */
     uint32_t stat_uart_rx_bytes;
     uint32_t stat_usbd_tx_bytes;
 
     /* Error counters */
-    uint32_t uart_err_cnt;
+    uint32_t uart_err_cnt;                  /* Reception aborted by HAL, i.e. DMA error */
+    uint32_t uart_pe_cnt;                   /* Line errors, the reception goes on */
+    uint32_t uart_fe_cnt;
+    uint32_t uart_ne_cnt;
+    uint32_t uart_ore_cnt;
+    uint32_t uart_brk_cnt;                  /* Framing errors on all-zero frame */
     uint32_t uart_ovfl_cnt;
     uint32_t uart_ovfl_bytes;
+    uint32_t ovfl_idx;                      /* Ring index overwritten data are counted up to */
+    uint32_t frame_merge_cnt;               /* Frame ends lost due to the full queue */
 } uart_cdc_upstream_t;
 
 typedef struct cdc_uart_s {
     uart_cdc_upstream_t   us;
     uart_cdc_downstream_t ds;
     cdc_dfi_t dfi;
+
+    pstn_line_coding_t line_coding;         /* Currently applied to the USART */
+    pstn_line_coding_t line_coding_req;     /* Requested by the host. Applied from the main loop
+                                             * once downstream DMA transfer is completed */
+    volatile int line_coding_pending;
+
+    cdc_uart_mode_t mode;
+    av_prbs_chk_t prbs_chk;                 /* Checker of the current PRBS mode */
 } cdc_uart_t;
 
+/* UART bridges, registered as CDC functions in MX_USB_DEVICE_Init() */
+extern cdc_uart_t g_cdc_uart[USBD_CDC_UART_NUM];
+
+void cdc_uart_irq_hook(UART_HandleTypeDef *huart);
 void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size);
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
 
-extern void cdc_uart_init(cdc_uart_t *cdc_uart, USBD_CDC_Handle *hcdc, UART_HandleTypeDef *huart);
+void cdc_uart_set_mode(cdc_uart_t *cdc_uart, cdc_uart_mode_t mode);
+void cdc_uart_set_framing(cdc_uart_t *cdc_uart, cdc_uart_framing_t framing, uint8_t delim);
+
+/* Console commands of all bridges. Returns -1 if the registry is full */
+int cdc_uart_cmd_register(void);
+
+/* Returns 0 on success, -1 if cfg is invalid or the pool is exhausted */
+extern int cdc_uart_init(cdc_uart_t *cdc_uart, USBD_CDC_Handle *hcdc,
+        UART_HandleTypeDef *huart, const cdc_uart_modem_t *modem,
+        av_pool_t *pool, const cdc_uart_cfg_t *cfg);
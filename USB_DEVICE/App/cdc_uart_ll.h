@@ -0,0 +1,99 @@
+#pragma once
+
+#include "stm32l0xx_hal.h"
+
+/*
+ * USART register level access of the UART bridge.
+ *
+ * Everything else cdc_uart.c needs from the target is a HAL or USBD
+ * function call, which is resolved at link time. Register macros aren't,
+ * so they are kept here. An off-target build defines CDC_UART_LL_HOST
+ * and provides cdc_uart_ll_host.h along with the fake HAL and USBD
+ * functions, see tools/host.
+ */
+
+#ifdef CDC_UART_LL_HOST
+#include "cdc_uart_ll_host.h"
+#else
+
+#include "systick.h"
+
+/* Free running microsecond clock, wraps around in ~71 minutes */
+static inline uint32_t cdc_uart_ll_time_us(void)
+{
+    return systick_us();
+}
+
+/* Current circular RX DMA write position in a buffer of size bytes */
+static inline uint32_t cdc_uart_ll_rx_dma_pos(UART_HandleTypeDef *huart, uint32_t size)
+{
+    return size - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+}
+
+/* Receiver timeout in bit times, enables the timeout counter */
+static inline void cdc_uart_ll_rto_set(UART_HandleTypeDef *huart, uint32_t bits)
+{
+    MODIFY_REG(huart->Instance->RTOR, USART_RTOR_RTO, bits);
+    SET_BIT(huart->Instance->CR2, USART_CR2_RTOEN);
+}
+
+/* Flush upstream on receiver timeout instead of IDLE line */
+static inline void cdc_uart_ll_rto_irq_enable(UART_HandleTypeDef *huart)
+{
+    ATOMIC_CLEAR_BIT(huart->Instance->CR1, USART_CR1_IDLEIE);
+    __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_RTOF);
+    ATOMIC_SET_BIT(huart->Instance->CR1, USART_CR1_RTOIE);
+}
+
+static inline void cdc_uart_ll_rto_irq_disable(UART_HandleTypeDef *huart)
+{
+    ATOMIC_CLEAR_BIT(huart->Instance->CR1, USART_CR1_RTOIE);
+}
+
+/* Returns non-zero and clears the flag if receiver timeout occurred */
+static inline int cdc_uart_ll_rto_fetch(UART_HandleTypeDef *huart)
+{
+    if (!__HAL_UART_GET_FLAG(huart, UART_FLAG_RTOF)) {
+        return 0;
+    }
+
+    __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_RTOF);
+    return 1;
+}
+
+/* Line errors, USART_ISR and USART_ICR bits match */
+#define CDC_UART_LL_ERRORS  (USART_ISR_PE | USART_ISR_FE | USART_ISR_NE | USART_ISR_ORE)
+
+/* Returns pending line error flags, USART_ISR_xxx, and clears them */
+static inline uint32_t cdc_uart_ll_errors_fetch(UART_HandleTypeDef *huart)
+{
+    uint32_t errors = huart->Instance->ISR & CDC_UART_LL_ERRORS;
+
+    if (errors) {
+        huart->Instance->ICR = errors;
+    }
+
+    return errors;
+}
+
+/*
+ * Frame format and BRR can be changed only while USART is disabled.
+ * Parameters are HAL UART_xxx init values, brr is a raw register value.
+ */
+static inline void cdc_uart_ll_frame_set(UART_HandleTypeDef *huart,
+        uint32_t word_len, uint32_t parity, uint32_t stop_bits, uint32_t over8, uint32_t brr)
+{
+    __disable_irq();
+
+    CLEAR_BIT(huart->Instance->CR1, USART_CR1_UE);
+    MODIFY_REG(huart->Instance->CR1,
+            USART_CR1_M | USART_CR1_PCE | USART_CR1_PS | USART_CR1_OVER8,
+            word_len | parity | over8);
+    MODIFY_REG(huart->Instance->CR2, USART_CR2_STOP, stop_bits);
+    huart->Instance->BRR = brr;
+    SET_BIT(huart->Instance->CR1, USART_CR1_UE);
+
+    __enable_irq();
+}
+
+#endif /* CDC_UART_LL_HOST */
@@ -0,0 +1,253 @@
+#include <string.h>
+
+#include "av-generic.h"
+#include "main.h"
+#include "cdc_ictrl.h"
+#include "ictrl_rpc.h"
+#include "stats.h"
+
+#define ICTRL_RPC_CRC_INIT  0xFFFFU
+
+typedef struct ictrl_rpc_s {
+    /* Request being received. CRC lands after the payload, or is cut */
+    uint8_t req[sizeof(ictrl_rpc_hdr_t) + ICTRL_RPC_REQ_MAX + 2];
+    uint32_t len;                   /* Received, 0 if waiting for the magic */
+    uint32_t frame_len;             /* Known once the header is in */
+    uint16_t crc;
+    uint16_t crc_rx;                /* Last two bytes received */
+    uint32_t ts;
+
+    uint8_t resp[sizeof(ictrl_rpc_hdr_t) + ICTRL_RPC_RESP_MAX + 2];
+    uint32_t resp_len;              /* Waiting for the console output room */
+
+    /* Statistics counters */
+    uint32_t req_cnt;
+    uint32_t err_cnt;               /* Answered with an error */
+    uint32_t timeout_cnt;
+    uint32_t held_cnt;              /* Response held back, console output was full */
+} ictrl_rpc_t;
+
+static ictrl_rpc_t g_ictrl_rpc;
+
+static uint16_t ictrl_rpc_crc(uint16_t crc, const uint8_t *data, uint32_t len)
+{
+    int i;
+
+    while (len--) {
+        crc ^= (uint16_t)(*data++ << 8);
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000U) ? (uint16_t)((crc << 1) ^ 0x1021U) : (uint16_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+static inline uint32_t ictrl_rpc_arg_first(const ictrl_rpc_hdr_t *hdr, const uint8_t *payload)
+{
+    return hdr->len >= 2 ? (uint32_t)payload[0] | ((uint32_t)payload[1] << 8) : 0;
+}
+
+static inline void ictrl_rpc_put16(uint8_t *out, uint32_t val)
+{
+    out[0] = (uint8_t)val;
+    out[1] = (uint8_t)(val >> 8);
+}
+
+/* Returns the payload length */
+static int ictrl_rpc_stat(const ictrl_rpc_hdr_t *hdr, const uint8_t *payload, uint8_t *out, int names)
+{
+    const char *group, *name;
+    uint32_t total = stats_total();
+    uint32_t idx = ictrl_rpc_arg_first(hdr, payload);
+    uint32_t len = 4;
+    uint32_t val, glen, nlen;
+
+    ictrl_rpc_put16(&out[0], total);
+    ictrl_rpc_put16(&out[2], idx);
+
+    for (; idx < total; idx++) {
+        if (!names) {
+            if (len + sizeof(val) > ICTRL_RPC_RESP_MAX) {
+                break;
+            }
+            val = stats_read(idx);
+            memcpy(&out[len], &val, sizeof(val));
+            len += sizeof(val);
+            continue;
+        }
+
+        stats_name(idx, &group, &name);
+        glen = strlen(group);
+        nlen = strlen(name);
+        if (len + glen + 1 + nlen + 1 > ICTRL_RPC_RESP_MAX) {
+            break;
+        }
+        memcpy(&out[len], group, glen);
+        out[len + glen] = '.';
+        memcpy(&out[len + glen + 1], name, nlen + 1);
+        len += glen + 1 + nlen + 1;
+    }
+
+    return (int)len;
+}
+
+/* Command output is captured into the response */
+static int ictrl_rpc_cmd(const ictrl_rpc_hdr_t *hdr, uint8_t *payload, uint8_t *out, uint8_t *status)
+{
+    int rc, len;
+
+    /* The CRC is already checked, its place takes the terminator */
+    payload[hdr->len] = 0;
+
+    ictrl_capture_start(out, ICTRL_RPC_RESP_MAX);
+    rc = ictrl_cmd_exec((char *)payload);
+    len = ictrl_capture_stop();
+
+    if (rc == ICTRL_CMD_UNKNOWN) {
+        *status = ICTRL_RPC_ERR_CMD;
+    } else if (rc < 0) {
+        *status = ICTRL_RPC_ERR_USAGE;
+    } else if (rc == ICTRL_CMD_MORE || len < 0) {
+        *status = ICTRL_RPC_CUT;
+    }
+
+    return len < 0 ? ICTRL_RPC_RESP_MAX : len;
+}
+
+static void ictrl_rpc_request(ictrl_rpc_t *rpc)
+{
+    ictrl_rpc_hdr_t *hdr = (ictrl_rpc_hdr_t *)rpc->req;
+    uint8_t *payload = &rpc->req[sizeof(*hdr)];
+    ictrl_rpc_hdr_t *resp = (ictrl_rpc_hdr_t *)rpc->resp;
+    uint8_t *out = &rpc->resp[sizeof(*resp)];
+    uint8_t status = ICTRL_RPC_OK;
+    int len = 0;
+    uint16_t crc;
+
+    rpc->req_cnt++;
+
+    if (rpc->crc != rpc->crc_rx) {
+        status = ICTRL_RPC_ERR_CRC;
+    } else if (hdr->len > ICTRL_RPC_REQ_MAX) {
+        status = ICTRL_RPC_ERR_LEN;
+    } else {
+        switch (hdr->op) {
+        case ICTRL_RPC_OP_PING:
+            memcpy(out, payload, hdr->len);
+            len = hdr->len;
+            break;
+
+        case ICTRL_RPC_OP_CMD:
+            len = ictrl_rpc_cmd(hdr, payload, out, &status);
+            break;
+
+        case ICTRL_RPC_OP_STAT:
+        case ICTRL_RPC_OP_STAT_NAMES:
+            len = ictrl_rpc_stat(hdr, payload, out, hdr->op == ICTRL_RPC_OP_STAT_NAMES);
+            break;
+
+        default:
+            status = ICTRL_RPC_ERR_OP;
+            break;
+        }
+    }
+
+    if (status != ICTRL_RPC_OK) {
+        rpc->err_cnt++;
+    }
+
+    resp->magic = ICTRL_RPC_RESP_MAGIC;
+    resp->op = hdr->op;
+    resp->id = hdr->id;
+    resp->status = status;
+    resp->rsvd = 0;
+    resp->len = (uint16_t)len;
+
+    crc = ictrl_rpc_crc(ICTRL_RPC_CRC_INIT, rpc->resp, sizeof(*resp) + (uint32_t)len);
+    ictrl_rpc_put16(&out[len], crc);
+
+    /* Log records and imon samples might have taken the room since
+     * the input was let in, then the response waits for the next pass */
+    rpc->resp_len = sizeof(*resp) + (uint32_t)len + 2;
+    if (ictrl_rpc_flush() < 0) {
+        rpc->held_cnt++;
+    }
+}
+
+int ictrl_rpc_flush(void)
+{
+    ictrl_rpc_t *rpc = &g_ictrl_rpc;
+
+    /* Room is checked first, so retries don't count as ring drops */
+    if (rpc->resp_len && ictrl_out_free() >= rpc->resp_len &&
+        ictrl_print_out((const char *)rpc->resp, (int)rpc->resp_len) > 0) {
+        rpc->resp_len = 0;
+    }
+
+    return rpc->resp_len ? -1 : 0;
+}
+
+int ictrl_rpc_input(uint8_t ch)
+{
+    ictrl_rpc_t *rpc = &g_ictrl_rpc;
+    const ictrl_rpc_hdr_t *hdr = (const ictrl_rpc_hdr_t *)rpc->req;
+
+    if (rpc->len == 0) {
+        if (ch != ICTRL_RPC_REQ_MAGIC) {
+            return -1;
+        }
+        rpc->frame_len = 0;
+        rpc->crc = ICTRL_RPC_CRC_INIT;
+    }
+
+    rpc->ts = HAL_GetTick();
+
+    /* Oversized payload is received and checked, but not kept */
+    if (rpc->len < sizeof(rpc->req)) {
+        rpc->req[rpc->len] = ch;
+    }
+    if (!rpc->frame_len || rpc->len < rpc->frame_len - 2) {
+        rpc->crc = ictrl_rpc_crc(rpc->crc, &ch, 1);
+    }
+    rpc->crc_rx = (uint16_t)((rpc->crc_rx >> 8) | (ch << 8));
+
+    if (++rpc->len == sizeof(*hdr)) {
+        rpc->frame_len = sizeof(*hdr) + hdr->len + 2;
+    }
+
+    if (!rpc->frame_len || rpc->len < rpc->frame_len) {
+        return 0;
+    }
+
+    ictrl_rpc_request(rpc);
+    rpc->len = 0;
+    return 1;
+}
+
+/* Host gone mid-frame, the console takes the input again */
+void ictrl_rpc_on_idle(uint32_t now)
+{
+    ictrl_rpc_t *rpc = &g_ictrl_rpc;
+
+    if (rpc->len && now - rpc->ts > ICTRL_RPC_TIMEOUT_MS) {
+        rpc->len = 0;
+        rpc->timeout_cnt++;
+    }
+}
+
+static const stats_desc_t g_ictrl_rpc_stats[] = {
+    STATS_DESC(ictrl_rpc_t, req_cnt),
+    STATS_DESC(ictrl_rpc_t, err_cnt),
+    STATS_DESC(ictrl_rpc_t, timeout_cnt),
+    STATS_DESC(ictrl_rpc_t, held_cnt),
+};
+
+int ictrl_rpc_init(uint32_t us_size)
+{
+    if (sizeof(g_ictrl_rpc.resp) > us_size / 2) {
+        return -1;
+    }
+
+    return stats_register("rpc", &g_ictrl_rpc, g_ictrl_rpc_stats, COUNT_OF(g_ictrl_rpc_stats));
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <inttypes.h>
+
+/*
+ * Binary RPC on the ictrl console.
+ *
+ * A request starts with ICTRL_RPC_REQ_MAGIC, a byte never typed and not
+ * valid in UTF-8, so frames and console text share the input. Responses
+ * go into the console stream as whole records, in request order, thus
+ * requests might be pipelined. The host matches them by id.
+ *
+ * Frame: ictrl_rpc_hdr_t, len bytes of payload, CRC-16/CCITT-FALSE of
+ * the header and payload. All little endian.
+ */
+#define ICTRL_RPC_REQ_MAGIC     0xF7U
+#define ICTRL_RPC_RESP_MAGIC    0xF8U
+
+#define ICTRL_RPC_REQ_MAX       80      /* Request payload */
+#define ICTRL_RPC_RESP_MAX      240     /* Response payload */
+#define ICTRL_RPC_TIMEOUT_MS    100     /* Partial request is dropped after */
+
+#pragma pack(push, 1)
+typedef struct ictrl_rpc_hdr_s {
+    uint8_t magic;
+    uint8_t op;                     /* enum ictrl_rpc_op */
+    uint16_t id;                    /* Set by the host, echoed */
+    uint8_t status;                 /* enum ictrl_rpc_status, 0 in requests */
+    uint8_t rsvd;
+    uint16_t len;                   /* Payload */
+} ictrl_rpc_hdr_t;
+#pragma pack(pop)
+
+enum ictrl_rpc_op {
+    ICTRL_RPC_OP_PING,              /* Payload echoed */
+    ICTRL_RPC_OP_CMD,               /* Command line in, its output back */
+    ICTRL_RPC_OP_STAT,              /* [u16 first] in, u16 total, u16 first, u32 values[] back */
+    ICTRL_RPC_OP_STAT_NAMES,        /* [u16 first] in, u16 total, u16 first, "group.name\0"... back */
+};
+
+enum ictrl_rpc_status {
+    ICTRL_RPC_OK,
+    ICTRL_RPC_ERR_CRC,
+    ICTRL_RPC_ERR_OP,
+    ICTRL_RPC_ERR_LEN,
+    ICTRL_RPC_ERR_CMD,              /* No such command */
+    ICTRL_RPC_ERR_USAGE,            /* Command rejected arguments, usage is the payload */
+    ICTRL_RPC_CUT,                  /* Output didn't fit the response */
+};
+
+/* Returns -1 if responses don't fit half of the console ring of us_size */
+extern int ictrl_rpc_init(uint32_t us_size);
+
+/* Main loop, byte of the console input. Returns -1 if it's console text,
+ * 1 once a request is answered, 0 otherwise */
+extern int ictrl_rpc_input(uint8_t ch);
+
+/* Main loop, sends the held back response. Returns -1 while it's still
+ * waiting, the console input must not be taken then */
+extern int ictrl_rpc_flush(void);
+extern void ictrl_rpc_on_idle(uint32_t now);
@@ -2,11 +2,18 @@
 #include "usbd_desc.h"
 #include "usbd_composite.h"
 #include "usb_device.h"
+#include "stats.h"
+#include "av-generic.h"
 
 USBD_Handle hUsbDevice;
 
-USBD_CDC_Handle g_cdc0;
-USBD_CDC_Handle g_cdc1;
+USBD_CDC_Handle g_cdc_bridge[USBD_CDC_UART_NUM];    /* UART bridges */
+USBD_CDC_Handle g_cdc1;                             /* ictrl */
+
+/* EP1..EP7 are available. HID takes one, each CDC takes two (cmd and data) */
+#if 1 + 2 * (1 + USBD_CDC_UART_NUM) > 7
+#error "Not enough USB endpoints for UART bridges"
+#endif
 
 union _USBD_ConfigDescExt USBD_ConfigDescExt = {
 	.config_desc = {
@@ -40,10 +47,16 @@ void MX_USB_DEVICE_Init(void)
 	{ /* Link interfaces into composite class */
 		int ep_in_use = 1;
 		int if_in_use = 0;
+		int i;
 		HID_Register(&g_hid0, &pdev->intf[0], pdev->config_desc, &if_in_use, &ep_in_use);
-		CDC_Register(&g_cdc0, &pdev->intf[1], pdev->config_desc, &if_in_use, &ep_in_use);
+		CDC_Register(&g_cdc_bridge[0], &pdev->intf[1], pdev->config_desc, &if_in_use, &ep_in_use);
 		CDC_Register(&g_cdc1, &pdev->intf[2], pdev->config_desc, &if_in_use, &ep_in_use);
 
+		/* Extra bridges go after ictrl, so the host keeps numbering of the first ones */
+		for (i = 1; i < USBD_CDC_UART_NUM; i++) {
+			CDC_Register(&g_cdc_bridge[i], &pdev->intf[2 + i], pdev->config_desc, &if_in_use, &ep_in_use);
+		}
+
 		pdev->config_desc->bNumInterfaces = if_in_use;
 	}
 
@@ -57,3 +70,20 @@ void MX_USB_DEVICE_Init(void)
 
 }
 
+
+static const stats_desc_t g_usb_stats[] = {
+	STATS_DESC(USBD_Handle, stats.setup_cnt),
+	STATS_DESC(USBD_Handle, stats.data_out_cnt),
+	STATS_DESC(USBD_Handle, stats.data_in_cnt),
+	STATS_DESC(USBD_Handle, stats.sof_cnt),
+	STATS_DESC(USBD_Handle, stats.reset_cnt),
+	STATS_DESC(USBD_Handle, stats.suspend_cnt),
+	STATS_DESC(USBD_Handle, stats.resume_cnt),
+	STATS_DESC(USBD_Handle, stats.disconnect_cnt),
+	STATS_DESC(USBD_Handle, stats.ctl_err_cnt),
+};
+
+int usb_device_stats_register(void)
+{
+	return stats_register("usb", &hUsbDevice, g_usb_stats, COUNT_OF(g_usb_stats));
+}
@@ -10,10 +10,11 @@ union _USBD_ConfigDescExt{
 #pragma pack(pop)
 
 extern USBD_HID_Handle g_hid0;
-extern USBD_CDC_Handle g_cdc0;
+extern USBD_CDC_Handle g_cdc_bridge[USBD_CDC_UART_NUM];
 extern USBD_CDC_Handle g_cdc1;
 
 extern union _USBD_ConfigDescExt USBD_ConfigDescExt;
 
 void MX_USB_DEVICE_Init(void);
+int usb_device_stats_register(void);
 
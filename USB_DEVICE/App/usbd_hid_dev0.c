@@ -83,6 +83,8 @@ void Dev0_HID_DeInit (USBD_HID_Handle *hhid)
 {
     dev0_t *dev0 = &g_dev0;
 
+    UNUSED(hhid);
+
     dev0->hid = NULL;
     return;
 }
@@ -97,6 +99,9 @@ int8_t Dev0_HID_OutEvent (USBD_HID_Handle *hhid, uint8_t *buf, int len)
 
     uint16_t pb = 0;
 
+    UNUSED(hhid);
+    UNUSED(len);
+
     pb |= (report->leds & 0x01) ? LED_RED_Pin : 0;
     pb |= (report->leds & 0x02) ? LED_GREEN_Pin : 0;
 
@@ -135,6 +140,8 @@ void Dev0_HID_Init (USBD_HID_Handle *hhid, uint8_t cfgidx)
 {
     dev0_t *dev0 = &g_dev0;
 
+    UNUSED(cfgidx);
+
     USBD_Dev0_HID_ConfigDesc *desc = hhid->hid_cfg_desc.dev0;
 
     hhid->epin_size = usb2host_u16(desc->ep_in.wMaxPacketSize);
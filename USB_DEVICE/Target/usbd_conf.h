@@ -59,7 +59,13 @@
   */
 
 /*---------- -----------*/
-#define USBD_MAX_NUM_INTERFACES     3U
+/* UART bridges, see MX_USB_DEVICE_Init() */
+#define USBD_CDC_UART_NUM           ((UART_BRIDGE2 != UART_BRIDGE2_NONE) ? 2 : 1)
+/*---------- -----------*/
+/* HID, ictrl CDC and UART bridges CDC functions */
+#define COMPOSITE_INTF_NUM          (2 + USBD_CDC_UART_NUM)
+/*---------- -----------*/
+#define USBD_MAX_NUM_INTERFACES     (1U + 2U * (1U + USBD_CDC_UART_NUM))
 /*---------- -----------*/
 #define USBD_MAX_NUM_CONFIGURATION  1U
 /*---------- -----------*/
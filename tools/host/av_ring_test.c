@@ -0,0 +1,221 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "av-ring.h"
+
+/*
+ * Core/Inc/av-ring.h stress test. Producer and consumer take random
+ * steps through every API flavour, indices start right below the 32 bit
+ * wrap. Byte n of the stream is a hash of n, so any byte lost,
+ * duplicated or reordered is caught along with the exact count.
+ * Then the same runs with the sides in two threads.
+ */
+
+#define TEST_STREAM_LEN     (1U << 20)
+#define TEST_THREAD_LEN     (1U << 22)
+#define TEST_SIZE_MAX       4096U
+
+typedef struct test_side_s {
+    av_ring_t *ring;
+    uint32_t seq;                   /* Stream position */
+    uint32_t rnd;
+    uint32_t len;                   /* Stream length */
+} test_side_t;
+
+static int g_test_fail;
+
+#define TEST_CHECK(_cond, ...) do { \
+        if (!(_cond)) { \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            g_test_fail = 1; \
+            return -1; \
+        } \
+    } while (0)
+
+static inline uint8_t test_byte(uint32_t seq)
+{
+    return (uint8_t)((seq * 2654435761U) >> 24);
+}
+
+/* xorshift32 */
+static inline uint32_t test_rand(uint32_t *rnd)
+{
+    *rnd ^= *rnd << 13;
+    *rnd ^= *rnd >> 17;
+    *rnd ^= *rnd << 5;
+    return *rnd;
+}
+
+/* Up to size + 1, so steps larger than the ring are tried too */
+static inline uint32_t test_step(test_side_t *s)
+{
+    uint32_t r = test_rand(&s->rnd);
+
+    /* Mostly short steps, sometimes the whole ring */
+    return (r & 3U) ? (r >> 8) % 4U : (r >> 8) % (s->ring->size + 2U);
+}
+
+static int test_produce(test_side_t *s)
+{
+    uint8_t data[TEST_SIZE_MAX + 1];
+    uint32_t len = test_step(s);
+    uint32_t span, i, n;
+    uint8_t *ptr;
+
+    if (len > s->len - s->seq) {
+        len = s->len - s->seq;
+    }
+
+    if (test_rand(&s->rnd) & 1U) {
+        for (i = 0; i < len; i++) {
+            data[i] = test_byte(s->seq + i);
+        }
+        n = av_ring_write(s->ring, data, len);
+        TEST_CHECK(n <= len, "write %u of %u", n, len);
+    } else {
+        span = av_ring_wr_span(s->ring, &ptr);
+        n = len < span ? len : span;
+        for (i = 0; i < n; i++) {
+            ptr[i] = test_byte(s->seq + i);
+        }
+        av_ring_produce(s->ring, n);
+    }
+
+    s->seq += n;
+    return 0;
+}
+
+static int test_consume(test_side_t *s)
+{
+    uint32_t len = test_step(s);
+    uint32_t span, i;
+    uint8_t *ptr;
+
+    span = av_ring_rd_span(s->ring, &ptr);
+    if (len > span) {
+        len = span;
+    }
+
+    for (i = 0; i < len; i++) {
+        TEST_CHECK(ptr[i] == test_byte(s->seq + i),
+                   "size %u byte %u: 0x%02x, expected 0x%02x", s->ring->size, s->seq + i,
+                   ptr[i], test_byte(s->seq + i));
+    }
+
+    av_ring_consume(s->ring, len);
+    s->seq += len;
+    return 0;
+}
+
+static int test_interleaved(uint32_t size, uint32_t start, uint32_t seed)
+{
+    static uint8_t buff[TEST_SIZE_MAX];
+    av_ring_t ring;
+    test_side_t prod = { &ring, 0, seed, TEST_STREAM_LEN };
+    test_side_t cons = { &ring, 0, seed * 7U + 1U, TEST_STREAM_LEN };
+    uint32_t sched = seed ^ 0x5A5A5A5AU;
+    uint32_t steps = 0;
+    uint32_t bias;
+
+    av_ring_init(&ring, buff, size);
+    ring.wr_idx = start;
+    ring.rd_idx = start;
+
+    while (cons.seq < TEST_STREAM_LEN) {
+        /* Phases of a faster producer and of a faster consumer */
+        bias = (steps++ >> 10) & 1U ? 3U : 1U;
+        if (test_rand(&sched) % 4U < bias) {
+            if (test_produce(&prod)) {
+                return -1;
+            }
+        } else if (test_consume(&cons)) {
+            return -1;
+        }
+
+        TEST_CHECK(av_ring_used(&ring) == prod.seq - cons.seq,
+                   "size %u used %u, %u in flight", size, av_ring_used(&ring), prod.seq - cons.seq);
+        TEST_CHECK(av_ring_used(&ring) + av_ring_free(&ring) == size, "size %u free %u", size, av_ring_free(&ring));
+
+        /* Empty ring might be moved to the buffer origin */
+        if (!av_ring_used(&ring) && (test_rand(&sched) & 0xFFU) == 0) {
+            av_ring_rewind(&ring);
+            TEST_CHECK((ring.wr_idx & ring.mask) == 0 && !av_ring_used(&ring), "size %u rewind", size);
+        }
+    }
+
+    TEST_CHECK(prod.seq == TEST_STREAM_LEN, "size %u produced %u", size, prod.seq);
+    TEST_CHECK(ring.hwm <= size, "size %u hwm %u", size, ring.hwm);
+    TEST_CHECK(size < 4 || ring.hwm == size, "size %u never filled, hwm %u", size, ring.hwm);
+    return 0;
+}
+
+static void *test_producer_thread(void *arg)
+{
+    test_side_t *s = arg;
+
+    uint32_t seq;
+
+    while (s->seq < s->len) {
+        seq = s->seq;
+        if (test_produce(s)) {
+            break;
+        }
+        /* Even on a single CPU */
+        if (seq == s->seq) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static int test_threaded(uint32_t size, uint32_t start)
+{
+    static uint8_t buff[TEST_SIZE_MAX];
+    av_ring_t ring;
+    test_side_t prod = { &ring, 0, 0x12345678U, TEST_THREAD_LEN };
+    test_side_t cons = { &ring, 0, 0x9ABCDEF1U, TEST_THREAD_LEN };
+    pthread_t thread;
+    int rc = 0;
+
+    av_ring_init(&ring, buff, size);
+    ring.wr_idx = start;
+    ring.rd_idx = start;
+
+    TEST_CHECK(0 == pthread_create(&thread, NULL, test_producer_thread, &prod), "thread");
+
+    while (cons.seq < TEST_THREAD_LEN && !rc) {
+        if (!av_ring_used(&ring)) {
+            sched_yield();
+        }
+        rc = test_consume(&cons);
+    }
+
+    /* The producer is left behind on a failure, it waits for room forever */
+    if (!rc) {
+        pthread_join(thread, NULL);
+    }
+    return rc;
+}
+
+int main(void)
+{
+    static const uint32_t starts[] = { 0, 0xFFFFFFFFU - 5U, 0x80000000U - 1U };
+    uint32_t size, i;
+
+    for (size = 1; size <= TEST_SIZE_MAX; size <<= 1) {
+        for (i = 0; i < sizeof(starts) / sizeof(starts[0]); i++) {
+            test_interleaved(size, starts[i] - size / 2U, size * 31U + i + 1U);
+        }
+    }
+
+    for (size = 1; size <= 256; size <<= 3) {
+        test_threaded(size, 0U - size - 3U);
+    }
+
+    printf("%s\n", g_test_fail ? "av_ring_test: FAILED" : "av_ring_test: ok");
+    return g_test_fail;
+}
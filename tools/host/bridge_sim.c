@@ -0,0 +1,815 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "main.h"
+#include "usb_device.h"
+#include "cdc_uart.h"
+#include "cdc_ictrl.h"
+#include "stats.h"
+
+/*
+ * The UART bridge firmware on a host, over the hardware of sim_hal.c and
+ * sim_pcd.c. Init and the main loop are those of main.c. A script drives
+ * the far ends of the UART lines and the host applications on the CDC
+ * endpoints, and checks what arrives.
+ *
+ *     bridge_sim [-f] <script>
+ *
+ * -f  RTS/CTS flow control of bridge 0, CDC_UART_FLOW_CTRL.
+ *
+ * Byte n of a stream is a hash of n, so the receiving end tells lost,
+ * reordered and garbage bytes apart, and the latency of each byte.
+ * Script lines, # starts a comment:
+ *
+ *     connect                         Enumerate, assert DTR and RTS of each bridge
+ *     run <ms>                        Advance the time
+ *     loop <us>                       Main loop pass period
+ *     coding <b> <baud> [8N1]         SET_LINE_CODING, far end follows
+ *     send <b> <n> [<burst> <gap_us>] Far end sends n bytes, in bursts
+ *     write <b> <n>                   Host writes n bytes
+ *     read <b> on|off                 Host reads the data IN endpoint
+ *     error <b> pe|fe|ne|ore|break    Next byte of the far end is received with the error
+ *     cts <b> on|off                  Far end CTS
+ *     framed <b> off|gap|slip|cobs    Upstream framing, host parses the records
+ *     console <text>                  Typed into ictrl, the output is printed with "| "
+ *     report                          Streams of all bridges
+ *     expect <b> up|down <metric> <op> <value>
+ *     expect stat <group>.<name> <op> <value>
+ *
+ * Metrics are sent, recv, lost, garbage, lat_max and lat_avg (us), rate
+ * (bytes/s) and frames. Ops are == != < <= > >=. Exit status is 1 if an
+ * expect fails.
+ */
+
+#define SIM_TS_NUM          0x10000U    /* Bytes in flight a latency is kept for */
+#define SIM_LOOP_NS         (10U * SIM_US)
+
+/* One direction of a bridge */
+typedef struct sim_stream_s {
+    uint32_t mask;                      /* Data bits of the line coding */
+    uint32_t tx_seq;                    /* Next to send */
+    uint32_t tx_left;
+    uint32_t rx_seq;                    /* Next expected */
+    uint32_t recv;
+    uint32_t lost;
+    uint32_t garbage;
+    uint8_t win[4];                     /* Bytes out of sequence, resync is looked for */
+    uint32_t win_len;
+    uint64_t lat_sum;
+    uint64_t lat_max;
+    uint64_t first_tx;
+    uint64_t last_rx;
+    uint32_t frames;
+    uint64_t ts[SIM_TS_NUM];
+} sim_stream_t;
+
+typedef struct sim_bridge_s {
+    unsigned int idx;
+    cdc_uart_t *cdc_uart;
+    USBD_CDC_Handle *hcdc;
+    sim_uart_t *uart;
+    const cdc_uart_modem_t *modem;
+
+    sim_stream_t up;                    /* Far end to the host */
+    sim_stream_t down;                  /* Host to the far end */
+
+    /* Far end */
+    uint32_t burst;
+    uint32_t burst_left;
+    uint64_t gap_ns;
+    uint64_t gap_end;
+    uint32_t err_next;                  /* SIM_SYM_xxx of the next byte */
+    int brk_next;
+
+    /* Host */
+    int framed;
+    uint8_t rec[sizeof(cdc_uart_frame_hdr_t)];
+    uint32_t rec_len;                   /* Header bytes collected */
+    uint32_t rec_left;                  /* Frame bytes to follow */
+    uint16_t serial_state;
+    uint32_t serial_cnt;
+
+    sim_usb_pipe_t data_in;
+    sim_usb_pipe_t data_out;
+    sim_usb_pipe_t cmd_in;
+} sim_bridge_t;
+
+typedef struct sim_console_s {
+    char in[256];
+    uint32_t in_len;
+    uint32_t in_pos;
+    uint32_t skip;                      /* Binary record bytes left */
+    uint8_t hdr[2];
+    uint32_t hdr_len;
+    int bol;                            /* At the beginning of a line */
+    sim_usb_pipe_t out;
+    sim_usb_pipe_t in_pipe;
+} sim_console_t;
+
+/* Firmware objects of main.c */
+UART_HandleTypeDef huart1;
+UART_HandleTypeDef huart_bridge2;
+extern cdc_ictrl_t g_cdc_ictrl;
+
+static cdc_uart_modem_t g_uart1_modem = {
+    .dtr = { UART1_DTR_GPIO_Port, UART1_DTR_Pin },
+    .rts = { UART1_RTS_GPIO_Port, UART1_RTS_Pin },
+    .cts = { UART1_CTS_GPIO_Port, UART1_CTS_Pin },
+    .dsr = { UART1_DSR_GPIO_Port, UART1_DSR_Pin },
+    .dcd = { UART1_DCD_GPIO_Port, UART1_DCD_Pin },
+    .flow_ctrl = CDC_UART_FLOW_CTRL,
+};
+
+static const cdc_uart_cfg_t g_cdc_uart_cfg[USBD_CDC_UART_NUM] = {
+    { .us_size = UART_CDC_UPSTREAM_BUFF_SIZE, .ds_size = CDC_UART_DOWN_BUFF_SIZE },
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+    { .us_size = UART_CDC_UPSTREAM_BUFF_SIZE, .ds_size = CDC_UART_DOWN_BUFF_SIZE },
+#endif
+};
+
+#define BUFF_POOL_SIZE \
+    (USBD_CDC_UART_NUM * CDC_UART_POOL_SIZE(UART_CDC_UPSTREAM_BUFF_SIZE, CDC_UART_DOWN_BUFF_SIZE) + \
+     CDC_ICTRL_POOL_SIZE(ICTRL_CDC_UPSTREAM_BUFF_SIZE, CDC_ICTRL_DS_BUFF_SIZE))
+
+static uint32_t g_buff_pool_mem[BUFF_POOL_SIZE / sizeof(uint32_t)];
+static av_pool_t g_buff_pool;
+
+static sim_bridge_t g_bridges[USBD_CDC_UART_NUM];
+static sim_console_t g_console = { .bol = 1 };
+
+static struct {
+    const char *path;
+    unsigned int line;
+    unsigned int failed;
+} g_script;
+
+void Error_Handler(void)
+{
+    fprintf(stderr, "Error_Handler() at %" PRIu64 " ns\n", g_sim_now);
+    exit(2);
+}
+
+static void sim_die(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s:%u: ", g_script.path, g_script.line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(2);
+}
+
+static uint8_t sim_test_byte(uint32_t seq)
+{
+    return (uint8_t)((seq * 2654435761U) >> 24);
+}
+
+static void sim_stream_sent(sim_stream_t *s, uint64_t at)
+{
+    if (!s->tx_seq) {
+        s->first_tx = at;
+    }
+    s->ts[s->tx_seq % SIM_TS_NUM] = at;
+    s->tx_seq++;
+}
+
+static void sim_stream_got(sim_stream_t *s, uint32_t seq)
+{
+    uint64_t lat = g_sim_now - s->ts[seq % SIM_TS_NUM];
+
+    s->recv++;
+    s->lat_sum += lat;
+    s->lat_max = MAX(s->lat_max, lat);
+    s->last_rx = g_sim_now;
+}
+
+/* Bytes out of sequence are collected till 4 of them match somewhere ahead */
+static void sim_stream_resync(sim_stream_t *s)
+{
+    uint32_t k, i;
+
+    for (k = s->rx_seq; k + 4U <= s->tx_seq; k++) {
+        for (i = 0; i < 4U && s->win[i] == (sim_test_byte(k + i) & s->mask); i++) {
+        }
+        if (i == 4U) {
+            s->lost += k - s->rx_seq;
+            for (i = 0; i < 4U; i++) {
+                sim_stream_got(s, k + i);
+            }
+            s->rx_seq = k + 4U;
+            s->win_len = 0;
+            return;
+        }
+    }
+
+    s->garbage++;
+    memmove(&s->win[0], &s->win[1], 3);
+    s->win_len = 3;
+}
+
+static void sim_stream_rx(sim_stream_t *s, uint8_t byte)
+{
+    byte &= (uint8_t)s->mask;
+    if (!s->win_len && s->rx_seq < s->tx_seq && byte == (sim_test_byte(s->rx_seq) & s->mask)) {
+        sim_stream_got(s, s->rx_seq++);
+        return;
+    }
+
+    s->win[s->win_len++] = byte;
+    if (s->win_len == 4U) {
+        sim_stream_resync(s);
+    }
+}
+
+/* Far end UART, sending the up stream */
+static int sim_far_tx(void *ctx, uint64_t end, uint32_t *sym)
+{
+    sim_bridge_t *b = ctx;
+    const cdc_uart_modem_t *modem = b->modem;
+
+    /* Far end holds off while RTS is deasserted, high */
+    if (modem && (modem->rts.port->ODR & modem->rts.pin)) {
+        return 0;
+    }
+
+    if (b->brk_next) {
+        b->brk_next = 0;
+        *sym = SIM_SYM_FE;
+        return 1;
+    }
+
+    if (!b->up.tx_left || g_sim_now < b->gap_end) {
+        return 0;
+    }
+
+    *sym = sim_test_byte(b->up.tx_seq) | b->err_next;
+    b->err_next = 0;
+    sim_stream_sent(&b->up, end);
+    b->up.tx_left--;
+
+    if (b->burst && !--b->burst_left) {
+        b->burst_left = b->burst;
+        b->gap_end = end + b->gap_ns;
+    }
+    return 1;
+}
+
+static void sim_far_rx(void *ctx, uint8_t byte)
+{
+    sim_bridge_t *b = ctx;
+
+    sim_stream_rx(&b->down, byte);
+}
+
+/* Framed upstream records are parsed, frame bytes go to the stream */
+static void sim_host_data_in(void *ctx, const uint8_t *data, uint32_t len)
+{
+    sim_bridge_t *b = ctx;
+    cdc_uart_frame_hdr_t hdr;
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        if (!b->framed || b->rec_left) {
+            sim_stream_rx(&b->up, data[i]);
+            b->rec_left -= !!b->framed;
+            continue;
+        }
+
+        b->rec[b->rec_len++] = data[i];
+        if (b->rec_len < sizeof(hdr)) {
+            continue;
+        }
+        memcpy(&hdr, b->rec, sizeof(hdr));
+        b->rec_len = 0;
+        b->rec_left = hdr.len;
+        b->up.frames += !(hdr.flags & CDC_UART_FRAME_SPLIT);
+    }
+}
+
+static uint32_t sim_host_data_out(void *ctx, uint8_t *data, uint32_t max)
+{
+    sim_bridge_t *b = ctx;
+    uint32_t n = MIN(b->down.tx_left, max);
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        data[i] = sim_test_byte(b->down.tx_seq);
+        sim_stream_sent(&b->down, g_sim_now);
+    }
+    b->down.tx_left -= n;
+    return n;
+}
+
+/* SERIAL_STATE notification, bmUartState follows the header */
+static void sim_host_cmd_in(void *ctx, const uint8_t *data, uint32_t len)
+{
+    sim_bridge_t *b = ctx;
+
+    if (len >= 10U) {
+        b->serial_state = (uint16_t)(data[8] | data[9] << 8);
+        b->serial_cnt++;
+    }
+}
+
+static uint32_t sim_console_out(void *ctx, uint8_t *data, uint32_t max)
+{
+    sim_console_t *con = ctx;
+    uint32_t n = MIN(con->in_len - con->in_pos, max);
+
+    memcpy(data, &con->in[con->in_pos], n);
+    con->in_pos += n;
+    return n;
+}
+
+/* Console text, log and imon records are skipped */
+static void sim_console_in(void *ctx, const uint8_t *data, uint32_t len)
+{
+    sim_console_t *con = ctx;
+    uint32_t i;
+    uint8_t ch;
+
+    for (i = 0; i < len; i++) {
+        ch = data[i];
+        if (con->skip) {
+            con->skip--;
+            continue;
+        }
+        if (con->hdr_len) {
+            con->hdr[con->hdr_len++] = ch;
+            if (con->hdr[0] == ICTRL_IMON_MAGIC) {
+                con->skip = ch - 2U;
+                con->hdr_len = 0;
+            } else if (con->hdr_len == 2U) {
+                con->skip = sizeof(ictrl_log_hdr_t) - 2U + 4U * ch;
+                con->hdr_len = 0;
+            }
+            continue;
+        }
+        if (ch == ICTRL_LOG_MAGIC || ch == ICTRL_IMON_MAGIC) {
+            con->hdr[con->hdr_len++] = ch;
+            continue;
+        }
+
+        if (ch == '\r') {
+            continue;
+        }
+        if (con->bol) {
+            fputs("| ", stdout);
+        }
+        putchar(ch);
+        con->bol = (ch == '\n');
+    }
+}
+
+/* Console line in progress is ended before the driver's own output */
+static void sim_console_break(void)
+{
+    if (!g_console.bol) {
+        putchar('\n');
+        g_console.bol = 1;
+    }
+}
+
+static void sim_loop(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+        g_cdc_uart[i].dfi.on_idle(&g_cdc_uart[i].dfi);
+    }
+    g_cdc_ictrl.dfi.on_idle(&g_cdc_ictrl.dfi);
+}
+
+static void sim_uart_init(UART_HandleTypeDef *huart, USART_TypeDef *instance)
+{
+    huart->Instance = instance;
+    huart->Init.BaudRate = 115200;
+    huart->Init.WordLength = UART_WORDLENGTH_8B;
+    huart->Init.StopBits = UART_STOPBITS_1;
+    huart->Init.Parity = UART_PARITY_NONE;
+    huart->Init.Mode = UART_MODE_TX_RX;
+    huart->Init.HwFlowCtl = UART_HWCONTROL_NONE;
+    huart->Init.OverSampling = UART_OVERSAMPLING_16;
+    if (HAL_UART_Init(huart) != HAL_OK) {
+        Error_Handler();
+    }
+}
+
+static void sim_fw_init(void)
+{
+    UART_HandleTypeDef *huarts[] = { &huart1, &huart_bridge2 };
+    unsigned int i;
+
+    sim_uart_init(&huart1, USART1);
+#if UART_BRIDGE2 != UART_BRIDGE2_NONE
+    sim_uart_init(&huart_bridge2, BRIDGE2_UART_Instance);
+#endif
+    MX_USB_DEVICE_Init();
+
+    av_pool_init(&g_buff_pool, g_buff_pool_mem, sizeof(g_buff_pool_mem));
+    for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+        if (cdc_uart_init(&g_cdc_uart[i], &g_cdc_bridge[i], huarts[i], i ? NULL : &g_uart1_modem,
+                &g_buff_pool, &g_cdc_uart_cfg[i])) {
+            Error_Handler();
+        }
+    }
+    if (cdc_ictrl_init(&g_cdc1, &g_buff_pool, ICTRL_CDC_UPSTREAM_BUFF_SIZE, CDC_ICTRL_DS_BUFF_SIZE)) {
+        Error_Handler();
+    }
+    if (cdc_uart_cmd_register() || stats_cmd_register() || usb_device_stats_register()) {
+        Error_Handler();
+    }
+
+    /* Far end inputs are deasserted, low active */
+    GPIOA->IDR |= UART1_CTS_Pin | UART1_DSR_Pin | UART1_DCD_Pin;
+
+    for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+        sim_bridge_t *b = &g_bridges[i];
+
+        b->idx = i;
+        b->cdc_uart = &g_cdc_uart[i];
+        b->hcdc = &g_cdc_bridge[i];
+        b->uart = huarts[i]->Instance;
+        b->modem = i ? NULL : &g_uart1_modem;
+        b->up.mask = b->down.mask = 0xFFU;
+        b->uart->peer = (sim_uart_peer_t){ sim_far_tx, sim_far_rx, b };
+    }
+
+    sim_init(sim_loop, SIM_LOOP_NS);
+}
+
+static void sim_connect(void)
+{
+    sim_console_t *con = &g_console;
+    unsigned int i;
+
+    if (sim_usb_connect()) {
+        sim_die("enumeration failed");
+    }
+
+    for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+        sim_bridge_t *b = &g_bridges[i];
+
+        b->data_in = (sim_usb_pipe_t){ .ep_addr = 0x80U | b->hcdc->epnum_data, .on = 1,
+            .in = sim_host_data_in, .ctx = b };
+        b->data_out = (sim_usb_pipe_t){ .ep_addr = b->hcdc->epnum_data, .on = 1,
+            .out = sim_host_data_out, .ctx = b };
+        b->cmd_in = (sim_usb_pipe_t){ .ep_addr = 0x80U | b->hcdc->epnum_cmd, .on = 1,
+            .in = sim_host_cmd_in, .ctx = b };
+        if (sim_usb_pipe_add(&b->data_in) || sim_usb_pipe_add(&b->data_out) ||
+            sim_usb_pipe_add(&b->cmd_in)) {
+            sim_die("too many pipes");
+        }
+
+        /* DTR and RTS */
+        if (sim_usb_control(0x21, CDC_SET_CONTROL_LINE_STATE, 0x03, b->hcdc->ifnum_cmd, NULL, 0) < 0) {
+            sim_die("SET_CONTROL_LINE_STATE stalled");
+        }
+    }
+
+    con->in_pipe = (sim_usb_pipe_t){ .ep_addr = 0x80U | g_cdc1.epnum_data, .on = 1,
+        .in = sim_console_in, .ctx = con };
+    con->out = (sim_usb_pipe_t){ .ep_addr = g_cdc1.epnum_data, .on = 1,
+        .out = sim_console_out, .ctx = con };
+    if (sim_usb_pipe_add(&con->in_pipe) || sim_usb_pipe_add(&con->out)) {
+        sim_die("too many pipes");
+    }
+}
+
+static sim_bridge_t *sim_arg_bridge(const char *arg)
+{
+    char *end;
+    unsigned long idx = arg ? strtoul(arg, &end, 0) : 0;
+
+    if (!arg || *end || idx >= USBD_CDC_UART_NUM) {
+        sim_die("bad bridge '%s'", arg ? arg : "");
+    }
+    return &g_bridges[idx];
+}
+
+static uint64_t sim_arg_num(const char *arg)
+{
+    char *end;
+    unsigned long long val = arg ? strtoull(arg, &end, 0) : 0;
+
+    if (!arg || *end) {
+        sim_die("bad number '%s'", arg ? arg : "");
+    }
+    return val;
+}
+
+static int sim_arg_on(const char *arg)
+{
+    if (arg && !strcmp(arg, "on")) {
+        return 1;
+    }
+    if (!arg || strcmp(arg, "off")) {
+        sim_die("on or off expected");
+    }
+    return 0;
+}
+
+/* Line coding like 8N1 */
+static void sim_cmd_coding(sim_bridge_t *b, const char *baud, const char *fmt)
+{
+    static const char parities[] = "NOE";
+    pstn_line_coding_t lc = { .dwDTERate = (uint32_t)sim_arg_num(baud), .bDataBits = 8 };
+    const char *par;
+
+    if (fmt) {
+        par = strchr(parities, fmt[1]);
+        if (strlen(fmt) != 3 || (fmt[0] != '7' && fmt[0] != '8') || !fmt[1] || !par ||
+            (fmt[2] != '1' && fmt[2] != '2')) {
+            sim_die("bad format '%s'", fmt);
+        }
+        lc.bDataBits = (uint8_t)(fmt[0] - '0');
+        lc.bParityType = (uint8_t)(par - parities);
+        lc.bCharFormat = (fmt[2] == '2') ? 2 : 0;
+    }
+
+    if (sim_usb_control(0x21, CDC_SET_LINE_CODING, 0, b->hcdc->ifnum_cmd,
+            (uint8_t *)&lc, sizeof(lc)) < 0) {
+        sim_die("SET_LINE_CODING stalled");
+    }
+    b->up.mask = b->down.mask = (1U << lc.bDataBits) - 1U;
+}
+
+static void sim_cmd_framed(sim_bridge_t *b, const char *mode)
+{
+    if (!mode || !strcmp(mode, "off")) {
+        cdc_uart_set_framing(b->cdc_uart, CDC_UART_FRAMING_NONE, 0);
+    } else if (!strcmp(mode, "gap")) {
+        cdc_uart_set_framing(b->cdc_uart, CDC_UART_FRAMING_GAP, 0);
+    } else if (!strcmp(mode, "slip")) {
+        cdc_uart_set_framing(b->cdc_uart, CDC_UART_FRAMING_DELIM, CDC_UART_SLIP_END);
+    } else if (!strcmp(mode, "cobs")) {
+        cdc_uart_set_framing(b->cdc_uart, CDC_UART_FRAMING_DELIM, CDC_UART_COBS_DELIM);
+    } else {
+        sim_die("bad framing '%s'", mode);
+    }
+    b->framed = mode && strcmp(mode, "off");
+    b->rec_len = 0;
+    b->rec_left = 0;
+}
+
+static void sim_cmd_error(sim_bridge_t *b, const char *err)
+{
+    if (!err) {
+        sim_die("error expected");
+    } else if (!strcmp(err, "pe")) {
+        b->err_next = SIM_SYM_PE;
+    } else if (!strcmp(err, "fe")) {
+        b->err_next = SIM_SYM_FE;
+    } else if (!strcmp(err, "ne")) {
+        b->err_next = SIM_SYM_NE;
+    } else if (!strcmp(err, "ore")) {
+        b->err_next = SIM_SYM_ORE;
+    } else if (!strcmp(err, "break")) {
+        b->brk_next = 1;
+    } else {
+        sim_die("bad error '%s'", err);
+    }
+}
+
+static void sim_cmd_console(const char *text)
+{
+    sim_console_t *con = &g_console;
+    size_t len = strlen(text);
+
+    if (con->in_pos == con->in_len) {
+        con->in_pos = con->in_len = 0;
+    }
+    if (con->in_len + len + 1U > sizeof(con->in)) {
+        sim_die("console input is full");
+    }
+    memcpy(&con->in[con->in_len], text, len);
+    con->in_len += (uint32_t)len;
+    con->in[con->in_len++] = '\r';
+}
+
+static int sim_metric(const sim_stream_t *s, const char *name, uint64_t *val)
+{
+    uint64_t span = s->last_rx - s->first_tx;
+
+    if (!strcmp(name, "sent")) {
+        *val = s->tx_seq;
+    } else if (!strcmp(name, "recv")) {
+        *val = s->recv;
+    } else if (!strcmp(name, "lost")) {
+        *val = s->lost;
+    } else if (!strcmp(name, "garbage")) {
+        *val = s->garbage;
+    } else if (!strcmp(name, "lat_max")) {
+        *val = s->lat_max / SIM_US;
+    } else if (!strcmp(name, "lat_avg")) {
+        *val = s->recv ? s->lat_sum / s->recv / SIM_US : 0;
+    } else if (!strcmp(name, "rate")) {
+        *val = (s->recv && span) ? s->recv * 1000000000ULL / span : 0;
+    } else if (!strcmp(name, "frames")) {
+        *val = s->frames;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void sim_report_stream(const sim_bridge_t *b, const char *dir, const sim_stream_t *s)
+{
+    static const char *const names[] = { "sent", "recv", "lost", "garbage", "lat_avg", "lat_max", "rate", "frames" };
+    uint64_t val;
+    unsigned int i;
+
+    printf("bridge %u %-4s", b->idx, dir);
+    for (i = 0; i < COUNT_OF(names); i++) {
+        sim_metric(s, names[i], &val);
+        printf(" %s %" PRIu64, names[i], val);
+    }
+    putchar('\n');
+}
+
+static void sim_cmd_report(void)
+{
+    unsigned int i;
+
+    sim_console_break();
+    for (i = 0; i < USBD_CDC_UART_NUM; i++) {
+        sim_bridge_t *b = &g_bridges[i];
+
+        sim_report_stream(b, "up", &b->up);
+        sim_report_stream(b, "down", &b->down);
+        printf("bridge %u serial_state 0x%04x notifications %u dropped %u\n",
+                i, b->serial_state, b->serial_cnt, b->uart->rx_drop_cnt);
+    }
+}
+
+static int sim_stat(const char *path, uint64_t *val)
+{
+    const char *dot = strchr(path, '.');
+    const char *group, *name;
+    unsigned int i;
+
+    for (i = 0; dot && i < stats_total(); i++) {
+        if (!stats_name(i, &group, &name) && strlen(group) == (size_t)(dot - path) &&
+            !strncmp(group, path, (size_t)(dot - path)) && !strcmp(name, dot + 1)) {
+            *val = stats_read(i);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void sim_cmd_expect(char **argv, int argc)
+{
+    static const char *const ops[] = { "==", "!=", "<", "<=", ">", ">=" };
+    const char **expr = (const char **)&argv[1];
+    uint64_t val, ref;
+    unsigned int op;
+    int ok;
+
+    if (argc >= 4 && !strcmp(argv[1], "stat")) {
+        if (sim_stat(argv[2], &val)) {
+            sim_die("no counter '%s'", argv[2]);
+        }
+        expr = (const char **)&argv[2];
+    } else if (argc >= 5) {
+        sim_bridge_t *b = sim_arg_bridge(argv[1]);
+        sim_stream_t *s = !strcmp(argv[2], "up") ? &b->up :
+                !strcmp(argv[2], "down") ? &b->down : NULL;
+
+        if (!s || sim_metric(s, argv[3], &val)) {
+            sim_die("bad stream metric '%s %s'", argv[2], argv[3]);
+        }
+        expr = (const char **)&argv[3];
+    } else {
+        sim_die("bad expect");
+    }
+
+    if (!expr[1] || !expr[2]) {
+        sim_die("bad expect");
+    }
+    for (op = 0; op < COUNT_OF(ops) && strcmp(expr[1], ops[op]); op++) {
+    }
+    ref = sim_arg_num(expr[2]);
+
+    switch (op) {
+    case 0: ok = val == ref; break;
+    case 1: ok = val != ref; break;
+    case 2: ok = val < ref;  break;
+    case 3: ok = val <= ref; break;
+    case 4: ok = val > ref;  break;
+    case 5: ok = val >= ref; break;
+    default:
+        sim_die("bad op '%s'", expr[1]);
+    }
+
+    if (!ok) {
+        sim_console_break();
+        fflush(stdout);
+        fprintf(stderr, "%s:%u: FAIL %s is %" PRIu64 "\n", g_script.path, g_script.line, expr[0], val);
+        g_script.failed++;
+    }
+}
+
+static void sim_exec(char *line)
+{
+    char *argv[8];
+    int argc = 0;
+    char *tok;
+
+    if (!strncmp(line, "console ", 8)) {
+        sim_cmd_console(line + 8);
+        return;
+    }
+
+    for (tok = strtok(line, " \t"); tok && argc < (int)COUNT_OF(argv); tok = strtok(NULL, " \t")) {
+        argv[argc++] = tok;
+    }
+    if (!argc) {
+        return;
+    }
+    argv[argc] = NULL;
+
+    if (!strcmp(argv[0], "connect")) {
+        sim_connect();
+    } else if (!strcmp(argv[0], "run")) {
+        sim_run(sim_arg_num(argv[1]) * SIM_MS);
+    } else if (!strcmp(argv[0], "loop")) {
+        sim_init(sim_loop, sim_arg_num(argv[1]) * SIM_US);
+    } else if (!strcmp(argv[0], "coding")) {
+        sim_cmd_coding(sim_arg_bridge(argv[1]), argv[2], argc > 3 ? argv[3] : NULL);
+    } else if (!strcmp(argv[0], "send")) {
+        sim_bridge_t *b = sim_arg_bridge(argv[1]);
+
+        b->up.tx_left += (uint32_t)sim_arg_num(argv[2]);
+        b->burst = b->burst_left = (argc > 3) ? (uint32_t)sim_arg_num(argv[3]) : 0;
+        b->gap_ns = (argc > 4) ? sim_arg_num(argv[4]) * SIM_US : 0;
+    } else if (!strcmp(argv[0], "write")) {
+        sim_arg_bridge(argv[1])->down.tx_left += (uint32_t)sim_arg_num(argv[2]);
+    } else if (!strcmp(argv[0], "read")) {
+        sim_arg_bridge(argv[1])->data_in.on = sim_arg_on(argv[2]);
+    } else if (!strcmp(argv[0], "error")) {
+        sim_cmd_error(sim_arg_bridge(argv[1]), argv[2]);
+    } else if (!strcmp(argv[0], "cts")) {
+        sim_bridge_t *b = sim_arg_bridge(argv[1]);
+
+        if (!b->modem) {
+            sim_die("bridge %u has no modem lines", b->idx);
+        }
+        if (sim_arg_on(argv[2])) {
+            GPIOA->IDR &= ~(uint32_t)b->modem->cts.pin;
+        } else {
+            GPIOA->IDR |= b->modem->cts.pin;
+        }
+    } else if (!strcmp(argv[0], "framed")) {
+        sim_cmd_framed(sim_arg_bridge(argv[1]), argv[2]);
+    } else if (!strcmp(argv[0], "report")) {
+        sim_cmd_report();
+    } else if (!strcmp(argv[0], "expect")) {
+        sim_cmd_expect(argv, argc);
+    } else {
+        sim_die("unknown command '%s'", argv[0]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char line[256];
+    FILE *f;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-f")) {
+            g_uart1_modem.flow_ctrl = 1;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "usage: %s [-f] <script>\n", argv[0]);
+        return 2;
+    }
+
+    g_script.path = argv[i];
+    f = fopen(g_script.path, "r");
+    if (!f) {
+        perror(g_script.path);
+        return 2;
+    }
+
+    sim_fw_init();
+
+    while (fgets(line, sizeof(line), f)) {
+        g_script.line++;
+        line[strcspn(line, "#\r\n")] = 0;
+        sim_exec(line);
+    }
+    fclose(f);
+
+    fflush(stdout);
+    return g_script.failed ? 1 : 0;
+}
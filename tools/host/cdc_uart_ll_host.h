@@ -0,0 +1,70 @@
+#pragma once
+
+#include "sim.h"
+
+/*
+ * cdc_uart_ll.h of the host build. Registers are the fields of the
+ * USART model, sim_hal.c times the line and raises events by them.
+ */
+
+static inline uint32_t cdc_uart_ll_time_us(void)
+{
+    return (uint32_t)(g_sim_now / SIM_US);
+}
+
+static inline uint32_t cdc_uart_ll_rx_dma_pos(UART_HandleTypeDef *huart, uint32_t size)
+{
+    (void)size;
+    return huart->Instance->rx_pos;
+}
+
+static inline void cdc_uart_ll_rto_set(UART_HandleTypeDef *huart, uint32_t bits)
+{
+    huart->Instance->rto_bits = bits;
+    huart->Instance->rto_en = 1;
+}
+
+static inline void cdc_uart_ll_rto_irq_enable(UART_HandleTypeDef *huart)
+{
+    huart->Instance->idleie = 0;
+    huart->Instance->isr &= ~SIM_UART_RTOF;
+    huart->Instance->rtoie = 1;
+}
+
+static inline void cdc_uart_ll_rto_irq_disable(UART_HandleTypeDef *huart)
+{
+    huart->Instance->rtoie = 0;
+}
+
+static inline int cdc_uart_ll_rto_fetch(UART_HandleTypeDef *huart)
+{
+    if (!(huart->Instance->isr & SIM_UART_RTOF)) {
+        return 0;
+    }
+
+    huart->Instance->isr &= ~SIM_UART_RTOF;
+    return 1;
+}
+
+#define CDC_UART_LL_ERRORS  (USART_ISR_PE | USART_ISR_FE | USART_ISR_NE | USART_ISR_ORE)
+
+static inline uint32_t cdc_uart_ll_errors_fetch(UART_HandleTypeDef *huart)
+{
+    uint32_t errors = huart->Instance->isr & CDC_UART_LL_ERRORS;
+
+    huart->Instance->isr &= ~errors;
+    return errors;
+}
+
+static inline void cdc_uart_ll_frame_set(UART_HandleTypeDef *huart,
+        uint32_t word_len, uint32_t parity, uint32_t stop_bits, uint32_t over8, uint32_t brr)
+{
+    sim_uart_t *uart = huart->Instance;
+
+    uart->word_len = word_len;
+    uart->parity = parity;
+    uart->stop_bits = stop_bits;
+    uart->over8 = over8;
+    uart->brr = brr;
+    sim_uart_update(uart);
+}
@@ -0,0 +1,270 @@
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "av-fmt.h"
+#include "av-generic.h"
+#include "cdc_ictrl.h"
+#include "ictrl_rpc.h"
+#include "stats.h"
+
+/*
+ * USB_DEVICE/App/ictrl_rpc.c and Core/Src/stats.c on a host, the console
+ * is stdin/stdout, see tools/test_ictrl_rpc.py. Console text is echoed
+ * with a log record in front, so the client has something to skip.
+ *
+ *     ictrl_rpc_host [-t]
+ *
+ * -t  Output room is short on every other check, responses are held back.
+ */
+
+#define HOST_OUT_ROOM   512U
+
+typedef struct host_console_s {
+    const ictrl_cmd_t *cmds[ICTRL_CMD_MAX];
+    unsigned int cmd_num;
+
+    uint8_t *cap_buff;
+    uint32_t cap_size;
+    uint32_t cap_len;
+    int cap_cut;
+
+    int tight;
+    unsigned int room_checks;
+} host_console_t;
+
+static host_console_t g_host;
+
+/* Counters the stat requests page through */
+static uint32_t g_host_cnt[48];
+static char g_host_cnt_names[COUNT_OF(g_host_cnt)][24];
+static stats_desc_t g_host_cnt_desc[COUNT_OF(g_host_cnt)];
+
+uint32_t HAL_GetTick(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+int ictrl_print_out(const char *in_buff, int in_buff_len)
+{
+    host_console_t *host = &g_host;
+    int i;
+
+    if (host->cap_buff) {
+        for (i = 0; i < in_buff_len; i++) {
+            if (host->cap_len < host->cap_size) {
+                host->cap_buff[host->cap_len++] = (uint8_t)in_buff[i];
+            } else {
+                host->cap_cut = 1;
+            }
+        }
+        return in_buff_len;
+    }
+
+    return (int)write(STDOUT_FILENO, in_buff, (size_t)in_buff_len);
+}
+
+typedef struct host_fmt_s {
+    char buff[256];
+    int len;
+} host_fmt_t;
+
+static void host_fmt_put(void *ctx, char ch)
+{
+    host_fmt_t *fmt = ctx;
+
+    if (fmt->len < (int)sizeof(fmt->buff)) {
+        fmt->buff[fmt->len++] = ch;
+    }
+}
+
+int ictrl_printf(const char *format, ...)
+{
+    host_fmt_t fmt;
+    va_list ap;
+
+    fmt.len = 0;
+    va_start(ap, format);
+    av_vfmt(host_fmt_put, &fmt, format, ap);
+    va_end(ap);
+
+    return ictrl_print_out(fmt.buff, fmt.len);
+}
+
+uint32_t ictrl_out_free(void)
+{
+    host_console_t *host = &g_host;
+
+    if (host->cap_buff) {
+        return host->cap_size - host->cap_len;
+    }
+
+    return (host->tight && (host->room_checks++ & 1U)) ? 0 : HOST_OUT_ROOM;
+}
+
+int ictrl_cmd_register(const ictrl_cmd_t *cmds, unsigned int num)
+{
+    host_console_t *host = &g_host;
+    unsigned int i;
+
+    for (i = 0; i < num; i++) {
+        if (host->cmd_num == ICTRL_CMD_MAX) {
+            return -1;
+        }
+        host->cmds[host->cmd_num++] = &cmds[i];
+    }
+
+    return 0;
+}
+
+unsigned int ictrl_cmd_pass(void)
+{
+    return 0;
+}
+
+int ictrl_cmd_exec(char *line)
+{
+    host_console_t *host = &g_host;
+    char *argv[ICTRL_ARGC_MAX];
+    int argc = 0;
+    unsigned int i;
+    int rc;
+
+    for (line = strtok(line, " "); line; line = strtok(NULL, " ")) {
+        if (argc == ICTRL_ARGC_MAX) {
+            return ICTRL_CMD_UNKNOWN;
+        }
+        argv[argc++] = line;
+    }
+
+    for (i = 0; argc && i < host->cmd_num; i++) {
+        if (0 == strcmp(argv[0], host->cmds[i]->name)) {
+            rc = host->cmds[i]->handler(argc, argv);
+            if (rc < 0) {
+                ictrl_printf("%s %s\r\n", host->cmds[i]->name, host->cmds[i]->args);
+            }
+            return rc;
+        }
+    }
+
+    return ICTRL_CMD_UNKNOWN;
+}
+
+void ictrl_capture_start(uint8_t *buff, uint32_t size)
+{
+    host_console_t *host = &g_host;
+
+    host->cap_buff = buff;
+    host->cap_size = size;
+    host->cap_len = 0;
+    host->cap_cut = 0;
+}
+
+int ictrl_capture_stop(void)
+{
+    host_console_t *host = &g_host;
+
+    host->cap_buff = NULL;
+    return host->cap_cut ? -1 : (int)host->cap_len;
+}
+
+static int host_cmd_echo(int argc, char *argv[])
+{
+    int i;
+
+    if (argc < 2) {
+        return -1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        ictrl_printf("%s%s", argv[i], i + 1 < argc ? " " : "\r\n");
+    }
+    return 0;
+}
+
+/* More than a response takes */
+static int host_cmd_lines(int argc, char *argv[])
+{
+    int i;
+
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    for (i = 0; i < 16; i++) {
+        ictrl_printf("line %2d of the long listing\r\n", i);
+    }
+    return 0;
+}
+
+static const ictrl_cmd_t g_host_cmds[] = {
+    { "echo", "<word>...", "Arguments back", host_cmd_echo },
+    { "lines", "", "Listing cut by RPC", host_cmd_lines },
+};
+
+static void host_console_text(uint8_t ch)
+{
+    const ictrl_log_hdr_t rec = { ICTRL_LOG_MAGIC, 0, 0, 0 };
+
+    ictrl_print_out((const char *)&rec, sizeof(rec));
+    ictrl_print_out((const char *)&ch, 1);
+}
+
+static int host_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < COUNT_OF(g_host_cnt); i++) {
+        snprintf(g_host_cnt_names[i], sizeof(g_host_cnt_names[i]), "counter_%02u", i);
+        g_host_cnt_desc[i].name = g_host_cnt_names[i];
+        g_host_cnt_desc[i].ofs = i * sizeof(g_host_cnt[0]);
+        g_host_cnt[i] = 0x01000000U * i + i;
+    }
+
+    if (ictrl_cmd_register(g_host_cmds, COUNT_OF(g_host_cmds)) ||
+        stats_register("host", g_host_cnt, g_host_cnt_desc, COUNT_OF(g_host_cnt_desc)) ||
+        stats_cmd_register() ||
+        ictrl_rpc_init(HOST_OUT_ROOM)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    uint8_t ch;
+    int rc;
+
+    g_host.tight = (argc > 1 && 0 == strcmp(argv[1], "-t"));
+
+    if (host_init()) {
+        fprintf(stderr, "init failed\n");
+        return 1;
+    }
+
+    /* The console idle loop, input is held while a response waits */
+    for (;;) {
+        if (ictrl_rpc_flush() < 0) {
+            continue;
+        }
+
+        rc = poll(&pfd, 1, 10);
+        if (rc == 0) {
+            ictrl_rpc_on_idle(HAL_GetTick());
+            continue;
+        }
+        if (rc < 0 || read(STDIN_FILENO, &ch, 1) != 1) {
+            return 0;
+        }
+
+        if (ictrl_rpc_input(ch) < 0) {
+            host_console_text(ch);
+        }
+    }
+}
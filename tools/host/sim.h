@@ -0,0 +1,122 @@
+#pragma once
+#include <inttypes.h>
+
+#include "stm32l0xx_hal.h"
+#include "usbd_def.h"
+
+/*
+ * Hardware of the bridge, simulated on a host: USARTs with their DMA
+ * (sim_hal.c) and the USB device controller with a host polling it
+ * (sim_pcd.c). Firmware modules run on top unmodified, see bridge_sim.c.
+ *
+ * Time is virtual, nanoseconds since start. sim_run() advances it event
+ * by event: line symbols, USB packets and SOFs, main loop passes.
+ * Interrupt handlers run in between main loop passes, never inside one.
+ */
+
+#define SIM_US              1000ULL
+#define SIM_MS              1000000ULL
+
+#define SIM_PCLK            16000000U
+
+extern uint64_t g_sim_now;
+
+/* Main loop pass, called every loop_ns */
+typedef void (*sim_loop_t)(void);
+
+void sim_init(sim_loop_t loop, uint64_t loop_ns);
+void sim_run(uint64_t ns);
+
+/* Line symbol: data bits, plus the errors it is received with */
+#define SIM_SYM_PE          0x0100U
+#define SIM_SYM_FE          0x0200U
+#define SIM_SYM_NE          0x0400U
+#define SIM_SYM_ORE         0x0800U
+
+/* Far end of a UART line */
+typedef struct sim_uart_peer_s {
+    /* Next symbol to put on the line, which completes at end.
+     * Returns 0 if there is none, asked again a frame time later */
+    int (*tx)(void *ctx, uint64_t end, uint32_t *sym);
+    /* Byte from the bridge is complete */
+    void (*rx)(void *ctx, uint8_t byte);
+    void *ctx;
+} sim_uart_peer_t;
+
+#define SIM_UART_RTOF       0x0800U     /* USART_ISR_RTOF */
+
+/* USART model, the USART_TypeDef of the host build */
+struct sim_uart_s {
+    const char *name;
+    int lowpower;                       /* LPUART, no oversampling and no receiver timeout */
+    UART_HandleTypeDef *huart;          /* Set by HAL_UART_Init() */
+    sim_uart_peer_t peer;
+
+    /* Registers, as far as cdc_uart_ll_host.h touches them */
+    uint32_t word_len;                  /* UART_WORDLENGTH_xxx */
+    uint32_t parity;                    /* UART_PARITY_xxx */
+    uint32_t stop_bits;                 /* UART_STOPBITS_xxx */
+    uint32_t over8;                     /* UART_OVERSAMPLING_xxx */
+    uint32_t brr;
+    uint32_t rto_bits;
+    int rto_en;
+    int rtoie;
+    int idleie;
+    uint32_t isr;                       /* USART_ISR_xxx line errors, SIM_UART_RTOF */
+
+    uint64_t frame_ns;                  /* Symbol time by the registers above */
+
+    /* Circular RX DMA */
+    uint8_t *rx_buff;
+    uint32_t rx_size;
+    uint32_t rx_pos;
+    uint32_t rx_sym;                    /* On the line, complete at rx_end */
+    uint64_t rx_end;                    /* 0 if the line is idle */
+    uint64_t rx_poll;                   /* Far end is asked for the next symbol */
+    uint64_t rto_at;                    /* Pending receiver timeout, 0 if none */
+    uint64_t idle_at;                   /* Pending IDLE line, 0 if none */
+
+    /* Normal TX DMA */
+    const uint8_t *tx_buff;
+    uint32_t tx_len;
+    uint32_t tx_done;
+    uint64_t tx_end;                    /* Byte on the line is complete, 0 if none */
+
+    uint32_t rx_drop_cnt;               /* Received while the reception is off */
+};
+
+typedef struct sim_uart_s sim_uart_t;
+
+/* Symbol time of the current registers, half_bits long */
+uint64_t sim_uart_bits_ns(const sim_uart_t *uart, uint32_t half_bits);
+/* Registers are changed, retime the line */
+void sim_uart_update(sim_uart_t *uart);
+
+/*
+ * USB host side of an endpoint. IN endpoints are polled while on,
+ * OUT ones while out() has data. Data of each packet is passed at the
+ * time the packet is on the bus.
+ */
+typedef struct sim_usb_pipe_s {
+    uint8_t ep_addr;
+    int on;
+    void (*in)(void *ctx, const uint8_t *data, uint32_t len);
+    /* Next bytes the host writes, up to max. Returns their number */
+    uint32_t (*out)(void *ctx, uint8_t *data, uint32_t max);
+    void *ctx;
+} sim_usb_pipe_t;
+
+#define SIM_USB_PIPE_MAX    8U
+
+int sim_usb_pipe_add(sim_usb_pipe_t *pipe);
+
+/* Bus reset, SET_ADDRESS and SET_CONFIGURATION, done at once */
+int sim_usb_connect(void);
+
+/* Control transfer done at once. Returns data stage length, -1 on STALL */
+int sim_usb_control(uint8_t type, uint8_t req, uint16_t value, uint16_t index,
+        uint8_t *data, uint16_t len);
+
+/* Next USB event and its processing, for sim_run() */
+uint64_t sim_usb_next(void);
+void sim_usb_step(void);
@@ -0,0 +1,387 @@
+#include <string.h>
+
+#include "sim.h"
+#include "cdc_uart.h"
+
+/*
+ * Virtual clock, GPIO, RCC and the USARTs with their DMA channels.
+ *
+ * A symbol takes the frame time of the current registers, start and
+ * stop bits included. RX DMA is circular and raises HT/TC events, the
+ * USART raises receiver timeout or IDLE line once the line is silent.
+ * Interrupts are dispatched the way stm32l0xx_it.c and HAL do it:
+ * cdc_uart_irq_hook() first, then the HAL callbacks.
+ */
+
+uint64_t g_sim_now;
+
+const uint32_t g_sim_uid[3] = { 0x004D4953U, 0x54534F48U, 0x00000001U };
+
+GPIO_TypeDef g_sim_gpio[2];
+
+sim_uart_t g_sim_usart1 = { .name = "USART1" };
+sim_uart_t g_sim_usart2 = { .name = "USART2" };
+sim_uart_t g_sim_lpuart1 = { .name = "LPUART1", .lowpower = 1 };
+
+static sim_uart_t *const g_sim_uarts[] = { &g_sim_usart1, &g_sim_usart2, &g_sim_lpuart1 };
+
+static struct {
+    sim_loop_t loop;
+    uint64_t loop_ns;
+    uint64_t loop_next;
+} g_sim;
+
+#define SIM_NEVER           UINT64_MAX
+
+/* USART_ISR_xxx line errors of a symbol */
+#define SIM_SYM_ISR(_sym)   (((_sym) >> 8) & (USART_ISR_PE | USART_ISR_FE | USART_ISR_NE | USART_ISR_ORE))
+
+uint32_t HAL_GetTick(void)
+{
+    return (uint32_t)(g_sim_now / SIM_MS);
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    if (PinState == GPIO_PIN_SET) {
+        GPIOx->ODR |= GPIO_Pin;
+    } else {
+        GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+    }
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    GPIOx->ODR ^= GPIO_Pin;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+    return SIM_PCLK;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+    return SIM_PCLK;
+}
+
+uint64_t sim_uart_bits_ns(const sim_uart_t *uart, uint32_t half_bits)
+{
+    uint64_t div = uart->brr;
+    uint64_t den = 2ULL * SIM_PCLK;
+
+    if (uart->lowpower) {
+        den *= 256U;
+    } else if (uart->over8 == UART_OVERSAMPLING_8) {
+        /* BRR[2:0] is USARTDIV[3:0] shifted right */
+        div = (div & 0xFFF0U) | ((div & 0x7U) << 1);
+        den *= 2U;
+    }
+
+    return half_bits * div * 1000000000ULL / den;
+}
+
+/* Word length includes the parity bit */
+static uint32_t sim_uart_word_bits(const sim_uart_t *uart)
+{
+    return (uart->word_len == UART_WORDLENGTH_9B) ? 9U :
+            (uart->word_len == UART_WORDLENGTH_7B) ? 7U : 8U;
+}
+
+static uint32_t sim_uart_data_bits(const sim_uart_t *uart)
+{
+    return sim_uart_word_bits(uart) - (uart->parity != UART_PARITY_NONE);
+}
+
+void sim_uart_update(sim_uart_t *uart)
+{
+    uint32_t stop_half_bits = (uart->stop_bits == UART_STOPBITS_2) ? 4U :
+            (uart->stop_bits == UART_STOPBITS_1_5) ? 3U : 2U;
+
+    uart->frame_ns = sim_uart_bits_ns(uart, 2U * (1U + sim_uart_word_bits(uart)) + stop_half_bits);
+}
+
+/*
+ * Received byte as DMA reads it out of RDR. With a 7 bit word the parity
+ * bit is bit 7 of the data, RM0367 says so.
+ */
+static uint8_t sim_uart_rdr(const sim_uart_t *uart, uint32_t sym)
+{
+    uint32_t data_bits = sim_uart_data_bits(uart);
+    uint32_t data = sym & ((1U << data_bits) - 1U);
+    uint32_t par;
+
+    if (uart->parity == UART_PARITY_NONE || data_bits != 7U) {
+        return (uint8_t)data;
+    }
+
+    par = (uint32_t)__builtin_parity(data) ^ (uart->parity == UART_PARITY_ODD);
+    return (uint8_t)(data | (par << 7));
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+    sim_uart_t *uart = huart->Instance;
+    uint32_t usartdiv;
+
+    uart->huart = huart;
+    uart->word_len = huart->Init.WordLength;
+    uart->parity = huart->Init.Parity;
+    uart->stop_bits = huart->Init.StopBits;
+    uart->over8 = huart->Init.OverSampling;
+
+    if (uart->lowpower) {
+        uart->brr = (uint32_t)UART_DIV_LPUART(SIM_PCLK, huart->Init.BaudRate);
+    } else if (uart->over8 == UART_OVERSAMPLING_8) {
+        usartdiv = UART_DIV_SAMPLING8(SIM_PCLK, huart->Init.BaudRate);
+        uart->brr = (usartdiv & 0xFFF0U) | ((usartdiv & 0x000FU) >> 1U);
+    } else {
+        uart->brr = UART_DIV_SAMPLING16(SIM_PCLK, huart->Init.BaudRate);
+    }
+    sim_uart_update(uart);
+
+    huart->gState = HAL_UART_STATE_READY;
+    huart->RxState = HAL_UART_STATE_READY;
+    huart->ErrorCode = HAL_UART_ERROR_NONE;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+    sim_uart_t *uart = huart->Instance;
+
+    if (huart->RxState != HAL_UART_STATE_READY) {
+        return HAL_BUSY;
+    }
+    if (!pData || !Size) {
+        return HAL_ERROR;
+    }
+
+    uart->rx_buff = pData;
+    uart->rx_size = Size;
+    uart->rx_pos = 0;
+    uart->idleie = 1;
+
+    huart->RxXferSize = Size;
+    huart->RxState = HAL_UART_STATE_BUSY_RX;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+    sim_uart_t *uart = huart->Instance;
+
+    if (huart->gState != HAL_UART_STATE_READY) {
+        return HAL_BUSY;
+    }
+    if (!pData || !Size) {
+        return HAL_ERROR;
+    }
+
+    uart->tx_buff = pData;
+    uart->tx_len = Size;
+    uart->tx_done = 0;
+    uart->tx_end = g_sim_now + uart->frame_ns;
+
+    huart->TxXferSize = Size;
+    huart->gState = HAL_UART_STATE_BUSY_TX;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Abort_IT(UART_HandleTypeDef *huart)
+{
+    sim_uart_t *uart = huart->Instance;
+
+    uart->rx_buff = NULL;
+    uart->idleie = 0;
+    uart->idle_at = 0;
+    uart->tx_buff = NULL;
+    uart->tx_end = 0;
+
+    huart->gState = HAL_UART_STATE_READY;
+    huart->RxState = HAL_UART_STATE_READY;
+    huart->ErrorCode = HAL_UART_ERROR_NONE;
+    return HAL_OK;
+}
+
+static int sim_uart_rx_on(const sim_uart_t *uart)
+{
+    return uart->rx_buff && uart->huart->RxState == HAL_UART_STATE_BUSY_RX;
+}
+
+static void sim_uart_tx_done(sim_uart_t *uart)
+{
+    UART_HandleTypeDef *huart = uart->huart;
+    uint8_t byte = uart->tx_buff[uart->tx_done++];
+
+    uart->tx_end = 0;
+    if (uart->peer.rx) {
+        uart->peer.rx(uart->peer.ctx, byte & (uint8_t)((1U << sim_uart_data_bits(uart)) - 1U));
+    }
+
+    if (uart->tx_done < uart->tx_len) {
+        uart->tx_end = g_sim_now + uart->frame_ns;
+        return;
+    }
+
+    /* USART TC, after the last stop bit */
+    uart->tx_buff = NULL;
+    huart->gState = HAL_UART_STATE_READY;
+    HAL_UART_TxCpltCallback(huart);
+}
+
+static void sim_uart_rx_done(sim_uart_t *uart)
+{
+    UART_HandleTypeDef *huart = uart->huart;
+    uint32_t sym = uart->rx_sym;
+
+    /* Next symbol might follow right away. Timeouts count from here */
+    uart->rx_end = 0;
+    uart->rx_poll = g_sim_now;
+    uart->rto_at = uart->rto_en ? g_sim_now + sim_uart_bits_ns(uart, 2U * uart->rto_bits) : 0;
+    uart->idle_at = g_sim_now + uart->frame_ns;
+
+    if (!sim_uart_rx_on(uart)) {
+        uart->rx_drop_cnt++;
+        return;
+    }
+
+    /* DMA has the byte by the time the error interrupt is served */
+    uart->rx_buff[uart->rx_pos++] = sim_uart_rdr(uart, sym);
+    if (SIM_SYM_ISR(sym)) {
+        uart->isr |= SIM_SYM_ISR(sym);
+        cdc_uart_irq_hook(huart);
+    }
+
+    if (uart->rx_pos == uart->rx_size / 2U) {
+        /* DMA HT */
+        HAL_UARTEx_RxEventCallback(huart, (uint16_t)uart->rx_pos);
+    } else if (uart->rx_pos == uart->rx_size) {
+        /* DMA TC, NDTR is reloaded */
+        uart->rx_pos = 0;
+        HAL_UARTEx_RxEventCallback(huart, (uint16_t)uart->rx_size);
+    }
+}
+
+static void sim_uart_rx_start(sim_uart_t *uart)
+{
+    uint64_t end = g_sim_now + uart->frame_ns;
+
+    if (uart->peer.tx && uart->peer.tx(uart->peer.ctx, end, &uart->rx_sym)) {
+        uart->rx_end = end;
+        uart->rx_poll = SIM_NEVER;
+    } else {
+        uart->rx_poll = end;
+    }
+}
+
+static void sim_uart_rto(sim_uart_t *uart)
+{
+    uart->rto_at = 0;
+    uart->isr |= SIM_UART_RTOF;
+
+    if (uart->rtoie) {
+        cdc_uart_irq_hook(uart->huart);
+    }
+}
+
+/* HAL_UART_IRQHandler(): IDLE in the middle of the DMA buffer is an event */
+static void sim_uart_idle(sim_uart_t *uart)
+{
+    uart->idle_at = 0;
+
+    if (!uart->idleie || !sim_uart_rx_on(uart)) {
+        return;
+    }
+
+    cdc_uart_irq_hook(uart->huart);
+    if (uart->rx_pos) {
+        HAL_UARTEx_RxEventCallback(uart->huart, (uint16_t)uart->rx_pos);
+    }
+}
+
+static uint64_t sim_uart_next(const sim_uart_t *uart)
+{
+    uint64_t t = uart->rx_end ? uart->rx_end : uart->rx_poll;
+
+    if (uart->tx_end && uart->tx_end < t) {
+        t = uart->tx_end;
+    }
+    if (uart->rto_at && uart->rto_at < t) {
+        t = uart->rto_at;
+    }
+    if (uart->idle_at && uart->idle_at < t) {
+        t = uart->idle_at;
+    }
+    return t;
+}
+
+static void sim_uart_step(sim_uart_t *uart)
+{
+    if (uart->tx_end && uart->tx_end <= g_sim_now) {
+        sim_uart_tx_done(uart);
+    }
+    if (uart->rx_end && uart->rx_end <= g_sim_now) {
+        sim_uart_rx_done(uart);
+    }
+    if (!uart->rx_end && uart->rx_poll <= g_sim_now) {
+        sim_uart_rx_start(uart);
+    }
+    if (uart->rto_at && uart->rto_at <= g_sim_now) {
+        sim_uart_rto(uart);
+    }
+    if (uart->idle_at && uart->idle_at <= g_sim_now) {
+        sim_uart_idle(uart);
+    }
+}
+
+void sim_init(sim_loop_t loop, uint64_t loop_ns)
+{
+    g_sim.loop = loop;
+    g_sim.loop_ns = loop_ns;
+    g_sim.loop_next = g_sim_now;
+}
+
+void sim_run(uint64_t ns)
+{
+    uint64_t end = g_sim_now + ns;
+    uint64_t t, next;
+    unsigned int i;
+
+    for (;;) {
+        t = g_sim.loop_next;
+        for (i = 0; i < COUNT_OF(g_sim_uarts); i++) {
+            if (g_sim_uarts[i]->huart) {
+                next = sim_uart_next(g_sim_uarts[i]);
+                t = next < t ? next : t;
+            }
+        }
+        next = sim_usb_next();
+        t = next < t ? next : t;
+
+        if (t > end) {
+            break;
+        }
+        g_sim_now = t;
+
+        for (i = 0; i < COUNT_OF(g_sim_uarts); i++) {
+            if (g_sim_uarts[i]->huart) {
+                sim_uart_step(g_sim_uarts[i]);
+            }
+        }
+        if (sim_usb_next() <= g_sim_now) {
+            sim_usb_step();
+        }
+        if (g_sim.loop_next <= g_sim_now) {
+            g_sim.loop();
+            g_sim.loop_next = g_sim_now + g_sim.loop_ns;
+        }
+    }
+
+    g_sim_now = end;
+}
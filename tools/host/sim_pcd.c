@@ -0,0 +1,368 @@
+#include <string.h>
+
+#include "sim.h"
+#include "usbd_core.h"
+#include "av-generic.h"
+
+/*
+ * Full speed USB device controller, the USBD_LL_xxx functions of
+ * usbd_conf.c, and the host on the other end of the bus.
+ *
+ * A frame is 1 ms and begins with SOF. Within a frame the host polls
+ * its pipes round robin, a packet at a time, while the frame has room
+ * for a full packet. A pipe with nothing to move is NAKed and polled
+ * again SIM_USB_POLL_NS later. Control transfers are done at once,
+ * outside of the bus timing.
+ */
+
+#define SIM_USB_EP_NUM          8U
+#define SIM_USB_FRAME_NS        SIM_MS
+#define SIM_USB_FRAME_ROOM_NS   (SIM_USB_FRAME_NS - 20U * SIM_US)  /* SOF and EOF guard aside */
+#define SIM_USB_BYTE_NS         667U                /* 12 Mbit/s */
+#define SIM_USB_PKT_OVERHEAD    13U                 /* Token, handshake, sync, CRC, EOP and gaps */
+#define SIM_USB_POLL_NS         (10U * SIM_US)
+#define SIM_USB_CTRL_PKT_MAX    64U                 /* Control transfer packets, a sanity limit */
+
+#define SIM_USB_PKT_NS(_len)    (((_len) + SIM_USB_PKT_OVERHEAD) * (uint64_t)SIM_USB_BYTE_NS)
+
+typedef struct sim_ep_s {
+    uint8_t *buff;
+    uint32_t len;
+    uint32_t done;
+    uint32_t rx_size;                   /* OUT transfer completed */
+    uint16_t mps;
+    uint8_t open;
+    uint8_t busy;
+    uint8_t stall;
+} sim_ep_t;
+
+typedef struct sim_usb_s {
+    USBD_Handle *pdev;
+    sim_ep_t in[SIM_USB_EP_NUM];
+    sim_ep_t out[SIM_USB_EP_NUM];
+
+    sim_usb_pipe_t *pipes[SIM_USB_PIPE_MAX];
+    unsigned int pipe_num;
+    unsigned int pipe_rr;               /* Polled first in the next slot */
+
+    int connected;
+    uint64_t frame_start;
+    uint64_t next;                      /* Next slot */
+} sim_usb_t;
+
+static sim_usb_t g_sim_usb;
+
+static sim_ep_t *sim_usb_ep(uint8_t ep_addr)
+{
+    sim_usb_t *usb = &g_sim_usb;
+
+    return (ep_addr & 0x80U) ? &usb->in[ep_addr & 0x7FU] : &usb->out[ep_addr & 0x7FU];
+}
+
+USBD_Status USBD_LL_Init(USBD_Handle *pdev)
+{
+    g_sim_usb.pdev = pdev;
+    return USBD_OK;
+}
+
+USBD_Status USBD_LL_DeInit(USBD_Handle *pdev)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    return USBD_OK;
+}
+
+USBD_Status USBD_LL_Start(USBD_Handle *pdev)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    return USBD_OK;
+}
+
+USBD_Status USBD_LL_Stop(USBD_Handle *pdev)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    g_sim_usb.connected = 0;
+    return USBD_OK;
+}
+
+/* The core keeps EP0 packet size in its endpoint, as usbd_conf.c does */
+static USBD_Endpoint *sim_usb_usbd_ep(USBD_Handle *pdev, uint8_t ep_addr)
+{
+    return (ep_addr & 0x80U) ? &pdev->ep_in[ep_addr & 0x7FU] : &pdev->ep_out[ep_addr & 0x7FU];
+}
+
+USBD_Status USBD_LL_OpenEP(USBD_Handle *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps)
+{
+    USBD_Endpoint *usbd_ep = sim_usb_usbd_ep(pdev, ep_addr);
+    sim_ep_t *ep = sim_usb_ep(ep_addr);
+
+    UNREFERENCED_PARAMETER(ep_type);
+
+    usbd_ep->is_used = 1;
+    usbd_ep->maxpacket = ep_mps;
+
+    memset(ep, 0, sizeof(*ep));
+    ep->mps = ep_mps;
+    ep->open = 1;
+    return USBD_OK;
+}
+
+void USBD_LL_CloseEP(USBD_Handle *pdev, uint8_t ep_addr)
+{
+    USBD_Endpoint *usbd_ep = sim_usb_usbd_ep(pdev, ep_addr);
+    sim_ep_t *ep = sim_usb_ep(ep_addr);
+
+    usbd_ep->is_used = 0;
+    usbd_ep->maxpacket = 0;
+    ep->open = 0;
+    ep->busy = 0;
+}
+
+USBD_Status USBD_LL_FlushEP(USBD_Handle *pdev, uint8_t ep_addr)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    UNREFERENCED_PARAMETER(ep_addr);
+    return USBD_OK;
+}
+
+USBD_Status USBD_LL_StallEP(USBD_Handle *pdev, uint8_t ep_addr)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    sim_usb_ep(ep_addr)->stall = 1;
+    return USBD_OK;
+}
+
+USBD_Status USBD_LL_ClearStallEP(USBD_Handle *pdev, uint8_t ep_addr)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    sim_usb_ep(ep_addr)->stall = 0;
+    return USBD_OK;
+}
+
+uint8_t USBD_LL_IsStallEP(USBD_Handle *pdev, uint8_t ep_addr)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    return sim_usb_ep(ep_addr)->stall;
+}
+
+USBD_Status USBD_LL_SetUSBAddress(USBD_Handle *pdev, uint8_t dev_addr)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    UNREFERENCED_PARAMETER(dev_addr);
+    return USBD_OK;
+}
+
+/* IN endpoint, ep_addr direction bit is optional (EP0 status stage has none) */
+USBD_Status USBD_LL_Transmit(USBD_Handle *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size)
+{
+    sim_ep_t *ep = sim_usb_ep(ep_addr | 0x80U);
+
+    UNREFERENCED_PARAMETER(pdev);
+    ep->buff = pbuf;
+    ep->len = size;
+    ep->done = 0;
+    ep->busy = 1;
+    return USBD_OK;
+}
+
+USBD_Status USBD_LL_PrepareReceive(USBD_Handle *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size)
+{
+    sim_ep_t *ep = sim_usb_ep(ep_addr & 0x7FU);
+
+    UNREFERENCED_PARAMETER(pdev);
+    ep->buff = pbuf;
+    ep->len = size;
+    ep->done = 0;
+    ep->busy = 1;
+    return USBD_OK;
+}
+
+uint32_t USBD_LL_GetRxDataSize(USBD_Handle *pdev, uint8_t ep_addr)
+{
+    UNREFERENCED_PARAMETER(pdev);
+    return sim_usb_ep(ep_addr & 0x7FU)->rx_size;
+}
+
+void USBD_LL_Delay(uint32_t Delay)
+{
+    UNREFERENCED_PARAMETER(Delay);
+}
+
+int sim_usb_pipe_add(sim_usb_pipe_t *pipe)
+{
+    sim_usb_t *usb = &g_sim_usb;
+
+    if (usb->pipe_num == SIM_USB_PIPE_MAX) {
+        return -1;
+    }
+
+    usb->pipes[usb->pipe_num++] = pipe;
+    return 0;
+}
+
+/*
+ * EP0 data moves a packet per DataIn/DataOut stage, as HAL PCD does it.
+ * The stack then continues with the buffer advanced past the packet.
+ */
+int sim_usb_control(uint8_t type, uint8_t req, uint16_t value, uint16_t index,
+        uint8_t *data, uint16_t len)
+{
+    sim_usb_t *usb = &g_sim_usb;
+    sim_ep_t *in = &usb->in[0];
+    sim_ep_t *out = &usb->out[0];
+    uint8_t setup[8] = {
+        type, req, (uint8_t)value, (uint8_t)(value >> 8),
+        (uint8_t)index, (uint8_t)(index >> 8), (uint8_t)len, (uint8_t)(len >> 8)
+    };
+    uint32_t got = 0;
+    uint32_t n, i;
+
+    in->busy = in->stall = 0;
+    out->busy = out->stall = 0;
+    USBD_LL_SetupStage(usb->pdev, setup);
+
+    /* A request error stalls both directions. IN stall alone ends a good data stage */
+    if (type & 0x80U) {
+        for (i = 0; in->busy && !out->stall && i < SIM_USB_CTRL_PKT_MAX; i++) {
+            n = MIN(in->len, in->mps);
+            if (n && got + n <= len) {
+                memcpy(&data[got], in->buff, n);
+            }
+            got += n;
+            in->busy = 0;
+            USBD_LL_DataInStage(usb->pdev, 0, in->buff + n);
+            /* Short packet ends the data stage */
+            if (n < in->mps || got >= len) {
+                break;
+            }
+        }
+        if (out->stall || !out->busy) {
+            return -1;
+        }
+
+        /* Status stage, ZLP out */
+        out->rx_size = 0;
+        out->busy = 0;
+        USBD_LL_DataOutStage(usb->pdev, 0, out->buff);
+        return (int)MIN(got, len);
+    }
+
+    for (i = 0; got < len && out->busy && !out->stall && i < SIM_USB_CTRL_PKT_MAX; i++) {
+        n = MIN(len - got, out->mps);
+        memcpy(out->buff, &data[got], n);
+        got += n;
+        out->rx_size = n;
+        out->busy = 0;
+        USBD_LL_DataOutStage(usb->pdev, 0, out->buff + n);
+    }
+    if (out->stall || in->stall || got < len || !in->busy) {
+        return -1;
+    }
+
+    /* Status stage, ZLP in */
+    in->busy = 0;
+    USBD_LL_DataInStage(usb->pdev, 0, in->buff);
+    return (int)got;
+}
+
+int sim_usb_connect(void)
+{
+    sim_usb_t *usb = &g_sim_usb;
+    uint8_t desc[USBD_MAX_STR_DESC_SIZ];
+    int len;
+
+    usb->connected = 1;
+    usb->frame_start = g_sim_now;
+    usb->next = g_sim_now;
+
+    USBD_LL_SetSpeed(usb->pdev, USBD_SPEED_FULL);
+    USBD_LL_Reset(usb->pdev);
+
+    /* Enough of the enumeration to get the descriptors checked */
+    if (sim_usb_control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_DEVICE << 8, 0, desc, 18) != 18 ||
+        sim_usb_control(0x00, USB_REQ_SET_ADDRESS, 1, 0, NULL, 0) < 0 ||
+        sim_usb_control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_CONFIGURATION << 8, 0, desc, 9) != 9) {
+        return -1;
+    }
+
+    len = desc[2] | desc[3] << 8;
+    if (len > (int)sizeof(desc) ||
+        sim_usb_control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_CONFIGURATION << 8, 0, desc, (uint16_t)len) != len ||
+        sim_usb_control(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, NULL, 0) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A packet of the pipe. Returns its bus time, 0 if NAKed */
+static uint64_t sim_usb_packet(sim_usb_pipe_t *pipe)
+{
+    sim_usb_t *usb = &g_sim_usb;
+    uint8_t num = pipe->ep_addr & 0x7FU;
+    sim_ep_t *ep = sim_usb_ep(pipe->ep_addr);
+    uint32_t n;
+
+    if (!pipe->on || !ep->open || !ep->busy || ep->stall) {
+        return 0;
+    }
+
+    if (pipe->ep_addr & 0x80U) {
+        n = MIN(ep->len - ep->done, ep->mps);
+        if (pipe->in) {
+            pipe->in(pipe->ctx, ep->buff + ep->done, n);
+        }
+        ep->done += n;
+        if (n < ep->mps || ep->done == ep->len) {
+            ep->busy = 0;
+            USBD_LL_DataInStage(usb->pdev, num, ep->buff + ep->done);
+        }
+        return SIM_USB_PKT_NS(n);
+    }
+
+    n = pipe->out ? pipe->out(pipe->ctx, ep->buff + ep->done, MIN(ep->len - ep->done, ep->mps)) : 0;
+    if (!n) {
+        return 0;
+    }
+    ep->done += n;
+    if (n < ep->mps || ep->done == ep->len) {
+        ep->busy = 0;
+        ep->rx_size = ep->done;
+        USBD_LL_DataOutStage(usb->pdev, num, ep->buff + ep->done);
+    }
+    return SIM_USB_PKT_NS(n);
+}
+
+uint64_t sim_usb_next(void)
+{
+    return g_sim_usb.connected ? g_sim_usb.next : UINT64_MAX;
+}
+
+void sim_usb_step(void)
+{
+    sim_usb_t *usb = &g_sim_usb;
+    uint64_t frame_end, pkt_ns;
+    unsigned int i, idx;
+
+    if (g_sim_now >= usb->frame_start + SIM_USB_FRAME_NS) {
+        usb->frame_start = g_sim_now;
+        USBD_LL_SOF(usb->pdev);
+    }
+
+    frame_end = usb->frame_start + SIM_USB_FRAME_NS;
+    if (g_sim_now + SIM_USB_PKT_NS(64U) > usb->frame_start + SIM_USB_FRAME_ROOM_NS) {
+        usb->next = frame_end;
+        return;
+    }
+
+    for (i = 0; i < usb->pipe_num; i++) {
+        idx = (usb->pipe_rr + i) % usb->pipe_num;
+        pkt_ns = sim_usb_packet(usb->pipes[idx]);
+        if (pkt_ns) {
+            usb->pipe_rr = idx + 1U;
+            usb->next = g_sim_now + pkt_ns;
+            return;
+        }
+    }
+
+    usb->next = MIN(g_sim_now + SIM_USB_POLL_NS, frame_end);
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <inttypes.h>
+
+/* Off-target, no interrupts to mask. Modules run from one thread */
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+static inline uint32_t __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(uint32_t primask) { (void)primask; }
+static inline void __DMB(void) {}
+static inline uint32_t __get_IPSR(void) { return 0; }
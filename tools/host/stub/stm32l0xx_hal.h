@@ -0,0 +1,143 @@
+#pragma once
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include "cmsis_compiler.h"
+
+/*
+ * Off-target stand-in of the HAL, just what the firmware modules built
+ * by tools/host touch. HAL_GetTick() is provided by each harness, the
+ * UART, DMA, GPIO and RCC functions by sim_hal.c.
+ */
+#define __IO                volatile
+#define __weak              __attribute__((weak))
+#define __ALIGN_BEGIN
+#define __ALIGN_END         __attribute__((aligned(4)))
+#define UNUSED(X)           (void)X
+#define assert_param(expr)  assert(expr)
+
+typedef enum {
+    HAL_OK,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT,
+} HAL_StatusTypeDef;
+
+typedef struct {
+    int dummy;
+} PCD_HandleTypeDef;
+
+extern uint32_t HAL_GetTick(void);
+
+/* Device electronic signature, read by usbd_desc.c */
+extern const uint32_t g_sim_uid[3];
+#define UID_BASE            ((uintptr_t)g_sim_uid)
+
+/* GPIO, pin levels only. Inputs read back IDR, the simulation drives it */
+typedef struct {
+    volatile uint32_t IDR;
+    volatile uint32_t ODR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef g_sim_gpio[2];
+#define GPIOA               (&g_sim_gpio[0])
+#define GPIOB               (&g_sim_gpio[1])
+
+#define GPIO_PIN_0          ((uint16_t)0x0001)
+#define GPIO_PIN_1          ((uint16_t)0x0002)
+#define GPIO_PIN_2          ((uint16_t)0x0004)
+#define GPIO_PIN_3          ((uint16_t)0x0008)
+#define GPIO_PIN_4          ((uint16_t)0x0010)
+#define GPIO_PIN_5          ((uint16_t)0x0020)
+#define GPIO_PIN_6          ((uint16_t)0x0040)
+#define GPIO_PIN_7          ((uint16_t)0x0080)
+#define GPIO_PIN_8          ((uint16_t)0x0100)
+
+typedef enum {
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+/* PCLK1 = PCLK2 = HSI16, as SystemClock_Config() sets them */
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+
+/* UART. Instances are USART models of sim_hal.c, see sim.h */
+typedef struct sim_uart_s USART_TypeDef;
+
+extern USART_TypeDef g_sim_usart1, g_sim_usart2, g_sim_lpuart1;
+#define USART1              (&g_sim_usart1)
+#define USART2              (&g_sim_usart2)
+#define LPUART1             (&g_sim_lpuart1)
+
+typedef struct {
+    int dummy;
+} DMA_HandleTypeDef;
+
+typedef struct {
+    uint32_t BaudRate;
+    uint32_t WordLength;
+    uint32_t StopBits;
+    uint32_t Parity;
+    uint32_t Mode;
+    uint32_t HwFlowCtl;
+    uint32_t OverSampling;
+} UART_InitTypeDef;
+
+typedef enum {
+    HAL_UART_STATE_RESET = 0x00U,
+    HAL_UART_STATE_READY = 0x20U,
+    HAL_UART_STATE_BUSY_TX = 0x21U,
+    HAL_UART_STATE_BUSY_RX = 0x22U,
+} HAL_UART_StateTypeDef;
+
+typedef struct __UART_HandleTypeDef {
+    USART_TypeDef *Instance;
+    UART_InitTypeDef Init;
+    uint16_t TxXferSize;
+    uint16_t RxXferSize;
+    DMA_HandleTypeDef *hdmatx;
+    DMA_HandleTypeDef *hdmarx;
+    volatile HAL_UART_StateTypeDef gState;
+    volatile HAL_UART_StateTypeDef RxState;
+    volatile uint32_t ErrorCode;
+} UART_HandleTypeDef;
+
+/* Init values are the CR1/CR2 bits, as on the target */
+#define UART_WORDLENGTH_7B      0x10000000U
+#define UART_WORDLENGTH_8B      0x00000000U
+#define UART_WORDLENGTH_9B      0x00001000U
+#define UART_STOPBITS_1         0x00000000U
+#define UART_STOPBITS_1_5       0x00003000U
+#define UART_STOPBITS_2         0x00002000U
+#define UART_PARITY_NONE        0x00000000U
+#define UART_PARITY_EVEN        0x00000400U
+#define UART_PARITY_ODD         0x00000600U
+#define UART_OVERSAMPLING_16    0x00000000U
+#define UART_OVERSAMPLING_8     0x00008000U
+#define UART_MODE_TX_RX         0x0000000CU
+#define UART_HWCONTROL_NONE     0x00000000U
+
+#define USART_ISR_PE            0x00000001U
+#define USART_ISR_FE            0x00000002U
+#define USART_ISR_NE            0x00000004U
+#define USART_ISR_ORE           0x00000008U
+
+#define HAL_UART_ERROR_NONE     0x00000000U
+#define HAL_UART_ERROR_DMA      0x00000010U
+
+#define UART_INSTANCE_LOWPOWER(__HANDLE__)  ((__HANDLE__)->Instance == LPUART1)
+
+#define UART_DIV_LPUART(__PCLK__, __BAUD__) \
+        ((((uint64_t)(__PCLK__) * 256U) + ((uint64_t)(__BAUD__) / 2U)) / (__BAUD__))
+#define UART_DIV_SAMPLING8(__PCLK__, __BAUD__)  ((((__PCLK__) * 2U) + ((__BAUD__) / 2U)) / (__BAUD__))
+#define UART_DIV_SAMPLING16(__PCLK__, __BAUD__) (((__PCLK__) + ((__BAUD__) / 2U)) / (__BAUD__))
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Abort_IT(UART_HandleTypeDef *huart);
@@ -0,0 +1,2 @@
+#pragma once
+/* Not used off-target, included by main.h */
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+
+/* Off-target usbd_conf.h, keep the configuration in line with USB_DEVICE/Target */
+#define USBD_CDC_UART_NUM           ((UART_BRIDGE2 != UART_BRIDGE2_NONE) ? 2 : 1)
+#define COMPOSITE_INTF_NUM          (2 + USBD_CDC_UART_NUM)
+#define USBD_MAX_NUM_INTERFACES     (1U + 2U * (1U + USBD_CDC_UART_NUM))
+#define USBD_MAX_NUM_CONFIGURATION  1U
+#define USBD_MAX_STR_DESC_SIZ       512U
+#define USBD_DEBUG_LEVEL            0U
+#define USBD_SELF_POWERED           1U
+#define DEVICE_FS                   0
+
+#define USBD_UsrLog(...)
+#define USBD_ErrLog(...)
+#define USBD_DbgLog(...)
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""
+Decode ictrl console stream with binary records.
+
+Text passes through as is. Log records of ICTRL_LOG_BINARY firmware (see
+ictrl_log_hdr_t in cdc_ictrl.h) are rebuilt from the format strings of
+the .ictrl_log section of the firmware ELF. imon samples streamed by
+"imon stream on" (see imon_rec_t in imon.h) are printed, or written to
+a CSV file with --imon. RPC responses (see ictrl_rpc.h) are summarized.
+
+    ictrl_log_decode.py firmware.elf /dev/ttyACM1
+    ictrl_log_decode.py --imon samples.csv firmware.elf capture.bin
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+LOG_MAGIC = 0xF5
+HDR = struct.Struct('<BBHI')
+
+IMON_MAGIC = 0xF6
+IMON_REC = struct.Struct('<BBHhHhh')
+
+RPC_RESP_MAGIC = 0xF8
+RPC_HDR = struct.Struct('<BBHBBH')
+
+
+def load_section(elf_path, name):
+    """Raw content of the named section of a 32 bit little endian ELF"""
+    with open(elf_path, 'rb') as f:
+        elf = f.read()
+
+    if elf[:4] != b'\x7fELF' or elf[4] != 1 or elf[5] != 1:
+        raise SystemExit('%s: not a 32 bit little endian ELF' % elf_path)
+
+    shoff, = struct.unpack_from('<I', elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from('<HHH', elf, 0x2E)
+
+    def shdr(i):
+        # name, type, flags, addr, offset, size
+        return struct.unpack_from('<IIIIII', elf, shoff + i * shentsize)
+
+    strtab = shdr(shstrndx)
+    for i in range(shnum):
+        sh = shdr(i)
+        end = elf.index(b'\0', strtab[4] + sh[0])
+        if elf[strtab[4] + sh[0]:end].decode() == name:
+            return elf[sh[4]:sh[4] + sh[5]]
+
+    # Text logging firmware, only imon records might show up
+    return b''
+
+
+def c_format(fmt, args):
+    """printf of 32 bit integer arguments"""
+    it = iter(args)
+
+    def conv(m):
+        if m.group(0) == '%%':
+            return '%'
+        spec = re.sub(r'[hlLqjzt]', '', m.group(0))
+        val = next(it, 0)
+        if spec[-1] in 'di':
+            val = val - (1 << 32) if val & 0x80000000 else val
+        elif spec[-1] == 'p':
+            spec = spec[:-1] + '#x'
+        elif spec[-1] == 'u':
+            spec = spec[:-1] + 'd'
+        return spec % val
+
+    return re.sub(r'%%|%[-+ #0]*\d*(?:\.\d+)?[hlLqjzt]*[diouxXcp]', conv, fmt)
+
+
+class ImonSink:
+    """imon samples, sequence gaps are reported as lost records"""
+
+    def __init__(self, out, csv):
+        self.out = out
+        self.csv = csv
+        self.seq = None
+        self.lost = 0
+        if csv:
+            csv.write('seq,temp_degc,vref_mv,ts_raw,vrefint_raw\n')
+
+    def put(self, rec):
+        _, _, seq, temp, vref, ts_raw, vrefint_raw = IMON_REC.unpack_from(rec)
+        if self.seq is not None and seq != (self.seq + 1) & 0xFFFF:
+            self.lost += (seq - self.seq - 1) & 0xFFFF
+            self.out.write('[imon %d records lost]\n' % ((seq - self.seq - 1) & 0xFFFF))
+        self.seq = seq
+
+        if self.csv:
+            self.csv.write('%u,%d,%u,%d,%d\n' % (seq, temp, vref, ts_raw, vrefint_raw))
+        else:
+            self.out.write('imon %u %dC %umV\n' % (seq, temp, vref))
+
+
+def decode(strings, stream, out, imon):
+    magics = (LOG_MAGIC, IMON_MAGIC, RPC_RESP_MAGIC)
+    buf = b''
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            break
+        buf += chunk
+
+        while buf:
+            if buf[0] not in magics:
+                text_end = min([i for i in (buf.find(bytes([m])) for m in magics) if i >= 0] or [len(buf)])
+                out.write(buf[:text_end].decode('latin-1'))
+                buf = buf[text_end:]
+                continue
+
+            if buf[0] == RPC_RESP_MAGIC:
+                if len(buf) < RPC_HDR.size or len(buf) < RPC_HDR.size + RPC_HDR.unpack_from(buf)[5] + 2:
+                    break
+                _, op, rid, status, _, plen = RPC_HDR.unpack_from(buf)
+                out.write('[rpc id %u op %u status %u, %u bytes]\n' % (rid, op, status, plen))
+                buf = buf[RPC_HDR.size + plen + 2:]
+                continue
+
+            if buf[0] == IMON_MAGIC:
+                # Length byte keeps older decoders in sync if fields are added
+                if len(buf) < 2 or len(buf) < max(buf[1], IMON_REC.size):
+                    break
+                imon.put(buf)
+                buf = buf[max(buf[1], IMON_REC.size):]
+                continue
+
+            if len(buf) < HDR.size or len(buf) < HDR.size + 4 * buf[1]:
+                break
+
+            _, nargs, sid, ts_ms = HDR.unpack_from(buf)
+            args = struct.unpack_from('<%dI' % nargs, buf, HDR.size)
+            buf = buf[HDR.size + 4 * nargs:]
+
+            end = strings.find(b'\0', sid)
+            fmt = strings[sid:end].decode('latin-1') if 0 <= sid < end else '<bad id %d>' % sid
+            out.write('[%u.%03u] %s' % (ts_ms // 1000, ts_ms % 1000, c_format(fmt, args)))
+
+        out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--imon', metavar='CSV', help='write imon samples to the file')
+    parser.add_argument('elf')
+    parser.add_argument('stream')
+    args = parser.parse_args()
+
+    strings = load_section(args.elf, '.ictrl_log')
+    csv = open(args.imon, 'w') if args.imon else None
+    imon = ImonSink(sys.stdout, csv)
+    try:
+        with open(args.stream, 'rb', buffering=0) as stream:
+            decode(strings, stream, sys.stdout, imon)
+    finally:
+        if csv:
+            csv.close()
+            sys.stderr.write('%s: %d samples lost\n' % (args.imon, imon.lost))
+
+
+if __name__ == '__main__':
+    main()
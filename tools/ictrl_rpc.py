@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""
+Binary RPC client for the ictrl console, see USB_DEVICE/App/ictrl_rpc.h.
+
+Console text, log and imon records arriving in between are skipped.
+
+    ictrl_rpc.py /dev/ttyACM1 ping
+    ictrl_rpc.py /dev/ttyACM1 cmd "uart 0"
+    ictrl_rpc.py /dev/ttyACM1 stat
+"""
+
+import os
+import struct
+import sys
+import termios
+import time
+import tty
+
+REQ_MAGIC = 0xF7
+RESP_MAGIC = 0xF8
+LOG_MAGIC = 0xF5
+IMON_MAGIC = 0xF6
+LOG_HDR_LEN = 8
+
+HDR = struct.Struct('<BBHBBH')
+
+OP_PING, OP_CMD, OP_STAT, OP_STAT_NAMES = range(4)
+STATUS = ['ok', 'bad crc', 'bad op', 'bad length', 'unknown command', 'usage', 'cut']
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT-FALSE"""
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+class RpcError(Exception):
+    pass
+
+
+class Ictrl:
+    def __init__(self, port, timeout=1.0):
+        """port is a device path or an open file descriptor"""
+        self.fd = port if isinstance(port, int) else os.open(port, os.O_RDWR | os.O_NOCTTY)
+        if os.isatty(self.fd):
+            tty.setraw(self.fd)
+            termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.timeout = timeout
+        self.buf = b''
+        self.next_id = 0
+        self.done = {}
+
+    def send(self, op, payload=b''):
+        """Pipelined requests are fine, returns the request id"""
+        rid = self.next_id
+        self.next_id = (self.next_id + 1) & 0xFFFF
+        frame = HDR.pack(REQ_MAGIC, op, rid, 0, 0, len(payload)) + payload
+        os.write(self.fd, frame + struct.pack('<H', crc16(frame)))
+        return rid
+
+    def _frame(self):
+        """Next response out of the buffer, None if incomplete"""
+        while self.buf:
+            b = self.buf[0]
+            if b == RESP_MAGIC:
+                if len(self.buf) < HDR.size:
+                    return None
+                _, op, rid, status, _, plen = HDR.unpack_from(self.buf)
+                flen = HDR.size + plen + 2
+                if len(self.buf) < flen:
+                    return None
+                frame, self.buf = self.buf[:flen], self.buf[flen:]
+                crc, = struct.unpack_from('<H', frame, flen - 2)
+                if crc != crc16(frame[:-2]):
+                    continue
+                return rid, op, status, frame[HDR.size:-2]
+            elif b == LOG_MAGIC:
+                if len(self.buf) < 2 or len(self.buf) < LOG_HDR_LEN + 4 * self.buf[1]:
+                    return None
+                self.buf = self.buf[LOG_HDR_LEN + 4 * self.buf[1]:]
+            elif b == IMON_MAGIC:
+                if len(self.buf) < 2 or len(self.buf) < self.buf[1]:
+                    return None
+                self.buf = self.buf[max(self.buf[1], 2):]
+            else:
+                self.buf = self.buf[1:]
+        return None
+
+    def wait(self, rid):
+        """Response of the request, (op, status, payload)"""
+        deadline = time.monotonic() + self.timeout
+        while rid not in self.done:
+            resp = self._frame()
+            if resp:
+                self.done[resp[0]] = resp[1:]
+                continue
+            if time.monotonic() > deadline:
+                raise RpcError('request %d timed out' % rid)
+            self.buf += os.read(self.fd, 512)
+        return self.done.pop(rid)
+
+    def call(self, op, payload=b''):
+        _, status, data = self.wait(self.send(op, payload))
+        if status not in (0, 5, 6):
+            raise RpcError(STATUS[status] if status < len(STATUS) else 'status %d' % status)
+        return status, data
+
+    def ping(self, data=b'ping'):
+        return self.call(OP_PING, data)[1] == data
+
+    def cmd(self, line):
+        status, data = self.call(OP_CMD, line.encode())
+        return STATUS[status], data.decode('latin-1')
+
+    def _paged(self, op):
+        items, first = [], 0
+        while True:
+            _, data = self.call(op, struct.pack('<H', first))
+            total, _ = struct.unpack_from('<HH', data)
+            if op == OP_STAT:
+                page = list(struct.unpack_from('<%dI' % ((len(data) - 4) // 4), data, 4))
+            else:
+                page = [s.decode() for s in data[4:].split(b'\0')[:-1]]
+            items += page
+            first += len(page)
+            if first >= total or not page:
+                return items
+
+    def stat(self):
+        """Counter values by "group.name", names are fetched once"""
+        if not hasattr(self, 'names'):
+            self.names = self._paged(OP_STAT_NAMES)
+        return dict(zip(self.names, self._paged(OP_STAT)))
+
+
+def main():
+    if len(sys.argv) < 3:
+        raise SystemExit(__doc__)
+
+    ictrl = Ictrl(sys.argv[1])
+    what = sys.argv[2]
+    if what == 'ping':
+        print('ok' if ictrl.ping() else 'mismatch')
+    elif what == 'cmd':
+        status, text = ictrl.cmd(' '.join(sys.argv[3:]))
+        sys.stdout.write(text)
+        if status != 'ok':
+            print('[%s]' % status)
+    elif what == 'stat':
+        for name, val in ictrl.stat().items():
+            print('%s=%u' % (name, val))
+    else:
+        raise SystemExit(__doc__)
+
+
+if __name__ == '__main__':
+    main()
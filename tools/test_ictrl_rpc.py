@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+ictrl_rpc.py against the host build of the device side over a pty,
+see tools/host.
+
+    make -C tools/host check
+    test_ictrl_rpc.py tools/host/build/ictrl_rpc_host
+"""
+
+import os
+import struct
+import subprocess
+import sys
+import time
+import tty
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import ictrl_rpc  # noqa: E402
+from ictrl_rpc import Ictrl, RpcError  # noqa: E402
+
+HARNESS = None
+
+
+class Harness:
+    """Device side on the pty slave, the client takes the master"""
+
+    def __init__(self, *args):
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        self.proc = subprocess.Popen([HARNESS] + list(args), stdin=slave, stdout=slave, close_fds=True)
+        os.close(slave)
+        self.ictrl = Ictrl(master)
+
+    def close(self):
+        self.proc.kill()
+        self.proc.wait()
+        os.close(self.ictrl.fd)
+
+
+class RpcTest(unittest.TestCase):
+    args = ()
+
+    def setUp(self):
+        self.harness = Harness(*self.args)
+        self.ictrl = self.harness.ictrl
+
+    def tearDown(self):
+        self.harness.close()
+
+    def raw(self, frame):
+        """Request sent as is, returns (status, payload) of its response"""
+        rid = struct.unpack_from('<H', frame, 2)[0]
+        os.write(self.ictrl.fd, frame)
+        _, status, data = self.ictrl.wait(rid)
+        return status, data
+
+    def frame(self, op, payload, rid=0x1234):
+        hdr = ictrl_rpc.HDR.pack(ictrl_rpc.REQ_MAGIC, op, rid, 0, 0, len(payload)) + payload
+        return hdr + struct.pack('<H', ictrl_rpc.crc16(hdr))
+
+
+class Basic(RpcTest):
+    def test_ping(self):
+        for size in (0, 1, 7, 80):
+            self.assertTrue(self.ictrl.ping(bytes(range(size))))
+
+    def test_ping_too_long(self):
+        with self.assertRaisesRegex(RpcError, 'bad length'):
+            self.ictrl.ping(bytes(81))
+
+    def test_bad_crc(self):
+        frame = bytearray(self.frame(ictrl_rpc.OP_PING, b'abc'))
+        frame[-1] ^= 0x55
+        self.assertEqual(self.raw(bytes(frame))[0], 1)
+
+    def test_bad_op(self):
+        self.assertEqual(self.raw(self.frame(0x7F, b''))[0], 2)
+
+    def test_cmd(self):
+        self.assertEqual(self.ictrl.cmd('echo one  two'), ('ok', 'one two\r\n'))
+
+    def test_cmd_unknown(self):
+        with self.assertRaisesRegex(RpcError, 'unknown command'):
+            self.ictrl.cmd('nope')
+
+    def test_cmd_usage(self):
+        status, text = self.ictrl.cmd('echo')
+        self.assertEqual(status, 'usage')
+        self.assertIn('<word>', text)
+
+    def test_cmd_cut(self):
+        status, text = self.ictrl.cmd('lines')
+        self.assertEqual(status, 'cut')
+        self.assertEqual(len(text), 240)
+        self.assertTrue(text.startswith('line  0 of'))
+
+    def test_stat_paged(self):
+        stat = self.ictrl.stat()
+        self.assertEqual(stat['host.counter_00'], 0)
+        self.assertEqual(stat['host.counter_47'], 0x2F00002F)
+        self.assertEqual(len([n for n in stat if n.startswith('host.')]), 48)
+        self.assertGreaterEqual(stat['rpc.req_cnt'], 1)
+
+    def test_pipelined(self):
+        rids = [self.ictrl.send(ictrl_rpc.OP_PING, b'%d' % i) for i in range(40)]
+        for i, rid in enumerate(rids):
+            self.assertEqual(self.ictrl.wait(rid), (ictrl_rpc.OP_PING, 0, b'%d' % i))
+
+    def test_console_text(self):
+        """Text in between the frames is the console's, log records are skipped"""
+        os.write(self.ictrl.fd, b'help\r' + self.frame(ictrl_rpc.OP_PING, b'x') + b'\x1b[A')
+        self.assertEqual(self.ictrl.wait(0x1234), (ictrl_rpc.OP_PING, 0, b'x'))
+        self.assertTrue(self.ictrl.ping())
+
+    def test_timeout(self):
+        os.write(self.ictrl.fd, self.frame(ictrl_rpc.OP_PING, b'abcd')[:5])
+        time.sleep(0.3)
+        self.assertTrue(self.ictrl.ping())
+        self.assertEqual(self.ictrl.stat()['rpc.timeout_cnt'], 1)
+
+
+class Held(RpcTest):
+    """Output room is short at times, responses wait for it"""
+    args = ('-t',)
+
+    def test_pipelined(self):
+        rids = [self.ictrl.send(ictrl_rpc.OP_CMD, b'echo %d' % i) for i in range(20)]
+        for i, rid in enumerate(rids):
+            self.assertEqual(self.ictrl.wait(rid), (ictrl_rpc.OP_CMD, 0, b'%d\r\n' % i))
+        self.assertGreater(self.ictrl.stat()['rpc.held_cnt'], 0)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        raise SystemExit(__doc__)
+    HARNESS = os.path.abspath(sys.argv.pop(1))
+    unittest.main()